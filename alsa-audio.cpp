@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <alsa/asoundlib.h>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "alsa-audio.h"
+#include "sound.h"
+
+
+audio_backend_alsa::audio_backend_alsa(sound_parameters *const sp, const std::string & device) :
+	audio_backend(sp),
+	device(device)
+{
+}
+
+audio_backend_alsa::~audio_backend_alsa()
+{
+	end();
+}
+
+std::string audio_backend_alsa::get_name() const
+{
+	if (opened_device.empty())
+		return "alsa " + device;
+	return "alsa " + opened_device + " (" + snd_pcm_format_name(format) + ")";
+}
+
+// the mix is in doubles; raw hw: devices often only take 16 or 32 bit integers
+static const snd_pcm_format_t formats[] = { SND_PCM_FORMAT_FLOAT64, SND_PCM_FORMAT_S32, SND_PCM_FORMAT_S16 };
+
+bool audio_backend_alsa::open_device(const std::string & name)
+{
+	int err = snd_pcm_open(&pcm, name.c_str(), SND_PCM_STREAM_PLAYBACK, 0);
+	if (err < 0) {
+		fprintf(stderr, "Cannot open alsa device %s: %s\n", name.c_str(), snd_strerror(err));
+		pcm = nullptr;
+		return false;
+	}
+
+	// alsa buffers 2 periods
+	for(auto f: formats) {
+		err = snd_pcm_set_params(pcm, f, SND_PCM_ACCESS_RW_INTERLEAVED, sp->n_channels, sp->sample_rate, 1,
+				2 * sp->period_size * 1000000ll / sp->sample_rate);
+		if (err == 0) {
+			format        = f;
+			opened_device = name;
+			return true;
+		}
+	}
+
+	fprintf(stderr, "Cannot configure alsa device %s: %s\n", name.c_str(), snd_strerror(err));
+	snd_pcm_close(pcm);
+	pcm = nullptr;
+
+	return false;
+}
+
+bool audio_backend_alsa::begin()
+{
+	bool ok = open_device(device);
+	// the plug-layer converts sample rate and channel count too
+	if (!ok && device.substr(0, 3) == "hw:") {
+		printf("Retrying with alsa device plug%s\n", device.c_str());
+		ok = open_device("plug" + device);
+	}
+	if (!ok)
+		return false;
+
+	snd_pcm_uframes_t buffer_frames = 0;
+	snd_pcm_uframes_t period_frames = 0;
+	if (snd_pcm_get_params(pcm, &buffer_frames, &period_frames) == 0)
+		sp->latency_frames = buffer_frames;
+	else
+		sp->latency_frames = 2 * sp->period_size;
+
+	th = new std::thread(&audio_backend_alsa::run, this);
+	return true;
+}
+
+void audio_backend_alsa::end()
+{
+	if (th) {
+		stop_flag = true;
+		th->join();
+		delete th;
+		th = nullptr;
+	}
+
+	if (pcm) {
+		snd_pcm_drain(pcm);
+		snd_pcm_close(pcm);
+		pcm = nullptr;
+	}
+}
+
+static void convert_to_format(const double *const in, const size_t n, const snd_pcm_format_t format, uint8_t *const out)
+{
+	if (format == SND_PCM_FORMAT_S32) {
+		int32_t *o = reinterpret_cast<int32_t *>(out);
+		for(size_t i=0; i<n; i++)
+			o[i] = int32_t(std::clamp(in[i], -1., 1.) * 2147483647.);
+	}
+	else if (format == SND_PCM_FORMAT_S16) {
+		int16_t *o = reinterpret_cast<int16_t *>(out);
+		for(size_t i=0; i<n; i++)
+			o[i] = int16_t(std::clamp(in[i], -1., 1.) * 32767.);
+	}
+}
+
+void audio_backend_alsa::run()
+{
+	configure_thread();
+
+	const int period_size = sp->period_size;
+	const int n_samples   = period_size * sp->n_channels;
+	double   *buffer      = new double[n_samples];
+	// float64 is written as is, the integer formats are converted into this one
+	uint8_t  *converted   = format == SND_PCM_FORMAT_FLOAT64 ? reinterpret_cast<uint8_t *>(buffer) : new uint8_t[snd_pcm_frames_to_bytes(pcm, period_size)];
+
+	while(!stop_flag) {
+		render_audio(sp, buffer, period_size);
+		convert_to_format(buffer, n_samples, format, converted);
+
+		snd_pcm_sframes_t n_written = 0;
+		while(n_written < period_size && !stop_flag) {
+			snd_pcm_sframes_t rc = snd_pcm_writei(pcm, &converted[snd_pcm_frames_to_bytes(pcm, n_written)], period_size - n_written);
+			if (rc < 0) {
+				rc = snd_pcm_recover(pcm, rc, 1);
+				if (rc < 0) {
+					fprintf(stderr, "alsa write to %s failed: %s\n", opened_device.c_str(), snd_strerror(rc));
+					stop_flag = true;
+				}
+			}
+			else {
+				n_written += rc;
+			}
+		}
+	}
+
+	if (converted != reinterpret_cast<uint8_t *>(buffer))
+		delete [] converted;
+	delete [] buffer;
+
+	printf("alsa thread terminating\n");
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <alsa/asoundlib.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "audio-backend.h"
+
+
+// writes directly to an alsa pcm device, for systems without pipewire
+class audio_backend_alsa : public audio_backend
+{
+private:
+	const std::string device;
+	std::string       opened_device;
+	snd_pcm_t        *pcm       { nullptr };
+	snd_pcm_format_t  format    { SND_PCM_FORMAT_UNKNOWN };
+	std::thread      *th        { nullptr };
+	std::atomic_bool  stop_flag { false   };
+
+	bool open_device(const std::string & name);
+	void run();
+
+public:
+	audio_backend_alsa(sound_parameters *const sp, const std::string & device);
+	virtual ~audio_backend_alsa();
+
+	bool        begin() override;
+	void        end()   override;
+	std::string get_name() const override;
+};
@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <ctime>
+#include <sndfile.h>
+#include <string>
+
+#include "alsa-audio.h"
+#include "audio-backend.h"
+#include "pipewire-audio.h"
+#include "sound.h"
+#include "time.h"
+
+
+audio_backend::audio_backend(sound_parameters *const sp) : sp(sp)
+{
+}
+
+audio_backend::~audio_backend()
+{
+}
+
+void audio_backend::configure_thread()
+{
+	if (thread_configured)
+		return;
+	thread_configured = true;
+
+	if (rt.policy != SCHED_OTHER)
+		printf("%s\n", set_thread_realtime("audio thread", rt.policy, rt.priority).c_str());
+	if (rt.audio_cpu.has_value())
+		printf("%s\n", set_thread_cpu("audio thread", rt.audio_cpu.value()).c_str());
+}
+
+audio_backend_null::audio_backend_null(sound_parameters *const sp, const std::string & file_name, const bool as_fast_as_possible) :
+	audio_backend(sp),
+	file_name(file_name),
+	as_fast_as_possible(as_fast_as_possible)
+{
+}
+
+audio_backend_null::~audio_backend_null()
+{
+	end();
+}
+
+std::string audio_backend_null::get_name() const
+{
+	std::string name = file_name.empty() ? "null" : "file " + file_name;
+	if (as_fast_as_possible)
+		name += " (as fast as possible)";
+	return name;
+}
+
+bool audio_backend_null::begin()
+{
+	th = new std::thread(&audio_backend_null::run, this);
+	return true;
+}
+
+void audio_backend_null::end()
+{
+	if (th) {
+		stop_flag = true;
+		th->join();
+		delete th;
+		th = nullptr;
+	}
+}
+
+void audio_backend_null::run()
+{
+	configure_thread();
+
+	SNDFILE *fh = nullptr;
+	if (file_name.empty() == false) {
+		SF_INFO si { };
+		si.samplerate = sp->sample_rate;
+		si.channels   = sp->n_channels;
+		si.format     = SF_FORMAT_WAV | SF_FORMAT_PCM_24;
+		fh = sf_open(file_name.c_str(), SFM_WRITE, &si);
+		if (!fh)
+			fprintf(stderr, "Cannot create %s: %s\n", file_name.c_str(), sf_strerror(nullptr));
+	}
+
+	const int period_size = sp->period_size;
+	double   *buffer      = new double[period_size * sp->n_channels];
+	uint64_t  n_periods   = 0;
+	uint64_t  start_t     = get_us();
+
+	timespec  next { };
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while(!stop_flag) {
+		render_audio(sp, buffer, period_size);
+		n_periods++;
+
+		if (fh)
+			sf_writef_double(fh, buffer, period_size);
+
+		if (!as_fast_as_possible) {
+			next.tv_nsec += 1000000000ll * period_size / sp->sample_rate;
+			while(next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+		}
+	}
+
+	uint64_t took = get_us() - start_t;
+	double   rendered_us = n_periods * period_size * 1000000. / sp->sample_rate;
+	printf("%s: rendered %.3f seconds of audio in %.3f seconds (%.1fx realtime)\n", get_name().c_str(),
+			rendered_us / 1000000., took / 1000000., took ? rendered_us / took : 0.);
+
+	delete [] buffer;
+
+	if (fh)
+		sf_close(fh);
+}
+
+audio_backend *create_audio_backend(const std::string & name, sound_parameters *const sp)
+{
+	if (name == "pipewire")
+		return new audio_backend_pipewire(sp);
+
+	if (name == "alsa")
+		return new audio_backend_alsa(sp, "default");
+	if (name.substr(0, 5) == "alsa:")
+		return new audio_backend_alsa(sp, name.substr(5));
+
+	if (name == "null")
+		return new audio_backend_null(sp, "", false);
+	if (name == "null-fast")
+		return new audio_backend_null(sp, "", true);
+	if (name.substr(0, 5) == "file:")
+		return new audio_backend_null(sp, name.substr(5), false);
+	if (name.substr(0, 10) == "file-fast:")
+		return new audio_backend_null(sp, name.substr(10), true);
+
+	return nullptr;
+}
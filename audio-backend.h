@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "realtime.h"
+
+
+class sound_parameters;
+
+// something that pulls the mixed audio (see render_audio()) out of the sound_parameters
+class audio_backend
+{
+protected:
+	sound_parameters *const sp;
+	realtime_settings       rt;
+	bool                    thread_configured { false };
+
+	// called from the audio thread, only by backends that started it themselves (before it renders anything)
+	void configure_thread();
+
+public:
+	audio_backend(sound_parameters *const sp);
+	virtual ~audio_backend();
+
+	void set_realtime_settings(const realtime_settings & rt_in) { rt = rt_in; }
+
+	virtual bool        begin() = 0;
+	virtual void        end()   = 0;
+	virtual std::string get_name() const = 0;
+};
+
+// no audio device: renders on a timer (as if it were a sound card) or as fast as possible
+// optionally writes the result to a .wav-file
+class audio_backend_null : public audio_backend
+{
+private:
+	const std::string file_name;
+	const bool        as_fast_as_possible { false };
+	std::thread      *th                  { nullptr };
+	std::atomic_bool  stop_flag           { false   };
+
+	void run();
+
+public:
+	audio_backend_null(sound_parameters *const sp, const std::string & file_name, const bool as_fast_as_possible);
+	virtual ~audio_backend_null();
+
+	bool        begin() override;
+	void        end()   override;
+	std::string get_name() const override;
+};
+
+// "pipewire" (default), "alsa" or "alsa:<device>", "null", "null-fast", "file:<name.wav>" or "file-fast:<name.wav>"
+audio_backend *create_audio_backend(const std::string & name, sound_parameters *const sp);
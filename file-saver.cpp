@@ -0,0 +1,73 @@
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "file-saver.h"
+#include "io.h"
+
+
+file_saver::file_saver()
+{
+	th = new std::thread(&file_saver::run, this);
+}
+
+file_saver::~file_saver()
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		stop_flag = true;
+		cv.notify_all();
+	}
+
+	th->join();
+	delete th;
+}
+
+void file_saver::save(const std::string & file_name, file_snapshot && snapshot, const file_format format)
+{
+	std::unique_lock<std::mutex> lck(lock);
+	jobs.push_back({ file_name, std::move(snapshot), format });
+	cv.notify_all();
+}
+
+std::pair<std::string, double> file_saver::get_progress()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	return { current, progress };
+}
+
+std::optional<std::pair<std::string, bool> > file_saver::get_result()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	if (results.empty())
+		return { };
+
+	auto result = results.front();
+	results.pop_front();
+	return result;
+}
+
+void file_saver::run()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(;;) {
+		cv.wait(lck, [this] { return stop_flag || jobs.empty() == false; });
+		if (jobs.empty())  // stop_flag is only looked at when everything has been written
+			break;
+
+		job j = std::move(jobs.front());
+		jobs.pop_front();
+		current  = j.file_name;
+		progress = 0.;
+
+		lck.unlock();
+		bool ok = write_file(j.file_name, j.snapshot, j.format, &progress);
+		lck.lock();
+
+		current.clear();
+		results.push_back({ j.file_name, ok });
+	}
+}
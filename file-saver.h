@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "io.h"
+
+
+// writes .kaboem-files on a thread of its own, so that the gui and the sequencer do not wait for it.
+// the caller hands over a snapshot; editing can go on immediately.
+class file_saver
+{
+private:
+	struct job
+	{
+		std::string   file_name;
+		file_snapshot snapshot;
+		file_format   format;
+	};
+
+	std::thread                *th        { nullptr };
+	std::mutex                  lock;
+	std::condition_variable     cv;
+	std::deque<job>             jobs;
+	bool                        stop_flag { false };
+	std::string                 current;  // file that is being written
+	std::atomic<double>         progress  { 0. };
+	std::deque<std::pair<std::string, bool> > results;
+
+	void run();
+
+public:
+	file_saver();
+	virtual ~file_saver();  // finishes what was queued
+
+	void save(const std::string & file_name, file_snapshot && snapshot, const file_format format);
+
+	// file that is being written (empty if none) and how far it is (0...1)
+	std::pair<std::string, double> get_progress();
+	// file name and whether it succeeded, for each save that has finished
+	std::optional<std::pair<std::string, bool> > get_result();
+};
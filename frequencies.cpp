@@ -1,21 +1,31 @@
 #include <cmath>
 #include <cstring>
 #include <fftw3.h>
+#include <mutex>
 #include <string>
 
 #include "frequencies.h"
 
 
+// only fftw_execute is thread safe; samples are analyzed on several threads at the same time
+static std::mutex planner_lock;
+
 fft::fft(const int n_samples_in_in, const double *const data)
 {
 	n_samples_in = n_samples_in_in;
 	pin          = data;
-	pout         = reinterpret_cast<fftw_complex *>(fftw_malloc(sizeof(fftw_complex) * n_samples_in + 1));
-	plan         = fftw_plan_dft_r2c_1d(n_samples_in, const_cast<double *>(pin), pout, FFTW_ESTIMATE);
+	pout         = reinterpret_cast<fftw_complex *>(fftw_malloc(sizeof(fftw_complex) * (n_samples_in / 2 + 1)));
+
+	std::lock_guard<std::mutex> lck(planner_lock);
+	plan         = fftw_plan_dft_r2c_1d(n_samples_in, const_cast<double *>(pin), pout, FFTW_ESTIMATE | FFTW_PRESERVE_INPUT);
 }
 
 fft::~fft()
 {
+	{
+		std::lock_guard<std::mutex> lck(planner_lock);
+		fftw_destroy_plan(plan);
+	}
 	fftw_free(pout);
 }
 
@@ -32,12 +42,10 @@ void fft::do_fft(double *o)
 	}
 }
 
+// an out-of-place r2c transform leaves its input alone, so 'in' is used as it is (no copy of the whole sample)
 static void do_fft(const double *const in, const size_t n, double **out, size_t *n_out)
 {
-	double *temp = new double[n];
-	memcpy(temp, in, n * sizeof(double));
-
-	fft f(n, temp);
+	fft f(n, in);
 
 	size_t hn = n / 2 + 1;
 
@@ -45,8 +53,6 @@ static void do_fft(const double *const in, const size_t n, double **out, size_t
 	*n_out = hn;
 
 	f.do_fft(*out);
-
-	delete [] temp;
 }
 
 double find_loudest_freq(const double *const in, const size_t n, const int sample_rate)
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cassert>
@@ -11,15 +12,29 @@
 #include <SDL3/SDL_render.h>
 #include <SDL3_ttf/SDL_ttf.h>
 
+#include "audio-backend.h"
+#include "file-saver.h"
 #include "font.h"
 #include "frequencies.h"
 #include "gui.h"
 #include "io.h"
+#include "journal.h"
 #include "midi.h"
+#include "midi-clock.h"
+#include "midi-input.h"
+#include "pcm-cache.h"
 #include "pipewire.h"
-#include "pipewire-audio.h"
+#include "pipewire-capture.h"
 #include "player.h"
+#include "realtime.h"
+#include "reclaimer.h"
+#include "sequencer.h"
 #include "sample.h"
+#include "sample-loader.h"
+#include "sample-streamer.h"
+#include "scene.h"
+#include "snapshot.h"
+#include "song.h"
 #include "sound.h"
 #include "time.h"
 
@@ -190,13 +205,22 @@ std::vector<clickable> generate_cell_settings_menu_buttons(const int w, const in
 	return clickables;
 }
 
+std::string get_midi_sync_name(const int mode)
+{
+	if (mode == ms_master)
+		return "sync: out";
+	if (mode == ms_slave)
+		return "sync: in";
+	return "sync: off";
+}
+
 std::vector<clickable> generate_settings_menu_buttons(const int w, const int h, size_t *const pattern_load_idx, size_t *const save_idx,
 		size_t *const clear_idx, size_t *const quit_idx, up_down_widget *const bpm_widget_pars, size_t *const record_idx,
 		up_down_widget *const volume_widget_pars, size_t *const pause_idx, up_down_widget *const midi_ch_widget_pars,
 		up_down_widget *const lp_filter_pars, up_down_widget *const hp_filter_pars,
 		up_down_widget *const sound_saturation_pars, size_t *const polyrythmic_idx,
 		up_down_widget *const swing_widget_pars, size_t *const agc_idx, size_t *const clipping_idx, size_t *const scope_idx,
-		size_t *const busyness_idx)
+		size_t *const busyness_idx, size_t *const preload_idx, size_t *const midi_sync_idx)
 {
 	int menu_button_width  = w * 15 / 100;
 	int menu_button_height = h * 15 / 100;
@@ -332,6 +356,24 @@ std::vector<clickable> generate_settings_menu_buttons(const int w, const int h,
 		x += menu_button_width;
 	}
 
+	{
+		clickable c { };
+		c.where          = { x, y + menu_button_height, menu_button_width, menu_button_height };
+		c.text           = "preload";
+		*preload_idx     = clickables.size();
+		clickables.push_back(c);
+		x += menu_button_width;
+	}
+
+	{
+		clickable c { };
+		c.where          = { x, y + menu_button_height, menu_button_width, menu_button_height };
+		c.text           = get_midi_sync_name(ms_none);
+		*midi_sync_idx   = clickables.size();
+		clickables.push_back(c);
+		x += menu_button_width;
+	}
+
 	{
 		clickable c { };
 		c.where          = { menu_button_width * 4, 4 * menu_button_height, int(menu_button_width * 1.9), menu_button_height * 2 };
@@ -343,7 +385,7 @@ std::vector<clickable> generate_settings_menu_buttons(const int w, const int h,
 	return clickables;
 }
 
-std::vector<clickable> generate_sample_buttons(const int w, const int h, size_t *const sample_load_idx, up_down_widget *const vol_widget_left_pars, up_down_widget *const vol_widget_right_pars, up_down_widget *const midi_note_widget_pars, up_down_widget *const n_steps_pars, up_down_widget *const pitch_pars, size_t *const sample_unload_idx, size_t *const mute_idx)
+std::vector<clickable> generate_sample_buttons(const int w, const int h, size_t *const sample_load_idx, up_down_widget *const vol_widget_left_pars, up_down_widget *const vol_widget_right_pars, up_down_widget *const midi_note_widget_pars, up_down_widget *const n_steps_pars, up_down_widget *const pitch_pars, size_t *const sample_unload_idx, size_t *const mute_idx, size_t *const input_idx)
 {
 	int menu_button_width  = w * 15 / 100;
 	int menu_button_height = h * 15 / 100;
@@ -368,7 +410,14 @@ std::vector<clickable> generate_sample_buttons(const int w, const int h, size_t
 		clickables.push_back(c);
 		x += menu_button_width;
 	}
-	x += menu_button_width;
+	{
+		clickable c { };
+		c.where          = { x, y, menu_button_width, menu_button_height };
+		c.text           = "input";
+		*input_idx       = clickables.size();
+		clickables.push_back(c);
+		x += menu_button_width;
+	}
 	x += menu_button_width;
 	{
 		clickable c { };
@@ -397,7 +446,7 @@ std::vector<clickable> generate_sample_buttons(const int w, const int h, size_t
 	return clickables;
 }
 
-pattern generate_pattern_grid(const int w, const int h, const int steps)
+pattern generate_pattern_grid(const int w, const int h, const int steps, const size_t max_steps)
 {
 	int pattern_w   = w * 85 / 100;
 	int pattern_h   = h * 80 / 100;
@@ -408,14 +457,7 @@ pattern generate_pattern_grid(const int w, const int h, const int steps)
 	int step_height = pattern_h / steps_sq;
 
 	pattern p;
-	p.pattern   .resize(max_pattern_dim);
-	p.note_delta.resize(max_pattern_dim);
-	p.dim = steps;
-
-	for(size_t i=0; i<max_pattern_dim; i++) {
-		p.volume_left .push_back(1.);
-		p.volume_right.push_back(1.);
-	}
+	p.pattern.resize(max_steps);
 
 	for(int i=0; i<steps; i++) {
 		int x = (i % steps_sq) * step_width;
@@ -424,13 +466,13 @@ pattern generate_pattern_grid(const int w, const int h, const int steps)
 		c.where            = { x, y, step_width, step_height };
 		c.selected         = false;
 		p.pattern.at(i)    = c;
-		p.note_delta.at(i) = 0;
 	}
 
 	return p;
 }
 
-std::vector<clickable> generate_pattern_menu(const int w, const int h, size_t *const pause_idx, size_t *const restart_idx)
+std::vector<clickable> generate_pattern_menu(const int w, const int h, size_t *const pause_idx, size_t *const restart_idx,
+		size_t *const prev_pattern_idx, size_t *const next_pattern_idx, size_t *const append_idx, size_t *const song_idx)
 {
 	int menu_button_width  = w * 15 / 100;
 	int menu_button_height = h * 15 / 100;
@@ -455,22 +497,53 @@ std::vector<clickable> generate_pattern_menu(const int w, const int h, size_t *c
 		clickables.push_back(c);
 		x += menu_button_width;
 	}
+	{
+		clickable c { };
+		c.where      = { x, y, menu_button_width, menu_button_height };
+		c.text       = "prev pat.";
+		*prev_pattern_idx = clickables.size();
+		clickables.push_back(c);
+		x += menu_button_width;
+	}
+	{
+		clickable c { };
+		c.where      = { x, y, menu_button_width, menu_button_height };
+		c.text       = "next pat.";
+		*next_pattern_idx = clickables.size();
+		clickables.push_back(c);
+		x += menu_button_width;
+	}
+	{
+		clickable c { };
+		c.where      = { x, y, menu_button_width, menu_button_height };
+		c.text       = "append";
+		*append_idx  = clickables.size();
+		clickables.push_back(c);
+		x += menu_button_width;
+	}
+	{
+		clickable c { };
+		c.where      = { x, y, menu_button_width, menu_button_height };
+		c.text       = "song";
+		*song_idx    = clickables.size();
+		clickables.push_back(c);
+		x += menu_button_width;
+	}
 
 	return clickables;
 }
 
-void regenerate_pattern_grid(const int w, const int h, pattern *const p)
+void regenerate_pattern_grid(const int w, const int h, const size_t dim, pattern *const p)
 {
 	int pattern_w   = w * 85 / 100;
 	int pattern_h   = h * 80 / 100;
 	int offset_h    = h * 5 / 100;
 
-	int steps_sq    = ceil(sqrt(p->dim));
-	printf("%zu: %d\n", p->dim, steps_sq);
+	int steps_sq    = ceil(sqrt(dim));
 	int step_width  = pattern_w / steps_sq;
 	int step_height = pattern_h / steps_sq;
 
-	for(size_t i=0; i<p->dim; i++) {
+	for(size_t i=0; i<dim; i++) {
 		int x = (i % steps_sq) * step_width;
 		int y = (i / steps_sq) * step_height + offset_h;
 		p->pattern.at(i).where = { x, y, step_width, step_height };
@@ -563,22 +636,22 @@ void draw_clickables(TTF_Font *const font, SDL_Renderer *const screen, const std
 	}
 }
 
-void set_filter_cutoff(sound_parameters *const sound_pars, filter_butterworth **const p, const bool is_high_pass, const std::optional<double> frequency)
+// the audio thread keeps using the previous filter until the end of its period; it is freed after that
+void set_filter_cutoff(std::atomic<filter_butterworth *> *const p, const bool is_high_pass, const std::optional<double> frequency, reclaimer *const reclaim)
 {
-	std::lock_guard<std::shared_mutex> lck(sound_pars->sounds_lock);
+	filter_butterworth *new_filter = nullptr;
 
 	if (frequency.has_value()) {
-		if (!*p)
-			*p = new filter_butterworth(sample_rate, is_high_pass, sqrt(2.));
-		(*p)->configure(frequency.value());
-	}
-	else {
-		delete *p;
-		*p = nullptr;
+		filter_butterworth *current = p->load();
+		// a copy keeps the history of the current one, so that the change does not click
+		new_filter = current ? new filter_butterworth(*current) : new filter_butterworth(sample_rate, is_high_pass, sqrt(2.));
+		new_filter->configure(frequency.value());
 	}
+
+	reclaim->retire(p->exchange(new_filter));
 }
 
-bool configure_filter(sound_parameters *const sound_pars, const up_down_widget & widget, const size_t widget_idx, const bool is_highpass, std::optional<double> *const f, const bool shift)
+bool configure_filter(sound_parameters *const sound_pars, const up_down_widget & widget, const size_t widget_idx, const bool is_highpass, std::optional<double> *const f, const bool shift, reclaimer *const reclaim)
 {
 	int mul = shift ? 3 : 1;
 
@@ -617,9 +690,9 @@ bool configure_filter(sound_parameters *const sound_pars, const up_down_widget &
 	}
 
 	if (is_highpass)
-		set_filter_cutoff(sound_pars, &sound_pars->filter_hp, is_highpass, *f);
+		set_filter_cutoff(&sound_pars->filter_hp, is_highpass, *f, reclaim);
 	else
-		set_filter_cutoff(sound_pars, &sound_pars->filter_lp, is_highpass, *f);
+		set_filter_cutoff(&sound_pars->filter_lp, is_highpass, *f, reclaim);
 
 	return true;
 }
@@ -721,28 +794,163 @@ bool configure_volume(sound_parameters *const sound_pars, const up_down_widget &
 	return true;
 }
 
-void reset_pattern(std::array<pattern, pattern_groups> *const pat_clickables, const size_t pattern_group, sound_sample *const s, const bool zero)
+// put a new sample in a channel; sounds that are still playing the old one keep doing so
+void swap_sample(sound_parameters *const sound_pars, sample *const s, sound_sample *const new_s, reclaimer *const reclaim)
+{
+	sound_sample *old_s = s->s;
+
+	{
+		std::unique_lock<std::shared_mutex> lck(sound_pars->sounds_lock);
+		s->s = new_s;
+	}
+
+	reclaim->retire(old_s);
+}
+
+std::string get_capture_status(pipewire_capture *const capture)
+{
+	switch(capture->get_state()) {
+		case pipewire_capture::cs_armed:
+			return "input armed";
+		case pipewire_capture::cs_recording:
+		case pipewire_capture::cs_stopping:
+			return "recording " + std::to_string(int(capture->get_recorded_seconds())) + "s";
+		case pipewire_capture::cs_finishing:
+			return "processing input";
+		default:
+			break;
+	}
+
+	return "";
+}
+
+std::string get_scenes_status(const std::vector<scene_loader *> & preloaded, const std::shared_ptr<scene_data> & switching_scene)
+{
+	std::string out = "scenes:";
+
+	for(size_t i=0; i<preloaded.size(); i++) {
+		if (!preloaded[i])
+			continue;
+
+		out += " F" + std::to_string(i + 1) + " " + get_filename(preloaded[i]->get_file_name());
+		if (preloaded[i]->is_finished() == false)
+			out += " (loading)";
+		else if (!preloaded[i]->get())
+			out += " (failed)";
+	}
+
+	if (switching_scene)
+		out += ", switching to " + get_filename(switching_scene->file_name);
+
+	return out;
+}
+
+void reset_pattern(std::vector<pattern> *const pat_clickables, sequencer_data *const sequence, const size_t pattern_group, sound_sample *const s, const bool zero)
 {
 	auto & pattern = (*pat_clickables)[pattern_group];
 
 	for(size_t i=0; i<pattern.pattern.size(); i++) {
 		if (zero) {
-			pattern.note_delta  [i] = 0.;
-			pattern.volume_left [i] = 1.;
-			pattern.volume_right[i] = 1.;
+			sequence->note_delta_at  (pattern_group, i) = 0;
+			sequence->volume_left_at (pattern_group, i) = 1.f;
+			sequence->volume_right_at(pattern_group, i) = 1.f;
 		}
 
-		std::string name = midi_note_to_name(s->get_base_midi_note() + pattern.note_delta[i]);
+		std::string name = midi_note_to_name(s->get_base_midi_note() + sequence->note_delta_at(pattern_group, i));
 		pattern.pattern[i].text = name;
 	}
 }
 
-void reset_all_patterns(std::array<pattern, pattern_groups> *const pat_clickables, std::shared_mutex *const pat_clickables_lock, const std::array<sample, pattern_groups> & samples, const bool zero)
+void reset_all_patterns(std::vector<pattern> *const pat_clickables, sequencer_data *const sequence, const std::vector<sample> & samples, const bool zero)
 {
-	for(size_t i=0; i<pattern_groups; i++) {
+	for(size_t i=0; i<samples.size(); i++) {
 		if (samples[i].s)
-			reset_pattern(pat_clickables, i, samples[i].s, zero);
+			reset_pattern(pat_clickables, sequence, i, samples[i].s, zero);
+	}
+}
+
+// returns the new note delta
+int change_note_delta(sequencer_data *const sequence, const size_t pattern_group, const size_t step, const int change)
+{
+	int8_t & note_delta = sequence->note_delta_at(pattern_group, step);
+	note_delta = std::clamp(note_delta + change, -127, 127);
+	return note_delta;
+}
+
+void publish_patterns(snapshot<sequencer_data> *const pattern_snapshot, sequencer_data *const sequence, const std::vector<sample> & samples)
+{
+	for(size_t i=0; i<samples.size(); i++)
+		sequence->enabled[i] = samples[i].s != nullptr;
+	sequence->update_active();
+
+	pattern_snapshot->publish(*sequence);
+}
+
+// store the pattern that is being edited in the song and continue with another (or a new, empty one)
+void switch_song_pattern(song_data *const song, sequencer_data *const sequence, const size_t new_pattern)
+{
+	song->patterns[song->current] = *sequence;
+
+	if (new_pattern >= song->patterns.size()) {
+		sequencer_data empty = *sequence;
+		for(size_t g=0; g<empty.n_groups; g++)
+			empty.clear(g);
+		song->patterns.push_back(empty);
+	}
+
+	song->current = std::min(new_pattern, song->patterns.size() - 1);
+	*sequence     = song->patterns[song->current];
+}
+
+// the compiled song follows the edits: only what changed is recompiled
+void update_song_timeline(song_data *const song, song_timeline *const timeline, snapshot<song_timeline> *const song_snapshot, const sequencer_data & sequence,
+		const int step_ms, const bool polyrythmic, const int swing_ms, std::vector<uint8_t> *const compiled_enabled, const bool patterns_changed)
+{
+	if (patterns_changed)
+		song->patterns[song->current] = sequence;
+
+	if (timeline->set_timing(sample_rate, step_ms, polyrythmic, swing_ms) || *compiled_enabled != sequence.enabled) {
+		*compiled_enabled = sequence.enabled;
+		timeline->compile(*song, *compiled_enabled);
+	}
+	else if (patterns_changed) {
+		timeline->recompile_pattern(*song, song->current, *compiled_enabled);
+	}
+	else {
+		song_snapshot->collect();
+		return;
+	}
+
+	song_snapshot->publish(*timeline);
+}
+
+std::string get_song_info(const song_data & song, const std::optional<size_t> playing_segment)
+{
+	std::string out = "pattern " + std::to_string(song.current + 1) + "/" + std::to_string(song.patterns.size());
+	if (song.arrangement.empty())
+		return out;
+
+	out += ", song:";
+	for(size_t i=0; i<song.arrangement.size(); i++) {
+		if (i == 24) {
+			out += " ...";
+			break;
+		}
+		std::string nr = std::to_string(song.arrangement[i] + 1);
+		if (playing_segment.has_value() && playing_segment.value() == i)
+			out += " [" + nr + "]";
+		else
+			out += " " + nr;
 	}
+
+	return out;
+}
+
+// the grid only shows what is in the sequencer data
+void sync_pattern_grid(pattern *const p, const sequencer_data & sequence, const size_t pattern_group)
+{
+	for(size_t i=0; i<sequence.dim[pattern_group]; i++)
+		p->pattern[i].selected = sequence.is_set(pattern_group, i);
 }
 
 void draw_message(TTF_Font *const font, SDL_Renderer *const screen, const SDL_DisplayMode *const display_mode, const std::string & message, const uint8_t r, const uint8_t g, const uint8_t b)
@@ -847,26 +1055,165 @@ int main(int argc, char *argv[])
 	init_pipewire(&pw_argc, &argv);
 
 	bool full_screen = true;
+	int  n_channels  = 2;
+	bool stems       = false;
+	std::string backend_name = "pipewire";
+	realtime_settings rt { };
+	bool lock_mem    = false;
+	size_t n_groups  = default_pattern_groups;
+	size_t max_steps = default_max_pattern_dim;
+	size_t benchmark = 0;  // run the sequencer benchmark up to this many pattern groups
+	int    period_ms = 0;  // 0: the default of 1/75th of a second
+	file_format save_format = ff_binary;
+	std::string benchmark_file;  // time loading and saving this file
 
 	int c = -1;
-	while((c = getopt(argc, argv, "-w")) != -1) {
+	while((c = getopt(argc, argv, "-wc:sb:r:Ra:q:mPt:S:B:l:zT:C:NL:")) != -1) {
 		if (c == 'w')
 			full_screen = false;
+		else if (c == 's')
+			stems = true;
+		else if (c == 'b')
+			backend_name = optarg;
+		else if (c == 'r') {
+			if (rt.policy == SCHED_OTHER)
+				rt.policy = SCHED_FIFO;
+			rt.priority = atoi(optarg);
+			if (rt.priority < 1 || rt.priority > 99) {
+				fprintf(stderr, "Realtime priority must be between 1 and 99\n");
+				return 1;
+			}
+		}
+		else if (c == 'R')
+			rt.policy = SCHED_RR;
+		else if (c == 'a')
+			rt.audio_cpu = atoi(optarg);
+		else if (c == 'q')
+			rt.sequencer_cpu = atoi(optarg);
+		else if (c == 'm')
+			lock_mem = true;
+		else if (c == 'P')
+			set_prefault(true);
+		else if (c == 't') {
+			n_groups = atoi(optarg);
+			if (n_groups < 1 || n_groups > 256) {
+				fprintf(stderr, "Number of pattern groups must be between 1 and 256\n");
+				return 1;
+			}
+		}
+		else if (c == 'S') {
+			max_steps = atoi(optarg);
+			if (max_steps < 16 || max_steps > 1024) {
+				fprintf(stderr, "Maximum number of steps must be between 16 and 1024\n");
+				return 1;
+			}
+		}
+		else if (c == 'B')
+			benchmark = std::max(8, atoi(optarg));
+		else if (c == 'z')
+			save_format = ff_binary_flac;
+		else if (c == 'T')
+			benchmark_file = optarg;
+		else if (c == 'N')
+			set_pcm_cache(false);
+		else if (c == 'L') {
+			double seconds = atof(optarg);
+			if (seconds <= 0.) {
+				fprintf(stderr, "Samples to stream must be longer than 0 seconds\n");
+				return 1;
+			}
+			set_stream_threshold(seconds);
+		}
+		else if (c == 'C') {
+			int megabytes = atoi(optarg);
+			if (megabytes < 0) {
+				fprintf(stderr, "Sample cache size cannot be negative\n");
+				return 1;
+			}
+			set_sample_cache_budget(size_t(megabytes) * 1024 * 1024);
+		}
+		else if (c == 'l') {
+			period_ms = atoi(optarg);
+			if (period_ms < 1 || period_ms > 100) {
+				fprintf(stderr, "Audio period must be between 1 and 100 ms\n");
+				return 1;
+			}
+		}
+		else if (c == 'c') {
+			n_channels = atoi(optarg);
+			if (n_channels < 1 || n_channels > int(max_output_channels)) {
+				fprintf(stderr, "Number of output channels must be between 1 and %zu\n", max_output_channels);
+				return 1;
+			}
+		}
 		else {
 			fprintf(stderr, "\"-%c\" is not understood\n", c);
 			return 1;
 		}
 	}
 
-	sound_parameters sound_pars(sample_rate, 2);
-	configure_pipewire_audio(&sound_pars);
-	sound_pars.global_volume = 1.;
+	if (benchmark) {
+		benchmark_player(benchmark, max_steps);
+		return 0;
+	}
+	if (benchmark_file.empty() == false) {
+		benchmark_io(benchmark_file, n_groups, max_steps, n_channels);
+		return 0;
+	}
+
+	begin_pcm_cache_prune();
+
+	if (rt.policy == SCHED_RR && rt.priority == 0)
+		rt.priority = 1;
+	if (lock_mem)
+		printf("%s\n", lock_memory().c_str());
+
+	// only with -L: it has a ring buffer per stream and a thread of its own
+	std::optional<sample_streamer> streamer;
+	if (is_streaming_enabled())
+		streamer.emplace();
+	sound_parameters sound_pars(sample_rate, n_channels);
+	sound_pars.streamer = streamer.has_value() ? &streamer.value() : nullptr;
+	if (stems)
+		sound_pars.n_stems = n_groups;
+	if (period_ms)
+		sound_pars.period_size = sample_rate * period_ms / 1000;
+	pipewire_capture capture(sample_rate, n_channels);
+	reclaimer reclaim(&sound_pars);  // after the audio has stopped, this frees what is left
+	audio_backend *backend = create_audio_backend(backend_name, &sound_pars);
+	if (!backend) {
+		fprintf(stderr, "Audio backend \"%s\" is not known\n", backend_name.c_str());
+		return 1;
+	}
+	if (stems && backend_name != "pipewire")
+		fprintf(stderr, "Only the pipewire backend has outputs per channel\n");
+	printf("Audio backend: %s\n", backend->get_name().c_str());
+	backend->set_realtime_settings(rt);
+	if (backend->begin() == false) {
+		fprintf(stderr, "Cannot start audio backend %s\n", backend->get_name().c_str());
+		return 1;
+	}
 
 	srand(time(nullptr));
 
 	const std::string path      = get_current_dir_name();
 	std::string       work_path = path;
-	auto              midi_in   = allocate_midi_input_port();
+	midi_input        midi_in;
+	ringbuffer<midi_event> *midi_gui_events = midi_in.subscribe({ SND_SEQ_EVENT_NOTEON, SND_SEQ_EVENT_CONTROLLER, SND_SEQ_EVENT_START, SND_SEQ_EVENT_CONTINUE, SND_SEQ_EVENT_STOP, SND_SEQ_EVENT_CLOCK });
+	latency_statistics midi_gui_latency;
+	// notes on the selected midi channel play the sample of the selected pattern group straight
+	// away, controllers on it change the master parameters (without a lock)
+	std::atomic_int live_group        = 0;
+	std::atomic_int live_midi_channel = -1;  // -1: none selected
+	midi_in.set_handler([&sound_pars, &live_group, &live_midi_channel](const midi_event & e) {
+			if (e.channel != live_midi_channel)
+				return;
+			if (e.type == SND_SEQ_EVENT_NOTEON && e.value > 0)
+				sound_pars.live_queues[sound_parameters::live_midi]->push({ live_group, e.note, e.value / 127., e.arrival_ns });
+			else if (e.type == SND_SEQ_EVENT_CONTROLLER)
+				sound_pars.master.set_control(e.note, e.value);
+			});
+	midi_in.begin();
 
 	signal(SIGTERM, sigh);
 
@@ -908,16 +1255,19 @@ int main(int argc, char *argv[])
 	int  vol    = 100;
 
 	enum { m_pattern, m_settings, m_sample, m_cell } mode = m_pattern;
-	enum { fs_load, fs_save, fs_none, fs_load_sample, fs_record } fs_action = fs_none;
+	enum { fs_load, fs_save, fs_none, fs_load_sample, fs_record, fs_preload } fs_action = fs_none;
 	size_t fs_action_sample_index        = 0;
 	fileselector_data      fs_data { };
-	std::shared_mutex      pat_clickables_lock;
-	std::array<pattern, pattern_groups> pat_clickables { };
+	// the gui owns 'sequence', the player gets copies of it via pattern_snapshot
+	sequencer_data         sequence(n_groups, max_steps, 16);
+	snapshot<sequencer_data> pattern_snapshot;
+	bool                   patterns_changed = false;
+	std::vector<pattern>   pat_clickables(n_groups);
 	std::optional<size_t>  pat_clickable_selected;
 	uint64_t               pat_clickable_pressed_since = 0;
 	size_t                 pattern_group = 0;
 
-	std::vector<clickable> channel_clickables      = generate_channel_column(display_mode->w, display_mode->h, pattern_groups);
+	std::vector<clickable> channel_clickables      = generate_channel_column(display_mode->w, display_mode->h, n_groups);
 
 	std::vector<clickable> menu_button_clickables  = generate_menu_button(display_mode->w, display_mode->h);
 
@@ -946,11 +1296,18 @@ int main(int argc, char *argv[])
 	size_t         agc_idx          = 0;
 	bool           agc              = false;
 	size_t         scope_idx        = 0;
+	size_t         preload_idx      = 0;
+	size_t         midi_sync_idx    = 0;
+	std::atomic_int midi_sync       = ms_none;
+	midi_clock_pll clock_pll;
+	double         clock_difference = 0.;  // ms, between us and the midi clock master
 	std::vector<clickable> settings_menu_buttons = generate_settings_menu_buttons(display_mode->w, display_mode->h,
 			&pattern_load_idx, &save_idx, &clear_idx, &quit_idx, &bpm_widget, &record_idx, &vol_widget,
 			&pause_idx, &midi_ch_widget, &lp_filter_widget, &hp_filter_widget, &sound_saturation_widget,
-			&polyrythmic_idx, &swing_widget, &agc_idx, &clipping_idx, &scope_idx, &busyness_idx);
+			&polyrythmic_idx, &swing_widget, &agc_idx, &clipping_idx, &scope_idx, &busyness_idx, &preload_idx, &midi_sync_idx);
 	std::string    menu_status;
+	file_saver     saver;
+	sample_loader  sample_loads(n_channels);
 
 	up_down_widget pitch_widget       { };
 	up_down_widget cell_volume_left_widget  { };
@@ -961,20 +1318,35 @@ int main(int argc, char *argv[])
 	size_t         sample_load_idx        = 0;
 	size_t         sample_unload_idx      = 0;
 	size_t         mute_idx               = 0;
+	size_t         input_idx              = 0;
+	std::string    prev_capture_status;
 	up_down_widget sample_vol_widget_left   { };
 	up_down_widget sample_vol_widget_right  { };
 	up_down_widget midi_note_widget_pars    { };
 	up_down_widget n_steps_pars             { };
 	up_down_widget pitch_pars               { };
-	std::vector<clickable> sample_buttons_clickables = generate_sample_buttons(display_mode->w, display_mode->h, &sample_load_idx, &sample_vol_widget_left, &sample_vol_widget_right, &midi_note_widget_pars, &n_steps_pars, &pitch_pars, &sample_unload_idx, &mute_idx);
+	std::vector<clickable> sample_buttons_clickables = generate_sample_buttons(display_mode->w, display_mode->h, &sample_load_idx, &sample_vol_widget_left, &sample_vol_widget_right, &midi_note_widget_pars, &n_steps_pars, &pitch_pars, &sample_unload_idx, &mute_idx, &input_idx);
 
 	size_t         p_pause_idx            = 0;
 	size_t         restart_idx            = 0;
-	std::vector<clickable> pattern_menu = generate_pattern_menu(display_mode->w, display_mode->h, &p_pause_idx, &restart_idx);
-	for(size_t i=0; i<pattern_groups; i++)
-		pat_clickables[i] = generate_pattern_grid(display_mode->w, display_mode->h, steps);
+	size_t         prev_pattern_idx       = 0;
+	size_t         next_pattern_idx       = 0;
+	size_t         append_idx             = 0;
+	size_t         song_idx               = 0;
+	std::vector<clickable> pattern_menu = generate_pattern_menu(display_mode->w, display_mode->h, &p_pause_idx, &restart_idx,
+			&prev_pattern_idx, &next_pattern_idx, &append_idx, &song_idx);
+	for(size_t i=0; i<n_groups; i++) {
+		pat_clickables[i] = generate_pattern_grid(display_mode->w, display_mode->h, steps, max_steps);
+		sequence.dim[i]   = steps;
+	}
 
-	std::array<sample, pattern_groups> samples { };
+	std::vector<sample> samples(n_groups);
+	{
+		std::unique_lock<std::shared_mutex> lck(sound_pars.sounds_lock);
+		sound_pars.get_group_sample = [&samples](const int group) -> sound * {
+			return group >= 0 && size_t(group) < samples.size() ? samples[group].s : nullptr;
+		};
+	}
 
 	SDL_DialogFileFilter sf_filters[]        { { "Kaboem files", PROG_EXT  } };
 	SDL_DialogFileFilter sf_filters_sample[] { { "Samples",      "wav;mp3" } };
@@ -993,25 +1365,36 @@ int main(int argc, char *argv[])
 	};
 
 	std::atomic_int swing_amount_parameter { swing_amount };
-	if (read_file("default." PROG_EXT, &pat_clickables, &samples, &file_parameters)) {
-		for(size_t i=0; i<pattern_groups; i++) {
+	song_data               song;
+	song_timeline           timeline;
+	snapshot<song_timeline> song_snapshot;
+	std::atomic_bool        song_mode = false;
+	std::vector<uint8_t>    compiled_enabled;
+	song.patterns.push_back(sequence);
+
+	// a session that ended without the normal save (a crash) is restored from the journal instead
+	const std::string journal_dir = path + "/default." PROG_EXT ".journal";
+	if (journal::recover(journal_dir, &reclaim, &sequence, &samples, &file_parameters, n_channels, &song) ||
+			read_file("default." PROG_EXT, &sequence, &samples, &file_parameters, n_channels, &song)) {
+		for(size_t i=0; i<n_groups; i++) {
 			if (samples[i].name.empty() == false)
 				channel_clickables[i].text = get_filename(samples[i].name).substr(0, 5);
 		}
 
-		sound_pars.global_volume                        = vol / 100.;
-		sound_pars.sound_saturation                     = 1. - sound_saturation / 1000.;
+		sound_pars.master.set(parameter_store::p_volume,     vol / 100.);
+		sound_pars.master.set(parameter_store::p_saturation, 1. - sound_saturation / 1000.);
 		sound_pars.agc_enabled                          = agc;
 		settings_menu_buttons[agc_idx].selected         = agc;
 		settings_menu_buttons[polyrythmic_idx].selected = polyrythmic;
 		swing_amount_parameter                          = swing_amount;
 
-		regenerate_pattern_grid(display_mode->w, display_mode->h, &pat_clickables[pattern_group]);
+		for(size_t i=0; i<n_groups; i++)
+			regenerate_pattern_grid(display_mode->w, display_mode->h, sequence.dim[i], &pat_clickables[i]);
 
-		reset_all_patterns(&pat_clickables, &pat_clickables_lock, samples, false);
+		reset_all_patterns(&pat_clickables, &sequence, samples, false);
 	}
 
-	std::atomic_int      sleep_ms       = 60 * 1000 / bpm;
+	std::atomic<double>  sleep_ms       = 60 * 1000 / bpm;  // fractional when following a midi clock
 	size_t               prev_pat_index = size_t(-1);
 	std::atomic_bool     paused         = false;
 	std::atomic_bool     force_trigger  = false;
@@ -1019,91 +1402,298 @@ int main(int argc, char *argv[])
 	bool                 ctrl           = false;
 	int                  prev_scope_t   = -1;
 	size_t               selected_cell  = 0;
-	std::atomic_uint64_t start_t        = 0;
-
-	std::thread player_thread([&pat_clickables, &pat_clickables_lock, &samples, &sleep_ms, &sound_pars, &paused, &force_trigger, &polyrythmic, &swing_amount_parameter, &start_t] {
-			player(&pat_clickables, &pat_clickables_lock, &samples, &sleep_ms, &sound_pars, &paused, &do_exit, &force_trigger, &polyrythmic, &swing_amount_parameter, &start_t);
+	std::atomic<double>  start_t        = 0.;
+	player_statistics    player_stats;
+	journal              session_journal(journal_dir);
+	uint64_t             journal_t      = 0;
+
+	// files loaded in the background that can be switched to with F1...F8
+	std::vector<scene_loader *>               preloaded(n_scenes);
+	scene_switch                              scenes;
+	std::shared_ptr<scene_data>               switching_scene;  // requested, not taken over yet
+	std::vector<std::shared_ptr<scene_data> > retired_scenes;   // until the player no longer uses them
+	std::vector<scene_loader *>               retired_loaders;  // removed while loading, until they have finished
+	std::string                               prev_scenes_status;
+
+	publish_patterns(&pattern_snapshot, &sequence, samples);
+	update_song_timeline(&song, &timeline, &song_snapshot, sequence, lround(sleep_ms), polyrythmic, swing_amount, &compiled_enabled, true);
+
+	std::thread player_thread([&pattern_snapshot, &samples, &sleep_ms, &sound_pars, &paused, &force_trigger, &polyrythmic, &swing_amount_parameter, &start_t, &capture, &rt, &player_stats, &song_snapshot, &song_mode, &scenes, &midi_sync] {
+			if (rt.policy != SCHED_OTHER)
+				printf("%s\n", set_thread_realtime("sequencer thread", rt.policy, rt.priority).c_str());
+			if (rt.sequencer_cpu.has_value())
+				printf("%s\n", set_thread_cpu("sequencer thread", rt.sequencer_cpu.value()).c_str());
+
+			player(&pattern_snapshot, &samples, &sleep_ms, &sound_pars, &paused, &do_exit, &force_trigger, &polyrythmic, &swing_amount_parameter, &start_t, &capture, &player_stats, &song_snapshot, &song_mode, &scenes, &midi_sync);
 			});
 
 	while(!do_exit) {
 		// determine pattern index
 		size_t pat_index = 0;
 		{
-			auto   now         = get_ms() - start_t;
-			std::shared_lock<std::shared_mutex> pat_lck(pat_clickables_lock);
-			size_t current_dim = pat_clickables[pattern_group].dim;
+			double now         = std::max(0., get_ms() - start_t);
+			size_t current_dim = sequence.dim[pattern_group];
 
-                        if (polyrythmic)
-				pat_index = now / sleep_ms % current_dim;
-			else {
-				size_t max_steps = 0;
-                                for(size_t i=0; i<pattern_groups; i++) {
-                                        if (samples[i].s != nullptr)
-                                                max_steps = std::max(max_steps, pat_clickables[i].dim);
-                                }
-				pat_index = size_t(now / double(sleep_ms) * current_dim / double(max_steps)) % current_dim;
-                        }
+			if (polyrythmic || sequence.max_steps == 0)
+				pat_index = uint64_t(now / sleep_ms) % current_dim;
+			else
+				pat_index = size_t(now / sleep_ms * current_dim / double(sequence.max_steps)) % current_dim;
 		}
 		if (pat_index != prev_pat_index && !paused) {
 			redraw = true;
 			prev_pat_index = pat_index;
 		}
 
-		// check for midi events
-		if (midi_in.first && snd_seq_event_input_pending(midi_in.first, 1) != 0) {
-			snd_seq_event_t *ev { nullptr };
-			snd_seq_event_input(midi_in.first, &ev);
-			if (ev->type == SND_SEQ_EVENT_NOTEON) {
-				uint8_t ch = ev->data.note.channel;
-				if (selected_midi_channel.has_value() && ch == selected_midi_channel) {
-					std::lock_guard<std::shared_mutex> pat_lck(pat_clickables_lock);
-					pat_clickables[pattern_group].pattern[pat_index].selected = true;
+		live_group        = pattern_group;
+		live_midi_channel = selected_midi_channel.value_or(-1);
+
+		// background saves
+		auto saving = saver.get_progress();
+		if (saving.first.empty() == false) {
+			std::string status = "saving " + get_filename(saving.first) + ": " + std::to_string(int(saving.second * 100)) + "%";
+			if (status != menu_status) {
+				menu_status = status;
+				redraw      = true;
+			}
+		}
+		auto saved = saver.get_result();
+		if (saved.has_value()) {
+			if (saved.value().second)
+				menu_status = "file " + get_filename(saved.value().first) + " written";
+			else {
+				menu_status = "cannot write " + get_filename(saved.value().first);
+				do_error_message(font, screen, display_mode, menu_status);
+			}
+			redraw = true;
+		}
+
+		// samples that are loaded in the background
+		for(size_t i=0; i<n_groups; i++) {
+			auto progress = sample_loads.get_progress(i);
+			if (progress.has_value()) {
+				std::string text = std::to_string(int(progress.value() * 100)) + "%";
+				if (channel_clickables[i].text != text) {
+					channel_clickables[i].text = text;
 					redraw = true;
 				}
 			}
 		}
+		for(;;) {
+			auto loaded = sample_loads.get_result();
+			if (loaded.has_value() == false)
+				break;
 
-		// did the user select a file in the fileselector?
-		if (fs_action != fs_none) {
-			std::lock_guard<std::mutex> fs_lck(fs_data.lock);
-			if (fs_action == fs_load) {
-				if (fs_data.finished) {
-					if (fs_data.file.empty() == false) {
-						draw_please_wait(font, screen, display_mode);
-
-						std::unique_lock<std::shared_mutex> lck    (sound_pars.sounds_lock);
-						std::unique_lock<std::shared_mutex> pat_lck(pat_clickables_lock   );
-						if (read_file(fs_data.file, &pat_clickables, &samples, &file_parameters)) {
-							sound_pars.global_volume                        = vol / 100.;
-							sound_pars.sound_saturation                     = 1. - sound_saturation / 1000.;
-							sound_pars.agc_enabled                          = agc;
-							settings_menu_buttons[agc_idx].selected         = agc;
-							settings_menu_buttons[polyrythmic_idx].selected = polyrythmic;
-							swing_amount_parameter                          = swing_amount;
-							sleep_ms                                        = 60 * 1000 / bpm;
+			size_t        group = loaded.value().group;
+			sound_sample *new_s = loaded.value().s;  // made and configured by the loader
 
-							for(size_t i=0; i<pattern_groups; i++) {
-								if (samples[i].name.empty() == false)
-									channel_clickables[i].text = get_filename(samples[i].name).substr(0, 5);
+			if (new_s) {
+				sample *const s = &samples[group];
+				swap_sample(&sound_pars, s, new_s, &reclaim);
+				s->name = loaded.value().file_name;
+				if (loaded.value().midi_note.has_value())
+					s->midi_note = loaded.value().midi_note.value();
 
-							}
-							menu_status = "file " + get_filename(fs_data.file) + " read";
+				reset_pattern(&pat_clickables, &sequence, group, s->s, false);
+				patterns_changed = true;
 
-							regenerate_pattern_grid(display_mode->w, display_mode->h, &pat_clickables[pattern_group]);
+				menu_status = "file " + get_filename(s->name) + " read";
+			}
+			else {
+				menu_status = "file " + get_filename(loaded.value().file_name) + " NOT FOUND";
+				do_error_message(font, screen, display_mode, get_filename(loaded.value().file_name) + " invalid/not found");
+			}
 
-							reset_all_patterns(&pat_clickables, &pat_clickables_lock, samples, false);
+			channel_clickables[group].text = samples[group].s ? get_filename(samples[group].name).substr(0, 5) : "";
+			redraw = true;
+		}
 
-							sound_pars.sounds.clear();
-						}
-						else {
-							lck    .unlock();
-							pat_lck.unlock();
+		// a song file that was read (patterns and settings); the samples are fetched in the background and each
+		// is put in its channel when it is ready (see sample_loads above)
+		auto file = sample_loads.get_file_result();
+		if (file.has_value()) {
+			auto & r = file.value();
+
+			if (r.ok) {
+				sample_loads.cancel();  // what was loaded for the previous song meanwhile
+
+				sequence = r.data;
+				song     = r.song;
+				set_parameters(r.parameters, file_parameters);
+				patterns_changed = true;
+
+				sound_pars.master.set(parameter_store::p_volume,     vol / 100.);
+				sound_pars.master.set(parameter_store::p_saturation, 1. - sound_saturation / 1000.);
+				sound_pars.agc_enabled                          = agc;
+				settings_menu_buttons[agc_idx].selected         = agc;
+				settings_menu_buttons[polyrythmic_idx].selected = polyrythmic;
+				swing_amount_parameter                          = swing_amount;
+				sleep_ms                                        = 60 * 1000 / bpm;
+
+				// voices that play the previous samples finish on them
+				for(size_t i=0; i<n_groups; i++) {
+					swap_sample(&sound_pars, &samples[i], nullptr, &reclaim);
+					samples[i].name.clear();
+					channel_clickables[i].text.clear();
+
+					if (i < r.samples.size() && r.samples[i].entry.midi_note.has_value())
+						samples[i].midi_note = r.samples[i].entry.midi_note.value();
+					if (i < r.samples.size() && r.samples[i].fetch)
+						sample_loads.load(i, r.samples[i]);
+				}
+				menu_status = "loading " + get_filename(r.file_name);
 
-							menu_status = "cannot read " + get_filename(fs_data.file);
-							do_error_message(font, screen, display_mode, menu_status);
-						}
+				for(size_t i=0; i<n_groups; i++)
+					regenerate_pattern_grid(display_mode->w, display_mode->h, sequence.dim[i], &pat_clickables[i]);
 
-						redraw = true;
+				timeline = song_timeline();  // all of the song changed
+				if (song.arrangement.empty()) {
+					song_mode = false;
+					pattern_menu[song_idx].selected = false;
+				}
+			}
+			else {
+				menu_status = "cannot read " + get_filename(r.file_name);
+				do_error_message(font, screen, display_mode, menu_status);
+			}
+
+			redraw = true;
+		}
+
+		// log what was changed since the previous time
+		if (get_ms() - journal_t >= 250) {
+			session_journal.update(take_snapshot(sequence, samples, file_parameters, &song));
+			journal_t = get_ms();
+		}
+
+		// check for midi events
+		midi_event ev { };
+		while(midi_gui_events->pop(&ev)) {
+			midi_gui_latency.add(get_ns_mono() - ev.arrival_ns);
+
+			if (ev.type == SND_SEQ_EVENT_NOTEON) {
+				if (selected_midi_channel.has_value() && ev.channel == selected_midi_channel) {
+					patterns_changed = true;
+					sequence.set(pattern_group, pat_index, true);
+					redraw = true;
+				}
+			}
+			else if (ev.type == SND_SEQ_EVENT_CONTROLLER) {
+				// the midi thread already changed it: only show the new values
+				if (selected_midi_channel.has_value() && ev.channel == selected_midi_channel) {
+					vol              = lround(sound_pars.master.get_target(parameter_store::p_volume) * 100.);
+					sound_saturation = lround((1. - sound_pars.master.get_target(parameter_store::p_saturation)) * 1000.);
+					redraw           = true;
+				}
+			}
+			else if (midi_sync == ms_slave) {
+				// the events are timestamped by alsa: when they are handled here does not matter
+				uint64_t event_ns = ev.arrival_ns;
+				double   event_ms = (get_ns() - (get_ns_mono() - event_ns)) / 1000000.;
+
+				if (ev.type == SND_SEQ_EVENT_START) {
+					clock_pll.reset();
+					start_t = event_ms;
+					paused  = false;
+				}
+				else if (ev.type == SND_SEQ_EVENT_CONTINUE) {
+					paused  = false;
+				}
+				else if (ev.type == SND_SEQ_EVENT_STOP) {
+					paused  = true;
+				}
+				else if (ev.type == SND_SEQ_EVENT_CLOCK && !paused) {
+					clock_pll.pulse(event_ns);
+					clock_difference = follow_midi_clock(clock_pll, event_ms, &sleep_ms, &start_t);
+					if (clock_pll.is_locked())
+						bpm = std::max(1, int(round(clock_pll.get_bpm())));
+				}
+
+				settings_menu_buttons[pause_idx].selected = paused;
+				pattern_menu[p_pause_idx].selected        = paused;
+			}
+		}
+
+		// the player switched to a preloaded scene: take it over
+		if (scenes.playing.load()) {
+			{
+				std::unique_lock<std::shared_mutex> lck(sound_pars.sounds_lock);
+				for(size_t i=0; i<n_groups; i++) {
+					reclaim.retire(samples[i].s);
+					samples[i] = switching_scene->samples[i];
+				}
+				switching_scene->owns_samples = false;
+			}
+
+			sequence = switching_scene->sequence;
+			song     = switching_scene->song;
+			bpm      = switching_scene->bpm;
+
+			for(size_t i=0; i<n_groups; i++) {
+				channel_clickables[i].text = get_filename(samples[i].name).substr(0, 5);
+				regenerate_pattern_grid(display_mode->w, display_mode->h, sequence.dim[i], &pat_clickables[i]);
+			}
+			reset_all_patterns(&pat_clickables, &sequence, samples, false);
+			timeline = song_timeline();  // all of the song changed
+
+			// from now on the player uses the published patterns again
+			publish_patterns(&pattern_snapshot, &sequence, samples);
+			scenes.playing.store(nullptr);
+
+			menu_status = "switched to " + get_filename(switching_scene->file_name);
+			retired_scenes.push_back(switching_scene);
+			switching_scene.reset();
+			patterns_changed = true;
+			redraw           = true;
+		}
+		std::erase_if(retired_scenes, [](const auto & scene) { return scene.use_count() == 1; });
+		std::erase_if(retired_loaders, [](scene_loader *const loader) {
+				if (loader->is_finished() == false)
+					return false;
+				delete loader;  // the thread has finished, so this does not wait
+				return true;
+			});
+
+		{
+			std::string scenes_status = get_scenes_status(preloaded, switching_scene);
+			if (scenes_status != prev_scenes_status) {
+				prev_scenes_status = scenes_status;
+				redraw = true;
+			}
+		}
+
+		// a recording from the input that can be put in its channel?
+		{
+			auto recorded = capture.get_finished();
+			if (recorded.has_value()) {
+				size_t ch = recorded.value().first;
+				swap_sample(&sound_pars, &samples[ch], recorded.value().second, &reclaim);
+				samples[ch].name = recorded.value().second->get_file_name();
+				channel_clickables[ch].text = get_filename(samples[ch].name).substr(0, 5);
+				reset_pattern(&pat_clickables, &sequence, ch, samples[ch].s, false);
+				patterns_changed = true;
+				menu_status = "input recorded in channel " + std::to_string(ch + 1);
+				redraw      = true;
+			}
+
+			std::string capture_status = get_capture_status(&capture);
+			if (capture_status != prev_capture_status) {
+				prev_capture_status = capture_status;
+				sample_buttons_clickables[input_idx].selected = capture.get_state() != pipewire_capture::cs_idle;
+				redraw = true;
+			}
+		}
+
+		// did the user select a file in the fileselector?
+		if (fs_action != fs_none) {
+			std::lock_guard<std::mutex> fs_lck(fs_data.lock);
+			if (fs_action == fs_load) {
+				if (fs_data.finished) {
+					if (fs_data.file.empty() == false) {
+						// read in the background, see below
+						sample_loads.cancel();
+						sample_loads.load_file(fs_data.file, sequence, file_parameters);
+						menu_status = "reading " + get_filename(fs_data.file);
+						redraw      = true;
 					}
 
 					fs_action = fs_none;
@@ -1112,18 +1702,13 @@ int main(int argc, char *argv[])
 			else if (fs_action == fs_save) {
 				if (fs_data.finished) {
 					if (fs_data.file.empty() == false) {
-						draw_please_wait(font, screen, display_mode);
-
 						std::string file     = fs_data.file;
 						size_t      file_len = file.size();
 						if (file_len > 7 && file.substr(file_len - 7) != "." PROG_EXT)
 							file += "." PROG_EXT;
 
-						std::shared_lock<std::shared_mutex> pat_lck(pat_clickables_lock);
-						if (write_file(file, pat_clickables, samples, file_parameters))
-							menu_status = "file " + get_filename(fs_data.file) + " written";
-						else
-							do_error_message(font, screen, display_mode, "cannot write " + get_filename(fs_data.file));
+						// written in the background; the outcome is shown when it is done
+						saver.save(file, take_snapshot(sequence, samples, file_parameters, &song), save_format);
 
 						redraw = true;
 					}
@@ -1133,39 +1718,25 @@ int main(int argc, char *argv[])
 			else if (fs_action == fs_load_sample) {
 				if (fs_data.finished) {
 					if (fs_data.file.empty() == false) {
-						std::unique_lock<std::shared_mutex> lck(sound_pars.sounds_lock);
-						sample *const s = &samples[fs_action_sample_index];
-						s->name = fs_data.file;
-						auto *old_s_pointer = s->s;
-						delete s->s;
-
-                                		s->s = new sound_sample(sample_rate, s->name);
-						if (s->s->begin() == false) {
-							delete s->s;
-							s->s = nullptr;
-						}
-
-						if (s->s) {
-							bool is_stereo = s->s->get_n_channels() >= 2;
-							s->s->add_mapping(0, 0, 1.0);
-							s->s->add_mapping(is_stereo ? 1 : 0, 1, 1.0);
-
-							menu_status = "file " + get_filename(fs_data.file) + " read";
-							channel_clickables[fs_action_sample_index].text = get_filename(s->name).substr(0, 5);
-						}
+						// decoded in the background; the channel shows how far it is
+						sample_loads.load(fs_action_sample_index, fs_data.file);
+						menu_status = "loading " + get_filename(fs_data.file);
+						redraw      = true;
+					}
+					fs_action = fs_none;
+				}
+			}
+			else if (fs_action == fs_preload) {
+				if (fs_data.finished) {
+					if (fs_data.file.empty() == false) {
+						auto it = std::find(preloaded.begin(), preloaded.end(), nullptr);
+						if (it == preloaded.end())
+							menu_status = "no free scene slot (shift+F1...F8 removes one)";
 						else {
-							menu_status = "file " + get_filename(fs_data.file) + " NOT FOUND";
-							do_error_message(font, screen, display_mode, get_filename(fs_data.file) + " invalid/not found");
-						}
-
-						for(size_t i=0; i<sound_pars.sounds.size(); i++) {
-							if (sound_pars.sounds[i].s == old_s_pointer)
-								sound_pars.sounds[i].s = s->s;
+							*it = new scene_loader(fs_data.file, n_groups, max_steps, n_channels);
+							menu_status = "preloading " + get_filename(fs_data.file) + " as F" + std::to_string(it - preloaded.begin() + 1);
 						}
 
-						if (s->s)
-							reset_pattern(&pat_clickables, fs_action_sample_index, s->s, false);
-
 						redraw = true;
 					}
 					fs_action = fs_none;
@@ -1176,7 +1747,7 @@ int main(int argc, char *argv[])
 					std::unique_lock<std::shared_mutex> lck(sound_pars.sounds_lock);
 					SF_INFO si { };
 					si.samplerate = sample_rate;
-					si.channels   = 2;
+					si.channels   = sound_pars.n_channels;
 					si.format     = SF_FORMAT_WAV | SF_FORMAT_PCM_24;
 					sound_pars.record_handle = sf_open(fs_data.file.c_str(), SFM_WRITE, &si);
 					if (sound_pars.record_handle)
@@ -1227,16 +1798,78 @@ int main(int argc, char *argv[])
 
 				draw_clickables(font, screen, pattern_menu, { }, { });
 
-				std::shared_lock<std::shared_mutex> pat_lck(pat_clickables_lock);
-				draw_clickables(font, screen, pat_clickables[pattern_group].pattern, click_state, pat_index, pat_clickables[pattern_group].dim);
+				sync_pattern_grid(&pat_clickables[pattern_group], sequence, pattern_group);
+				draw_clickables(font, screen, pat_clickables[pattern_group].pattern, click_state, pat_index, sequence.dim[pattern_group]);
 				draw_clickables(font, screen, channel_clickables, { }, pattern_group);
 
 				if (samples[pattern_group].name.empty() == false)
 					draw_text(font, screen, 0, display_mode->h / 2 / 100, samples[pattern_group].name, { });
+
+				std::optional<size_t> playing_segment;
+				if (song_mode && timeline.get_n_segments())
+					playing_segment = timeline.find_segment(uint64_t(std::max(0., get_ms() - start_t) * sample_rate / 1000));
+				draw_text(font, screen, display_mode->w / 3, display_mode->h / 2 / 100, get_song_info(song, playing_segment), { });
 			}
 			else if (mode == m_settings) {
 				if (menu_status.empty() == false)
 					draw_text(font, screen, 0, display_mode->h - font_height * 5, menu_status, { { display_mode->w, font_height } });
+				{
+					char seq_status[96];
+					snprintf(seq_status, sizeof seq_status, "sequencer: %u of %zu groups active, %.1f us per tick",
+							unsigned(player_stats.n_active), n_groups, player_stats.tick_ns / 1000.);
+					draw_text(font, screen, 0, display_mode->h - font_height * 7, seq_status, { { display_mode->w, font_height } });
+
+					char midi_status[160];
+					snprintf(midi_status, sizeof midi_status, "midi: scheduled %.1f ms ahead (+/- %.2f ms), %u late",
+							player_stats.midi_lead_ns / 1000000., player_stats.midi_lead_spread_ns / 1000000., unsigned(player_stats.midi_late));
+					draw_text(font, screen, 0, display_mode->h - font_height * 8, midi_status, { { display_mode->w, font_height } });
+
+					snprintf(midi_status, sizeof midi_status, "midi in: %llu events (%llu dropped), handled after %.1f ms (max %.1f ms)",
+							(unsigned long long)midi_in.get_n_events(), (unsigned long long)midi_in.get_n_dropped(),
+							midi_gui_latency.avg_ns / 1000000., midi_gui_latency.max_ns / 1000000.);
+					draw_text(font, screen, 0, display_mode->h - font_height * 10, midi_status, { { display_mode->w, font_height } });
+
+					snprintf(midi_status, sizeof midi_status, "live: %llu notes, %.1f ms from input to sound (max %.1f ms), period %.1f ms, output %.1f ms (%s)",
+							(unsigned long long)sound_pars.live_latency.n, sound_pars.live_latency.avg_ns / 1000000., sound_pars.live_latency.max_ns / 1000000.,
+							sound_pars.period_size * 1000. / sound_pars.sample_rate, sound_pars.latency_frames * 1000. / sound_pars.sample_rate,
+							sound_pars.latency_measured ? "measured" : "estimated");
+					draw_text(font, screen, 0, display_mode->h - font_height * 11, midi_status, { { display_mode->w, font_height } });
+
+					snprintf(midi_status, sizeof midi_status, "journal: %zu edits (%llu bytes) since compaction",
+							session_journal.get_n_records(), (unsigned long long)session_journal.get_n_bytes());
+					draw_text(font, screen, 0, display_mode->h - font_height * 12, midi_status, { { display_mode->w, font_height } });
+
+					auto cache_stats = get_sample_cache_statistics();
+					snprintf(midi_status, sizeof midi_status, "sample cache: %zu samples, %.1f of %zu MB, %llu hits, %llu misses; %zu replaced not freed yet",
+							cache_stats.n_samples, cache_stats.n_bytes / 1048576., cache_stats.budget / 1048576,
+							(unsigned long long)cache_stats.hits, (unsigned long long)cache_stats.misses, reclaim.get_n_pending());
+					draw_text(font, screen, 0, display_mode->h - font_height * 13, midi_status, { { display_mode->w, font_height } });
+
+					snprintf(midi_status, sizeof midi_status, "last sample decoded: %.1f MB of audio, %.1f MB allocated for it",
+							cache_stats.last_load_pcm_bytes / 1048576., cache_stats.last_load_allocated_bytes / 1048576.);
+					draw_text(font, screen, 0, display_mode->h - font_height * 14, midi_status, { { display_mode->w, font_height } });
+
+					if (streamer.has_value())
+						snprintf(midi_status, sizeof midi_status, "streaming: %zu voices, %.1f MB read, %llu frames too late, %llu voices without a stream",
+								streamer->get_n_active(), streamer->get_n_bytes_read() / 1048576.,
+								(unsigned long long)streamer->get_n_underflows(), (unsigned long long)streamer->get_n_no_stream());
+					else
+						snprintf(midi_status, sizeof midi_status, "streaming: off (see -L)");
+					draw_text(font, screen, 0, display_mode->h - font_height * 15, midi_status, { { display_mode->w, font_height } });
+
+					if (midi_sync == ms_slave) {
+						char sync_status[128];
+						if (clock_pll.is_locked()) {
+							snprintf(sync_status, sizeof sync_status, "midi clock in: %.2f BPM, phase error %.2f ms, jitter %.2f ms, %.0f ms off",
+									clock_pll.get_bpm(), clock_pll.get_phase_error_ns() / 1000000., clock_pll.get_jitter_ns() / 1000000., clock_difference);
+						}
+						else {
+							snprintf(sync_status, sizeof sync_status, "midi clock in: waiting for clock (%llu pulses)", (unsigned long long)clock_pll.get_n_pulses());
+						}
+						draw_text(font, screen, 0, display_mode->h - font_height * 6, sync_status, { { display_mode->w, font_height } });
+					}
+				}
+				draw_text(font, screen, 0, display_mode->h - font_height * 9, prev_scenes_status, { { display_mode->w, font_height } });
 				draw_clickables(font, screen, channel_clickables, { }, pattern_group);
 				draw_clickables(font, screen, settings_menu_buttons, { }, { });
 				draw_text(font, screen, bpm_widget.x, bpm_widget.y, std::to_string(bpm), { { bpm_widget.text_w, bpm_widget.text_h } });
@@ -1287,6 +1920,8 @@ int main(int argc, char *argv[])
 
 				if (name.empty() == false)
 					draw_text(font, screen, 0, display_mode->h - font_height * 5, name, { { display_mode->w, font_height } });
+				if (prev_capture_status.empty() == false)
+					draw_text(font, screen, 0, display_mode->h - font_height * 10, prev_capture_status + " (channel " + std::to_string(capture.get_channel() + 1) + ")", { { display_mode->w, font_height } });
 				draw_clickables(font, screen, channel_clickables, { }, pattern_group);
 				draw_clickables(font, screen, sample_buttons_clickables, { }, { });
 				draw_text(font, screen, sample_vol_widget_left.x,  sample_vol_widget_left.y,  std::to_string(vol_left),
@@ -1299,21 +1934,20 @@ int main(int argc, char *argv[])
 					draw_text(font, screen, midi_note_widget_pars.x, midi_note_widget_pars.y,  std::to_string(midi_note.value() + 1),
 						{ { midi_note_widget_pars.text_w,  midi_note_widget_pars.text_h } });
 				}
-				draw_text(font, screen, n_steps_pars.x, n_steps_pars.y, std::to_string(pat_clickables[fs_action_sample_index].dim),
+				draw_text(font, screen, n_steps_pars.x, n_steps_pars.y, std::to_string(sequence.dim[fs_action_sample_index]),
 					{ { n_steps_pars.text_w, n_steps_pars.text_h } });
 				draw_text(font, screen, pitch_pars.x, pitch_pars.y, std::to_string(s ? s->get_pitch_bend() : 0),
 					{ { pitch_pars.text_w, pitch_pars.text_h } });
 			}
 			else if (mode == m_cell) {
-				std::shared_lock<std::shared_mutex> pat_lck(pat_clickables_lock);
 				auto & pattern = pat_clickables[pattern_group];
 
 				draw_clickables(font, screen, cell_menu_buttons, { }, { });
 				draw_text(font, screen, pitch_widget.x, pitch_widget.y, pattern.pattern[selected_cell].text,
 					{ { pitch_widget.text_w, pitch_widget.text_h } });
-				draw_text(font, screen, cell_volume_left_widget.x, cell_volume_left_widget.y, std::to_string(pattern.volume_left[selected_cell]),
+				draw_text(font, screen, cell_volume_left_widget.x, cell_volume_left_widget.y, std::to_string(sequence.volume_left_at(pattern_group, selected_cell)),
 					{ { cell_volume_left_widget.text_w, cell_volume_left_widget.text_h } });
-				draw_text(font, screen, cell_volume_right_widget.x, cell_volume_right_widget.y, std::to_string(pattern.volume_right[selected_cell]),
+				draw_text(font, screen, cell_volume_right_widget.x, cell_volume_right_widget.y, std::to_string(sequence.volume_right_at(pattern_group, selected_cell)),
 					{ { cell_volume_right_widget.text_w, cell_volume_right_widget.text_h } });
 			}
 			else {
@@ -1356,6 +1990,8 @@ int main(int argc, char *argv[])
 							channel_clickables[pattern_group].selected = false;
 							pattern_group = new_group.value();
 							channel_clickables[pattern_group].selected = true;
+							// a tap on a channel also plays its sample, unpitched
+							sound_pars.live_queues[sound_parameters::live_touch]->push({ int(pattern_group), -1, 1., get_ns_mono() });
 						}
 						else if (p_menu_clicked.has_value()) {
 							size_t idx = p_menu_clicked.value();
@@ -1366,11 +2002,38 @@ int main(int argc, char *argv[])
 								start_t = get_ms();
 								paused  = false;
 							}
+							else if (idx == prev_pattern_idx || idx == next_pattern_idx) {
+								if (idx == next_pattern_idx)
+									switch_song_pattern(&song, &sequence, song.current + 1);
+								else if (song.current > 0)
+									switch_song_pattern(&song, &sequence, song.current - 1);
+
+								for(size_t i=0; i<n_groups; i++)
+									regenerate_pattern_grid(display_mode->w, display_mode->h, sequence.dim[i], &pat_clickables[i]);
+								reset_all_patterns(&pat_clickables, &sequence, samples, false);
+								patterns_changed = true;
+							}
+							else if (idx == append_idx) {
+								// shift+append removes the last one
+								if (shift) {
+									if (song.arrangement.empty() == false)
+										song.arrangement.pop_back();
+								}
+								else {
+									song.arrangement.push_back(song.current);
+								}
+								patterns_changed = true;
+							}
+							else if (idx == song_idx) {
+								song_mode = !song_mode && song.arrangement.empty() == false;
+								start_t   = get_ms();
+								paused    = false;
+								pattern_menu[song_idx].selected = song_mode;
+							}
 							pattern_menu         [p_pause_idx].selected = paused;
 							settings_menu_buttons[pause_idx]  .selected = paused;
 						}
 						else {
-							std::shared_lock<std::shared_mutex> pat_lck(pat_clickables_lock);
 							pat_clickable_selected = find_clickable(pat_clickables[pattern_group].pattern, event.button.x, event.button.y);
 							if (pat_clickable_selected.has_value())
 								pat_clickable_pressed_since = get_ms();
@@ -1393,44 +2056,33 @@ int main(int argc, char *argv[])
 						if (idx == clear_idx) {
 							bool choice = are_you_sure(font, screen, display_mode, font_height, "Clear everything");
 							if (choice) {
-								draw_please_wait(font, screen, display_mode);
+								saver.save(path + "/before_clear." PROG_EXT, take_snapshot(sequence, samples, file_parameters, &song), save_format);
 
-								{
-									const std::string file_name = path + "/before_clear." PROG_EXT;
-
-									std::shared_lock<std::shared_mutex> pat_lck(pat_clickables_lock);
-									if (write_file(file_name, pat_clickables, samples, file_parameters) == false)
-										menu_status = "failed: " + file_name;
-								}
 								{
 									std::lock_guard<std::shared_mutex> lck(sound_pars.sounds_lock);
-									sound_pars.sounds.clear();
+									sound_pars.clear_voices();
 								}
 								{
-									std::shared_lock<std::shared_mutex> pat_lck(pat_clickables_lock);
-									for(size_t i=0; i<pattern_groups; i++) {
+									patterns_changed = true;
+
+									for(size_t i=0; i<n_groups; i++) {
 										for(auto & element: pat_clickables[i].pattern) {
 											element.selected = false;
 											element.text.clear();
 										}
 
-										for(auto & element: pat_clickables[i].note_delta)
-											element = 0.;
-
-										for(auto & element: pat_clickables[i].volume_left)
-											element = 1.;
-										for(auto & element: pat_clickables[i].volume_right)
-											element = 1.;
+										sequence.clear(i);
 
-										{
-											std::lock_guard<std::shared_mutex> lck(sound_pars.sounds_lock);
-											sample & s = samples[i];
-											delete s.s;
-											s.s = nullptr;
-											s.name.clear();
-										}
+										swap_sample(&sound_pars, &samples[i], nullptr, &reclaim);
+										samples[i].name.clear();
 										channel_clickables[i].text.clear();
 									}
+
+									song = song_data();
+									song.patterns.push_back(sequence);
+									timeline  = song_timeline();  // forces a full recompile
+									song_mode = false;
+									pattern_menu[song_idx].selected = false;
 								}
 								menu_status = "cleared";
 							}
@@ -1461,13 +2113,12 @@ int main(int argc, char *argv[])
 						else if (set_up_down_value(idx, vol_widget, 0, 110, &vol, shift)) {  // this one goes to 11!
 						}
 						else if (set_up_down_value(idx, sound_saturation_widget, 0, 1000, &sound_saturation, shift)) {
-							std::unique_lock<std::shared_mutex> lck(sound_pars.sounds_lock);
-							sound_pars.sound_saturation = 1. - sound_saturation / 1000.;
+							sound_pars.master.set(parameter_store::p_saturation, 1. - sound_saturation / 1000.);
 						}
-						else if (configure_filter(&sound_pars, lp_filter_widget, idx, false, &lp_filter_f, shift)) {
+						else if (configure_filter(&sound_pars, lp_filter_widget, idx, false, &lp_filter_f, shift, &reclaim)) {
 							// taken
 						}
-						else if (configure_filter(&sound_pars, hp_filter_widget, idx, false, &hp_filter_f, shift)) {
+						else if (configure_filter(&sound_pars, hp_filter_widget, idx, false, &hp_filter_f, shift, &reclaim)) {
 							// taken
 						}
 						else if (set_up_down_value(idx, midi_ch_widget, 0, 15, &selected_midi_channel, shift)) {
@@ -1501,9 +2152,21 @@ int main(int argc, char *argv[])
 							agc = !agc;
 							settings_menu_buttons[agc_idx].selected = agc;
 						}
-						sleep_ms                 = 60 * 1000 / bpm;
+						else if (idx == midi_sync_idx) {
+							midi_sync = (midi_sync + 1) % 3;
+							settings_menu_buttons[midi_sync_idx].text     = get_midi_sync_name(midi_sync);
+							settings_menu_buttons[midi_sync_idx].selected = midi_sync != ms_none;
+							clock_pll.reset();
+						}
+						else if (idx == preload_idx) {
+							fs_data.finished = false;
+							fs_action = fs_preload;
+							SDL_ShowOpenFileDialog(fs_callback, &fs_data, win, sf_filters, 1, work_path.c_str(), false);
+						}
+						if (midi_sync != ms_slave)  // then the tempo comes from the midi clock
+							sleep_ms         = 60 * 1000 / bpm;
+						sound_pars.master.set(parameter_store::p_volume, vol / 100.);
 						std::lock_guard<std::shared_mutex> lck(sound_pars.sounds_lock);
-						sound_pars.global_volume = vol / 100.;
 						sound_pars.agc_enabled   = agc;
 					}
 					else if (sample_clicked.has_value()) {
@@ -1538,22 +2201,20 @@ int main(int argc, char *argv[])
 							SDL_ShowOpenFileDialog(fs_callback, &fs_data, win, sf_filters_sample, 1, work_path.c_str(), false);
 						}
 						else if (idx == sample_unload_idx) {
-							std::lock_guard<std::shared_mutex> lck(sound_pars.sounds_lock);
 							sample & s = samples[fs_action_sample_index];
 							// menubar text
 							channel_clickables[fs_action_sample_index].text.clear();
-							// remove from queue
-							for(size_t i=0; i<sound_pars.sounds.size();) {
-								if (sound_pars.sounds[i].s == s.s)
-									sound_pars.sounds.erase(sound_pars.sounds.begin() + i);
-								else
-									i++;
-							}
-							// delete sample from pattern
-							delete s.s;
-							s.s = nullptr;
+							// what is playing it finishes, then it is freed
+							swap_sample(&sound_pars, &s, nullptr, &reclaim);
+							patterns_changed = true;
 							s.name.clear();
 						}
+						else if (idx == input_idx) {
+							if (capture.get_state() == pipewire_capture::cs_idle)
+								capture.arm(fs_action_sample_index);
+							else
+								capture.disarm();
+						}
 						else if (idx == mute_idx) {
 							std::lock_guard<std::shared_mutex> lck(sound_pars.sounds_lock);
 							sound_sample *const s = samples[fs_action_sample_index].s;
@@ -1581,12 +2242,14 @@ int main(int argc, char *argv[])
 									s->set_pitch_bend(pitch / 1000.);
 							}
 							else if (idx == n_steps_pars.up) {
-								pat_clickables[fs_action_sample_index].dim = std::min(max_pattern_dim, pat_clickables[fs_action_sample_index].dim + 1);
-								regenerate_pattern_grid(display_mode->w, display_mode->h, &pat_clickables[fs_action_sample_index]);
+								sequence.dim[fs_action_sample_index] = std::min(max_steps, size_t(sequence.dim[fs_action_sample_index] + 1));
+								regenerate_pattern_grid(display_mode->w, display_mode->h, sequence.dim[fs_action_sample_index], &pat_clickables[fs_action_sample_index]);
+								patterns_changed = true;
 							}
 							else if (idx == n_steps_pars.down) {
-								pat_clickables[fs_action_sample_index].dim = std::max(size_t(2), pat_clickables[fs_action_sample_index].dim - 1);
-								regenerate_pattern_grid(display_mode->w, display_mode->h, &pat_clickables[fs_action_sample_index]);
+								sequence.dim[fs_action_sample_index] = std::max(size_t(2), size_t(sequence.dim[fs_action_sample_index] - 1));
+								regenerate_pattern_grid(display_mode->w, display_mode->h, sequence.dim[fs_action_sample_index], &pat_clickables[fs_action_sample_index]);
+								patterns_changed = true;
 							}
 							else if (s == nullptr) {
 								// skip volume when no sample
@@ -1607,20 +2270,25 @@ int main(int argc, char *argv[])
 					if (menu_clicked.has_value())
 						mode = m_pattern;
 					else if (idx.has_value()) {
-						std::lock_guard<std::shared_mutex> pat_lck(pat_clickables_lock);
-						auto & pattern = pat_clickables[pattern_group];
+						patterns_changed = true;
+						auto & pattern      = pat_clickables[pattern_group];
+						int    note_delta   = sequence.note_delta_at  (pattern_group, selected_cell);
+						double volume_left  = sequence.volume_left_at (pattern_group, selected_cell);
+						double volume_right = sequence.volume_right_at(pattern_group, selected_cell);
+
+						if (set_up_down_value(idx.value(), pitch_widget, 0, 127, &note_delta, shift)) {
+							sequence.note_delta_at(pattern_group, selected_cell) = note_delta;
 
-						if (set_up_down_value(idx.value(), pitch_widget, 0, 127, &pattern.note_delta[selected_cell], shift)) {
 							std::unique_lock<std::shared_mutex> lck(sound_pars.sounds_lock);
 							sound_sample *const s = samples[pattern_group].s;
 							if (s)
-								pattern.pattern[selected_cell].text = midi_note_to_name(s->get_base_midi_note() + pattern.note_delta[selected_cell]);
+								pattern.pattern[selected_cell].text = midi_note_to_name(s->get_base_midi_note() + note_delta);
 						}
-						else if (set_up_down_value(idx.value(), cell_volume_left_widget,  &pattern.volume_left [selected_cell], shift)) {
-							// ok
+						else if (set_up_down_value(idx.value(), cell_volume_left_widget,  &volume_left,  shift)) {
+							sequence.volume_left_at (pattern_group, selected_cell) = volume_left;
 						}
-						else if (set_up_down_value(idx.value(), cell_volume_right_widget, &pattern.volume_right[selected_cell], shift)) {
-							// ok
+						else if (set_up_down_value(idx.value(), cell_volume_right_widget, &volume_right, shift)) {
+							sequence.volume_right_at(pattern_group, selected_cell) = volume_right;
 						}
 						else {
 						}
@@ -1630,7 +2298,6 @@ int main(int argc, char *argv[])
 				redraw = true;
 			}
 			else if (event.type == SDL_EVENT_MOUSE_BUTTON_DOWN && (mouse_button_flags & 4) /* right button */) {
-				std::shared_lock<std::shared_mutex> pat_lck(pat_clickables_lock);
 
 				pat_clickable_selected = find_clickable(pat_clickables[pattern_group].pattern, event.button.x, event.button.y);
 				if (pat_clickable_selected.has_value()) {
@@ -1641,7 +2308,6 @@ int main(int argc, char *argv[])
 			else if (event.type == SDL_EVENT_MOUSE_BUTTON_UP) {
 				uint64_t now = get_ms();
 
-				std::lock_guard<std::shared_mutex> pat_lck(pat_clickables_lock);
 				if (pat_clickable_selected.has_value()) {
 					if (now - pat_clickable_pressed_since > long_press_dt) {  // long press?
 						// cell menu
@@ -1649,8 +2315,8 @@ int main(int argc, char *argv[])
 						selected_cell = pat_clickable_selected.value();
 					}
 					else {
-						pat_clickables[pattern_group].pattern[pat_clickable_selected.value()].selected =
-							!pat_clickables[pattern_group].pattern[pat_clickable_selected.value()].selected;
+						sequence.flip(pattern_group, pat_clickable_selected.value());
+						patterns_changed = true;
 					}
 
 					pat_clickable_selected.reset();
@@ -1660,8 +2326,8 @@ int main(int argc, char *argv[])
 			}
 			else if (event.type == SDL_EVENT_KEY_DOWN) {
 				if (event.key.scancode == SDL_SCANCODE_SPACE) {
-					std::lock_guard<std::shared_mutex> pat_lck(pat_clickables_lock);
-					pat_clickables[pattern_group].pattern[pat_index].selected = !pat_clickables[pattern_group].pattern[pat_index].selected;
+					patterns_changed = true;
+					sequence.flip(pattern_group, pat_index);
 					redraw        = true;
 					force_trigger = true;
 				}
@@ -1671,8 +2337,35 @@ int main(int argc, char *argv[])
 				else if (event.key.scancode == SDL_SCANCODE_LCTRL || event.key.scancode == SDL_SCANCODE_RCTRL) {
 					ctrl = true;
 				}
+				else if (event.key.scancode >= SDL_SCANCODE_F1 && event.key.scancode < SDL_SCANCODE_F1 + int(n_scenes)) {
+					size_t              nr     = event.key.scancode - SDL_SCANCODE_F1;
+					scene_loader *const loader = preloaded[nr];
+					std::string         name   = "F" + std::to_string(nr + 1);
+
+					if (shift) {  // forget it; when it is still loading, it is deleted when that has finished
+						if (loader)
+							retired_loaders.push_back(loader);
+						preloaded[nr] = nullptr;
+						menu_status   = "scene " + name + " removed";
+					}
+					else if (!loader || loader->is_finished() == false || !loader->get())
+						menu_status = "scene " + name + " is not ready";
+					else if (switching_scene)
+						menu_status = "already switching to " + get_filename(switching_scene->file_name);
+					else {
+						// scenes are played as patterns, not as a song
+						song_mode = false;
+						pattern_menu[song_idx].selected = false;
+
+						switching_scene = loader->get();
+						delete loader;
+						preloaded[nr]   = nullptr;
+						scenes.pending.store(switching_scene);
+						menu_status     = "switching to " + get_filename(switching_scene->file_name) + " at the next bar";
+					}
+					redraw = true;
+				}
 				else if (event.key.scancode == SDL_SCANCODE_UP || event.key.scancode == SDL_SCANCODE_DOWN) {
-					std::lock_guard<std::shared_mutex> pat_lck(pat_clickables_lock);
 					auto & pattern   = pat_clickables[pattern_group];
 					float  mouse_x   = -1;
 					float  mouse_y   = -1;
@@ -1682,13 +2375,14 @@ int main(int argc, char *argv[])
 					auto   idx       = find_clickable(pat_clickables[pattern_group].pattern, i_mouse_x, i_mouse_y);
 					if (idx.has_value()) {
 						int    change    = shift ? 12 : 1;
-						double direction = event.key.scancode == SDL_SCANCODE_UP ? change : -change;
-						pattern.note_delta[idx.value()] += direction;
+						int    direction = event.key.scancode == SDL_SCANCODE_UP ? change : -change;
+						int    new_delta = change_note_delta(&sequence, pattern_group, idx.value(), direction);
+						patterns_changed = true;
 
 						std::unique_lock<std::shared_mutex> lck(sound_pars.sounds_lock);
 						sound_sample *const s = samples[pattern_group].s;
 						if (s)
-							pattern.pattern[idx.value()].text = midi_note_to_name(s->get_base_midi_note() + pattern.note_delta[idx.value()]);
+							pattern.pattern[idx.value()].text = midi_note_to_name(s->get_base_midi_note() + new_delta);
 						redraw = true;
 					}
 				}
@@ -1700,38 +2394,50 @@ int main(int argc, char *argv[])
 					ctrl = false;
 			}
 			else if (event.type == SDL_EVENT_MOUSE_WHEEL) {
-				std::lock_guard<std::shared_mutex> pat_lck(pat_clickables_lock);
 				auto & pattern = pat_clickables[pattern_group];
 				auto   idx     = find_clickable(pat_clickables[pattern_group].pattern, event.wheel.mouse_x, event.wheel.mouse_y);
 				if (idx.has_value()) {
 					constexpr const int big_change   = 12;
 					constexpr const int small_change = 1;
-					double direction = 0;
+					int direction = 0;
 					if (event.wheel.y < 0)
 						direction = shift ? -big_change : -small_change;
 					else if (event.wheel.y > 0)
 						direction = shift ?  big_change :  small_change;
 
-					pattern.note_delta[idx.value()] += direction;
+					int new_delta = change_note_delta(&sequence, pattern_group, idx.value(), direction);
+					patterns_changed = true;
 
 					std::unique_lock<std::shared_mutex> lck(sound_pars.sounds_lock);
 					sound_sample *const s = samples[pattern_group].s;
 					if (s)
-						pattern.pattern[idx.value()].text = midi_note_to_name(s->get_base_midi_note() + pattern.note_delta[idx.value()]);
+						pattern.pattern[idx.value()].text = midi_note_to_name(s->get_base_midi_note() + new_delta);
 
 					redraw = true;
 				}
 			}
 		}
+
+		if (patterns_changed)
+			publish_patterns(&pattern_snapshot, &sequence, samples);
+		else
+			pattern_snapshot.collect();
+
+		update_song_timeline(&song, &timeline, &song_snapshot, sequence, lround(sleep_ms), polyrythmic, swing_amount, &compiled_enabled, patterns_changed);
+		patterns_changed = false;
 	}
 
 	draw_please_wait(font, screen, display_mode);
 
 	player_thread.join();
 
-	pw_main_loop_quit(sound_pars.pw.loop);
-	sound_pars.pw.th->join();
-	delete sound_pars.pw.th;
+	for(auto & loader: preloaded)
+		delete loader;
+	for(auto & loader: retired_loaders)
+		delete loader;
+
+	backend->end();
+	delete backend;
 
 	{  // stop any recording
 		std::lock_guard<std::shared_mutex> lck(sound_pars.sounds_lock);
@@ -1740,13 +2446,16 @@ int main(int argc, char *argv[])
 	}
 
 	{
-		std::shared_lock<std::shared_mutex> pat_lck(pat_clickables_lock);
-		write_file(path + "/default." PROG_EXT, pat_clickables, samples, file_parameters);
+		file_snapshot final_state = take_snapshot(sequence, samples, file_parameters, &song);
+		if (write_file(path + "/default." PROG_EXT, final_state, save_format))
+			session_journal.finish(final_state);
 	}
 
 	SDL_Quit();
 	deinit_fonts();
 
+	end_pcm_cache_prune();
+
 	pw_deinit();
 
 	return 0;
@@ -4,6 +4,7 @@
 #include <string>
 #include <SDL3/SDL.h>
 
+#include "sequencer.h"
 #include "sound.h"
 
 
@@ -17,13 +18,10 @@ struct clickable {
 	bool        without_bg;
 };
 
+// the on-screen grid of a pattern group; what is played is in sequencer_data
 struct pattern
 {
 	std::vector<clickable> pattern;
-	std::vector<int>       note_delta;
-	std::vector<double>    volume_left;
-	std::vector<double>    volume_right;
-	size_t                 dim;
 };
 
 struct sample
@@ -34,6 +32,4 @@ struct sample
 };
 
 constexpr const int    sample_rate     = 48000;
-constexpr const size_t pattern_groups  = 8;
-constexpr const size_t max_pattern_dim = 32;
 constexpr const int    long_press_dt   = 500;
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include "gui.h"
+#include "io.h"
+#include "sample.h"
+#include "sequencer.h"
+#include "song.h"
+
+using json = nlohmann::json;
+
+
+// the parts of reading and writing .kaboem-files that the journal uses as well
+
+json patterns_to_json(const sequencer_data & data);
+bool patterns_from_json(const json & j, sequencer_data *const data);
+// 'embed_pcm': the sample data goes in the json itself (the original format)
+json to_json(const file_snapshot & snapshot, const bool embed_pcm);
+
+void parameters_from_json(const json & j, const std::vector<file_parameter> *const parameters);
+// parameters (unless 'parameters' is nullptr), patterns and the song: everything but the samples
+bool metadata_from_json(const json & j, sequencer_data *const data, const std::vector<file_parameter> *const parameters, song_data *const song);
+// 'midi_note' is -1 when it is not known; the pcm is not set
+file_snapshot::sample_entry sample_entry_from_json(const json & entry, const int midi_note);
+// 'get_pcm' returns the audio of a sample entry (or nothing). the sound_sample of 's' must have been taken out
+// (e.g. retired) by the caller.
+bool sample_from_json(const json & entry, const int midi_note, sample *const s, const size_t n_outputs,
+		const std::function<std::shared_ptr<const sample_pcm>(const json & entry)> & get_pcm);
+// 'make_fetch' returns how the audio of a sample entry is fetched
+std::vector<pending_sample> pending_samples_from_json(const json & j, const std::function<pcm_fetch(const size_t group, const json & entry)> & make_fetch);
+// fetches them all at the same time and puts them in 'sample_files' (idem: taken out by the caller)
+bool load_pending_samples(std::vector<pending_sample> & pending, std::vector<sample> *const sample_files, const size_t n_outputs);
+bool samples_from_json(const json & j, std::vector<sample> *const sample_files, const size_t n_outputs,
+		const std::function<std::shared_ptr<const sample_pcm>(const size_t group, const json & entry)> & get_pcm);
+
+// 'progress' (when set) counts the bytes that were written
+bool write_all(const int fd, const void *const p, const size_t n, uint64_t *const progress = nullptr);
+// writes 'file_name' via a temporary file that is synced and then renamed
+bool replace_file(const std::string & file_name, const std::function<bool(const int fd)> & write_contents);
@@ -1,11 +1,28 @@
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <map>
 #include <nlohmann/json.hpp>
+#include <variant>
+#include <sndfile.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "gui.h"
 #include "io.h"
+#include "io-json.h"
+#include "sample.h"
+#include "sequencer.h"
+#include "song.h"
+#include "time.h"
+#include "worker-pool.h"
 
-using json = nlohmann::json;
 
 
 std::string get_dirname(const std::string & path)
@@ -24,26 +41,23 @@ std::string get_filename(const std::string & path)
 	return path.substr(slash + 1);
 }
 
-bool write_file(const std::string & file_name, const std::array<pattern, pattern_groups> & data, const std::array<sample, pattern_groups> & sample_files,
-		const std::vector<file_parameter> & parameters)
+json patterns_to_json(const sequencer_data & data)
 {
 	json patterns = json::array();
-	for(auto & group: data) {
+	for(size_t group=0; group<data.n_groups; group++) {
 		json group_pattern      = json::array();
-		for(auto & element: group.pattern)
-			group_pattern.push_back(element.selected);
 		json group_note_delta   = json::array();
-		for(auto & element: group.note_delta)
-			group_note_delta.push_back(element);
 		json group_volume_left  = json::array();
-		for(auto & element: group.volume_left)
-			group_volume_left.push_back(element);
 		json group_volume_right = json::array();
-		for(auto & element: group.volume_right)
-			group_volume_right.push_back(element);
+		for(size_t i=0; i<data.max_dim; i++) {
+			group_pattern     .push_back(data.is_set(group, i));
+			group_note_delta  .push_back(int   (data.note_delta_at  (group, i)));
+			group_volume_left .push_back(double(data.volume_left_at (group, i)));
+			group_volume_right.push_back(double(data.volume_right_at(group, i)));
+		}
 
 		json pattern_data;
-		pattern_data["dim"]          = group.dim;
+		pattern_data["dim"]          = data.dim[group];
 		pattern_data["pattern"]      = group_pattern;
 		pattern_data["note-delta"]   = group_note_delta;
 		pattern_data["volume-left"]  = group_volume_left;
@@ -52,36 +66,208 @@ bool write_file(const std::string & file_name, const std::array<pattern, pattern
 		patterns.push_back(pattern_data);
 	}
 
-	json samples    = json::array();
-	json midi_notes = json::array();
+	return patterns;
+}
+
+// binary .kaboem-files: a preamble, then the pcm of each sample in a chunk (aligned so that it can be mmap'ed
+// directly), then the json with everything else. the json is at the end so that the chunk offsets are known
+// when it is written.
+struct container_preamble
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t metadata_offset;
+	uint64_t metadata_size;
+};
+
+static const char         container_magic[8] = { 'K', 'A', 'B', 'O', 'E', 'M', '\x1a', '\n' };
+constexpr const uint32_t  container_version  = 1;
+constexpr const uint64_t  chunk_alignment    = 65536;  // a multiple of the page size on all platforms
+
+// memory as a file for sf_open_virtual
+struct memory_file
+{
+	std::vector<uint8_t> data;
+	sf_count_t           pos { 0 };
+};
+
+static sf_count_t mf_get_filelen(void *user)
+{
+	return static_cast<memory_file *>(user)->data.size();
+}
+
+static sf_count_t mf_seek(sf_count_t offset, int whence, void *user)
+{
+	memory_file *mf = static_cast<memory_file *>(user);
+	if (whence == SF_SEEK_CUR)
+		offset += mf->pos;
+	else if (whence == SF_SEEK_END)
+		offset += mf->data.size();
+	mf->pos = std::max(sf_count_t(0), offset);
+	return mf->pos;
+}
+
+static sf_count_t mf_read(void *ptr, sf_count_t count, void *user)
+{
+	memory_file *mf = static_cast<memory_file *>(user);
+	count = std::max(sf_count_t(0), std::min(count, sf_count_t(mf->data.size()) - mf->pos));
+	memcpy(ptr, mf->data.data() + mf->pos, count);
+	mf->pos += count;
+	return count;
+}
+
+static sf_count_t mf_write(const void *ptr, sf_count_t count, void *user)
+{
+	memory_file *mf = static_cast<memory_file *>(user);
+	if (size_t(mf->pos + count) > mf->data.size())
+		mf->data.resize(mf->pos + count);
+	memcpy(mf->data.data() + mf->pos, ptr, count);
+	mf->pos += count;
+	return count;
+}
+
+static sf_count_t mf_tell(void *user)
+{
+	return static_cast<memory_file *>(user)->pos;
+}
+
+static SF_VIRTUAL_IO memory_file_io { mf_get_filelen, mf_seek, mf_read, mf_write, mf_tell };
+
+// flac is lossless, but for 24 bit samples: not for the doubles that kaboem uses
+static bool encode_flac(const sample_pcm & pcm, std::vector<uint8_t> *const out)
+{
+	memory_file mf;
+	SF_INFO     si { };
+	si.samplerate = pcm.sample_rate;
+	si.channels   = pcm.n_channels;
+	si.format     = SF_FORMAT_FLAC | SF_FORMAT_PCM_24;
+
+	SNDFILE *sh = sf_open_virtual(&memory_file_io, SFM_WRITE, &si, &mf);
+	if (!sh)
+		return false;
+	bool ok = sf_writef_double(sh, pcm.frames, pcm.n_frames) == sf_count_t(pcm.n_frames);
+	sf_close(sh);
+
+	out->swap(mf.data);
+	return ok;
+}
+
+static bool decode_flac(std::vector<uint8_t> && in, std::vector<double> *const out, const size_t n_frames, const size_t n_channels)
+{
+	memory_file mf;
+	mf.data.swap(in);
+	SF_INFO     si { };
+
+	SNDFILE *sh = sf_open_virtual(&memory_file_io, SFM_READ, &si, &mf);
+	if (!sh)
+		return false;
+
+	out->resize(n_frames * n_channels);
+	bool ok = size_t(si.channels) == n_channels && sf_readf_double(sh, out->data(), n_frames) == sf_count_t(n_frames);
+	sf_close(sh);
+
+	return ok;
+}
+
+// 'progress' (when set) counts the bytes that were written
+bool write_all(const int fd, const void *const p, const size_t n, uint64_t *const progress)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(p);
+	size_t         done  = 0;
+	while(done < n) {
+		// in pieces so that the progress can be shown
+		ssize_t rc = write(fd, bytes + done, std::min(n - done, size_t(1024 * 1024)));
+		if (rc == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		done += rc;
+		if (progress)
+			*progress += rc;
+	}
+	return true;
+}
+
+file_snapshot take_snapshot(const sequencer_data & data, const std::vector<sample> & sample_files,
+		const std::vector<file_parameter> & parameters, const song_data *const song)
+{
+	file_snapshot snapshot { data, { }, { }, { } };
+
 	for(auto & sample_file : sample_files) {
-		json sample;
-		sample["file-name"] = sample_file.name;
+		file_snapshot::sample_entry entry;
+		entry.name      = sample_file.name;
+		entry.midi_note = sample_file.midi_note;
 
 		if (sample_file.s) {
-			sample["vol-left"]    = sample_file.s->get_mapping_target_volume(0);
-			if (sample_file.s->get_n_channels() >= 2)
-				sample["vol-right"] = sample_file.s->get_mapping_target_volume(1);
-			else
-				sample["vol-right"] = sample_file.s->get_mapping_target_volume(0);
-			sample["pitch"]       = sample_file.s->get_pitch_bend();
-			sample["mute"]        = sample_file.s->get_mute();
+			entry.pcm       = sample_file.s->get_pcm();
+			entry.vol_left  = sample_file.s->get_mapping_target_volume(0);
+			entry.vol_right = sample_file.s->get_mapping_target_volume(sample_file.s->get_n_channels() >= 2 ? 1 : 0);
+			entry.pitch     = sample_file.s->get_pitch_bend();
+			entry.mute      = sample_file.s->get_mute();
+		}
+
+		snapshot.samples.push_back(entry);
+	}
 
-			const std::vector<std::vector<double> > & sample_data = sample_file.s->get_raw();
-			sample["data"]        = sample_data;
-			sample["sample-rate"] = sample_file.s->get_sample_rate();
+	for(auto & element: parameters) {
+		if (element.type == file_parameter::T_FLOAT) {
+			if (element.d_value)
+				snapshot.parameters.push_back({ element.name, *element.d_value });
+			else if (element.od_value->has_value())
+				snapshot.parameters.push_back({ element.name, element.od_value->value() });
 		}
-		else {
-			sample["vol-left"]    = 0.;
-			sample["vol-right"]   = 0.;
-			sample["pitch"]       = 1.;
-			sample["mute"]        = false;
+		else if (element.type == file_parameter::T_INT) {
+			if (element.i_value)
+				snapshot.parameters.push_back({ element.name, *element.i_value });
+			else if (element.oi_value->has_value())
+				snapshot.parameters.push_back({ element.name, element.oi_value->value() });
+		}
+		else if (element.type == file_parameter::T_BOOL)
+			snapshot.parameters.push_back({ element.name, *element.b_value });
+		else if (element.type == file_parameter::T_ABOOL) {
+			snapshot.parameters.push_back({ element.name, bool(*element.ab_value) });
+		}
+	}
+
+	if (song && song->arrangement.empty() == false)
+		snapshot.song = *song;
+
+	return snapshot;
+}
+
+// 'embed_pcm': the sample data goes in the json itself (the original format)
+json to_json(const file_snapshot & snapshot, const bool embed_pcm)
+{
+	json patterns = patterns_to_json(snapshot.data);
+
+	json samples    = json::array();
+	json midi_notes = json::array();
+	for(auto & entry : snapshot.samples) {
+		json sample;
+		sample["file-name"]   = entry.name;
+		sample["vol-left"]    = entry.vol_left;
+		sample["vol-right"]   = entry.vol_right;
+		sample["pitch"]       = entry.pitch;
+		sample["mute"]        = entry.mute;
+
+		if (entry.pcm) {
+			sample["sample-rate"] = entry.pcm->sample_rate;
+
+			if (embed_pcm) {
+				const sample_pcm & pcm = *entry.pcm;
+				json sample_data = json::array();
+				for(size_t i=0; i<pcm.n_frames; i++)
+					sample_data.push_back(std::vector<double>(pcm.get_frame(i), pcm.get_frame(i) + pcm.n_channels));
+				sample["data"]        = sample_data;
+			}
 		}
 
 		samples.push_back(sample);
 
-		if (sample_file.midi_note.has_value())
-			midi_notes.push_back(sample_file.midi_note.value());
+		if (entry.midi_note.has_value())
+			midi_notes.push_back(entry.midi_note.value());
 		else
 			midi_notes.push_back(-1);
 	}
@@ -91,148 +277,789 @@ bool write_file(const std::string & file_name, const std::array<pattern, pattern
 	out["samples"]          = samples;
 	out["midi-notes"]       = midi_notes;
 
-	for(auto & element: parameters) {
-		if (element.type == file_parameter::T_FLOAT) {
-			if (element.d_value)
-				out[element.name] = *element.d_value;
-			else if (element.od_value->has_value())
-				out[element.name] = element.od_value->value();
-		}
-		else if (element.type == file_parameter::T_INT) {
-			if (element.i_value)
-				out[element.name] = *element.i_value;
-			else if (element.oi_value->has_value())
-				out[element.name] = element.oi_value->value();
+	if (snapshot.song.has_value()) {
+		const song_data & song = snapshot.song.value();
+
+		json song_patterns = json::array();
+		for(size_t i=0; i<song.patterns.size(); i++)
+			song_patterns.push_back(i == song.current ? patterns : patterns_to_json(song.patterns[i]));
+
+		json song_data;
+		song_data["patterns"]    = song_patterns;
+		song_data["arrangement"] = song.arrangement;
+		song_data["current"]     = song.current;
+		out["song"]              = song_data;
+	}
+
+	for(auto & element: snapshot.parameters)
+		std::visit([&out, &element](const auto & value) { out[element.first] = value; }, element.second);
+
+	return out;
+}
+
+static bool write_json_file(const int fd, const json & out, std::atomic<double> *const progress)
+{
+	std::string text = out.dump();
+	bool        ok   = write_all(fd, text.data(), text.size());
+	if (ok && progress)
+		*progress = 1.;
+	return ok;
+}
+
+static bool write_container(const int fd, json *const out, const file_snapshot & snapshot, const bool compress, std::atomic<double> *const progress)
+{
+	container_preamble preamble { };
+	bool               ok       = write_all(fd, &preamble, sizeof preamble);
+	uint64_t           offset   = sizeof preamble;
+
+	// a sample that is used in more than one channel is stored once
+	std::map<const sample_pcm *, json> chunks;
+
+	uint64_t total   = 1;
+	for(auto & entry: snapshot.samples) {
+		if (entry.pcm)
+			total += entry.pcm->get_size_in_bytes();
+	}
+	uint64_t written = 0;
+
+	for(size_t group=0; group<snapshot.samples.size() && ok; group++) {
+		if (!snapshot.samples[group].pcm)
+			continue;
+
+		const sample_pcm & pcm = *snapshot.samples[group].pcm;
+		auto               it  = chunks.find(&pcm);
+		if (it != chunks.end()) {
+			(*out)["samples"][group]["chunk"] = it->second;
+			continue;
 		}
-		else if (element.type == file_parameter::T_BOOL)
-			out[element.name] = *element.b_value;
-		else if (element.type == file_parameter::T_ABOOL) {
-			out[element.name] = bool(*element.ab_value);
+
+		std::vector<uint8_t> encoded;
+		bool                 is_flac = compress && encode_flac(pcm, &encoded);
+		const void          *bytes   = is_flac ? static_cast<const void *>(encoded.data()) : static_cast<const void *>(pcm.frames);
+		size_t               n_bytes = is_flac ? encoded.size() : pcm.get_size_in_bytes();
+
+		uint64_t chunk_offset = (offset + chunk_alignment - 1) / chunk_alignment * chunk_alignment;
+		std::vector<uint8_t> padding(chunk_offset - offset);
+		ok = write_all(fd, padding.data(), padding.size());
+
+		uint64_t chunk_written = 0;
+		if (ok) {
+			// for flac, the progress is in uncompressed bytes
+			const uint8_t *p     = static_cast<const uint8_t *>(bytes);
+			const size_t   piece = 1024 * 1024;
+			for(size_t done=0; done<n_bytes && ok; done += piece) {
+				ok = write_all(fd, p + done, std::min(piece, n_bytes - done), &chunk_written);
+				if (progress)
+					*progress = (written + chunk_written * pcm.get_size_in_bytes() / n_bytes) / double(total);
+			}
 		}
+		written += pcm.get_size_in_bytes();
+		offset   = chunk_offset + n_bytes;
+
+		json chunk;
+		chunk["offset"]            = chunk_offset;
+		chunk["size"]              = n_bytes;
+		chunk["encoding"]          = is_flac ? "flac" : "f64";
+		chunk["frames"]            = pcm.n_frames;
+		chunk["channels"]          = pcm.n_channels;
+		chunk["hash"]              = pcm.hash;
+		chunk["loudest-frequency"] = pcm.loudest_frequency;
+
+		(*out)["samples"][group]["chunk"] = chunk;
+		chunks.insert({ &pcm, chunk });
 	}
 
-	try {
-		std::ofstream o(file_name);
-		o.exceptions(std::ifstream::badbit);
-		o << out;
+	(*out)["little-endian"] = std::endian::native == std::endian::little;
 
-		return true;
+	std::string metadata = out->dump();
+	if (ok)
+		ok = write_all(fd, metadata.data(), metadata.size());
+
+	memcpy(preamble.magic, container_magic, sizeof preamble.magic);
+	preamble.version         = container_version;
+	preamble.metadata_offset = offset;
+	preamble.metadata_size   = metadata.size();
+	if (ok)
+		ok = pwrite(fd, &preamble, sizeof preamble, 0) == sizeof preamble;
+
+	if (ok && progress)
+		*progress = 1.;
+
+	return ok;
+}
+
+// written next to it and then renamed: samples from the file that is overwritten may still be mmap'ed
+// and a crash while writing leaves the previous version intact
+bool replace_file(const std::string & file_name, const std::function<bool(const int fd)> & write_contents)
+{
+	std::string temp_name = file_name + ".tmp";
+
+	int fd = open(temp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		printf("Cannot create %s: %s\n", temp_name.c_str(), strerror(errno));
+		return false;
 	}
-	catch(const std::ifstream::failure& e) {
-		printf("Cannot access %s\n", file_name.c_str());
+
+	bool ok = write_contents(fd);
+	if (ok)
+		ok = fsync(fd) == 0;
+	if (close(fd) == -1)
+		ok = false;
+	if (ok)
+		ok = rename(temp_name.c_str(), file_name.c_str()) == 0;
+
+	if (!ok) {
+		printf("Cannot write %s: %s\n", file_name.c_str(), strerror(errno));
+		unlink(temp_name.c_str());
+		return false;
+	}
+
+	// make the rename itself durable
+	int dir_fd = open(get_dirname(file_name).c_str(), O_RDONLY | O_DIRECTORY);
+	if (dir_fd != -1) {
+		fsync(dir_fd);
+		close(dir_fd);
 	}
 
-	return false;
+	return true;
 }
 
-bool read_file(const std::string & file_name, std::array<pattern, pattern_groups> *const data, std::array<sample, pattern_groups> *const sample_files,
-		const std::vector<file_parameter> *const parameters)
+bool write_file(const std::string & file_name, const file_snapshot & snapshot, const file_format format, std::atomic<double> *const progress)
 {
-	try {
-		std::ifstream ifs(file_name);
-		if (ifs.is_open() == false) {
-			printf("Cannot access file\n");
+	uint64_t start = get_us();
+
+	if (progress)
+		*progress = 0.;
+
+	json out = to_json(snapshot, format == ff_json);
+
+	bool ok = replace_file(file_name, [&](const int fd) {
+			return format == ff_json ? write_json_file(fd, out, progress) : write_container(fd, &out, snapshot, format == ff_binary_flac, progress);
+		});
+
+	if (ok)
+		printf("Saved %s in %.1f ms\n", file_name.c_str(), (get_us() - start) / 1000.);
+
+	return ok;
+}
+
+bool write_file(const std::string & file_name, const sequencer_data & data, const std::vector<sample> & sample_files,
+		const std::vector<file_parameter> & parameters, const song_data *const song, const file_format format)
+{
+	return write_file(file_name, take_snapshot(data, sample_files, parameters, song), format);
+}
+
+// files can have been made with a different number of pattern groups or steps
+bool patterns_from_json(const json & j, sequencer_data *const data)
+{
+	size_t n_groups = std::min(j.size(), data->n_groups);
+	if (j.size() > n_groups)
+		printf("File has %zu pattern groups, only the first %zu are used\n", j.size(), n_groups);
+
+	for(size_t group=0; group<n_groups; group++) {
+		size_t dim = j[group]["dim"];
+		if (dim < 2 || dim > data->max_dim) {
+			printf("pattern %zu has an invalid step count (%zu, maximum is %zu)\n", group, dim, data->max_dim);
 			return false;
 		}
-		ifs.exceptions(std::ifstream::badbit);
+		data->dim[group] = dim;
+		data->clear(group);
 
-		json j = json::parse(ifs);
-
-		for(auto & element: *parameters) {
-			if (j.contains(element.name)) {
-				if (element.type == file_parameter::T_FLOAT) {
-					if (element.d_value)
-						*element.d_value = j[element.name];
-					else
-						*element.od_value = j[element.name];
-				}
-				else if (element.type == file_parameter::T_INT) {
-					if (element.i_value)
-						*element.i_value = j[element.name];
-					else
-						*element.oi_value = j[element.name];
-				}
-				else if (element.type == file_parameter::T_BOOL)
-					*element.b_value = j[element.name];
-				else if (element.type == file_parameter::T_ABOOL) {
-					*element.ab_value = j[element.name];
-				}
+		size_t index_note_delta = 0;
+		for(auto & element: j[group]["note-delta"]) {
+			if (index_note_delta < data->max_dim)
+				data->note_delta_at(group, index_note_delta) = std::clamp(int(element), -127, 127);
+			index_note_delta++;
+		}
+
+		size_t index_pattern    = 0;
+		for(auto & element: j[group]["pattern"]) {
+			if (index_pattern < data->max_dim)
+				data->set(group, index_pattern, element);
+			index_pattern++;
+		}
+
+		if (j[group].contains("volume-left")) {
+			size_t index_volume_left = 0;
+			for(auto & element: j[group]["volume-left"]) {
+				if (index_volume_left < data->max_dim)
+					data->volume_left_at(group, index_volume_left) = element;
+				index_volume_left++;
+			}
+			size_t index_volume_right = 0;
+			for(auto & element: j[group]["volume-right"]) {
+				if (index_volume_right < data->max_dim)
+					data->volume_right_at(group, index_volume_right) = element;
+				index_volume_right++;
 			}
 		}
 
-		for(size_t group=0; group<pattern_groups; group++) {
-			(*data)[group].dim   = j["patterns"][group]["dim"];
-			auto & group_data    = (*data)[group];
+		if (index_pattern < dim || index_note_delta != index_pattern) {
+			printf("note-delta count (%zu) or pattern count (%zu) not %zu\n", index_note_delta, index_pattern, dim);
+			return false;
+		}
+	}
 
-			size_t index_note_delta = 0;
-			for(auto & element: j["patterns"][group]["note-delta"])
-				group_data.note_delta[index_note_delta++]          = element;
+	for(size_t group=n_groups; group<data->n_groups; group++)
+		data->clear(group);
 
-			size_t index_pattern    = 0;
-			for(auto & element: j["patterns"][group]["pattern"])
-				group_data.pattern   [index_pattern++   ].selected = element;
+	return true;
+}
 
-			if (j["patterns"][group].contains("volume-left")) {
-				size_t index_volume_left = 0;
-				for(auto & element: j["patterns"][group]["volume-left"])
-					group_data.volume_left[index_volume_left++]   = element;
-				size_t index_volume_right = 0;
-				for(auto & element: j["patterns"][group]["volume-right"])
-					group_data.volume_right[index_volume_right++] = element;
+void parameters_from_json(const json & j, const std::vector<file_parameter> *const parameters)
+{
+	for(auto & element: *parameters) {
+		if (j.contains(element.name)) {
+			if (element.type == file_parameter::T_FLOAT) {
+				if (element.d_value)
+					*element.d_value = j[element.name];
+				else
+					*element.od_value = j[element.name];
 			}
-			else {
-				for(size_t i=0; i<index_note_delta; i++) {
-					group_data.volume_left[i]                  = 1.;
-					group_data.volume_right[i]                 = 1.;
-				}
+			else if (element.type == file_parameter::T_INT) {
+				if (element.i_value)
+					*element.i_value = j[element.name];
+				else
+					*element.oi_value = j[element.name];
 			}
-
-			if (index_pattern < (*data)[group].dim || index_note_delta != index_pattern) {
-				printf("note-delta count (%zu) or pattern count (%zu) not %zu\n", index_note_delta, index_pattern, (*data)[group].dim);
-				return false;
+			else if (element.type == file_parameter::T_BOOL)
+				*element.b_value = j[element.name];
+			else if (element.type == file_parameter::T_ABOOL) {
+				*element.ab_value = j[element.name];
 			}
 		}
+	}
+}
 
-		for(size_t group=0; group<pattern_groups; group++) {
-			sample & s = (*sample_files)[group];
-			s.name = j["samples"][group]["file-name"];
-			delete s.s;
-			s.s = nullptr;
+// like parameters_from_json(), but nothing is changed: the values are returned
+static parameter_values parameter_values_from_json(const json & j, const std::vector<file_parameter> & parameters)
+{
+	parameter_values values;
 
-			if (j.contains("midi-notes")) {
-				int note = j["midi-notes"][group];
-				if (note != -1)
-					s.midi_note = note;
-			}
+	for(auto & element: parameters) {
+		if (j.contains(element.name)) {
+			if (element.type == file_parameter::T_FLOAT)
+				values.push_back({ element.name, double(j[element.name]) });
+			else if (element.type == file_parameter::T_INT)
+				values.push_back({ element.name, int(j[element.name]) });
+			else
+				values.push_back({ element.name, bool(j[element.name]) });
+		}
+	}
 
-			if (s.name.empty() == false) {
-				printf("Loading \"%s\"...\n", s.name.c_str());
-				const std::vector<std::vector<double> > sample_data = j["samples"][group]["data"];
-				s.s = new sound_sample(sample_rate, s.name, sample_data, j["samples"][group]["sample-rate"]);
-				if (s.s->begin() == false) {
-					delete s.s;
-					s.s = nullptr;
-					s.name.clear();
-					printf("Cannot init sample %s\n", s.name.c_str());
-				}
-				if (!s.s)
-					return false;
-				bool is_stereo = s.s->get_n_channels() >= 2;
-				s.s->add_mapping(0, 0, j["samples"][group]["vol-left"]);
-				if (is_stereo)
-					s.s->add_mapping(1, 1, j["samples"][group]["vol-right"]);
+	return values;
+}
+
+void set_parameters(const parameter_values & values, const std::vector<file_parameter> & parameters)
+{
+	for(auto & value: values) {
+		for(auto & element: parameters) {
+			if (element.name != value.first)
+				continue;
+
+			if (element.type == file_parameter::T_FLOAT) {
+				if (element.d_value)
+					*element.d_value = std::get<double>(value.second);
 				else
-					s.s->add_mapping(0, 1, 1.0);  // mono -> right
-				s.s->set_pitch_bend(j["samples"][group]["pitch"]);
-				if (j["samples"][group].contains("mute"))
-					s.s->set_mute(j["samples"][group]["mute"]);
+					*element.od_value = std::get<double>(value.second);
+			}
+			else if (element.type == file_parameter::T_INT) {
+				if (element.i_value)
+					*element.i_value = std::get<int>(value.second);
 				else
-					s.s->set_mute(false);
+					*element.oi_value = std::get<int>(value.second);
 			}
+			else if (element.type == file_parameter::T_BOOL)
+				*element.b_value = std::get<bool>(value.second);
+			else if (element.type == file_parameter::T_ABOOL)
+				*element.ab_value = std::get<bool>(value.second);
 		}
+	}
+}
+
+// parameters (unless 'parameters' is nullptr), patterns and the song: everything but the samples
+bool metadata_from_json(const json & j, sequencer_data *const data, const std::vector<file_parameter> *const parameters, song_data *const song)
+{
+	if (parameters)
+		parameters_from_json(j, parameters);
+
+	if (patterns_from_json(j["patterns"], data) == false)
+		return false;
+
+	if (song) {
+		song_data new_song;
+
+		if (j.contains("song")) {
+			for(auto & element: j["song"]["patterns"]) {
+				sequencer_data pattern = *data;
+				if (patterns_from_json(element, &pattern) == false)
+					return false;
+				new_song.patterns.push_back(pattern);
+			}
+
+			for(auto & element: j["song"]["arrangement"]) {
+				size_t nr = element;
+				if (nr < new_song.patterns.size())
+					new_song.arrangement.push_back(nr);
+			}
+
+			new_song.current = j["song"]["current"];
+		}
+
+		if (new_song.current >= new_song.patterns.size()) {
+			new_song.patterns.push_back(*data);
+			new_song.current = new_song.patterns.size() - 1;
+		}
+
+		*song = new_song;
+	}
 
+	return true;
+}
+
+file_snapshot::sample_entry sample_entry_from_json(const json & entry, const int midi_note)
+{
+	file_snapshot::sample_entry out;
+	out.name      = entry["file-name"];
+	if (midi_note != -1)
+		out.midi_note = midi_note;
+	out.vol_left  = entry.value("vol-left",  1.);
+	out.vol_right = entry.value("vol-right", 1.);
+	out.pitch     = entry.value("pitch",     1.);
+	out.mute      = entry.value("mute",      false);
+	return out;
+}
+
+sound_sample *create_sample(const file_snapshot::sample_entry & entry, const size_t n_outputs)
+{
+	sound_sample *s = new sound_sample(sample_rate, n_outputs, entry.name, entry.pcm);
+	if (s->begin() == false) {
+		delete s;
+		return nullptr;
+	}
+
+	bool is_stereo = s->get_n_channels() >= 2;
+	s->add_default_mapping(entry.vol_left, is_stereo ? entry.vol_right : 1.0);  // mono -> right
+	s->set_pitch_bend(entry.pitch);
+	s->set_mute(entry.mute);
+
+	return s;
+}
+
+// 'entry.pcm' is set when there is a sample
+static bool install_sample(const file_snapshot::sample_entry & entry, sample *const s, const size_t n_outputs)
+{
+	s->s    = nullptr;
+	s->name = entry.name;
+	if (entry.midi_note.has_value())
+		s->midi_note = entry.midi_note.value();
+
+	if (s->name.empty())
+		return true;
+
+	if (entry.pcm)
+		s->s = create_sample(entry, n_outputs);
+	if (!s->s) {
+		printf("Cannot init sample %s\n", s->name.c_str());
+		s->name.clear();
+		return false;
+	}
+
+	return true;
+}
+
+bool sample_from_json(const json & entry, const int midi_note, sample *const s, const size_t n_outputs,
+		const std::function<std::shared_ptr<const sample_pcm>(const json & entry)> & get_pcm)
+{
+	file_snapshot::sample_entry e = sample_entry_from_json(entry, midi_note);
+	if (e.name.empty() == false) {
+		printf("Loading \"%s\"...\n", e.name.c_str());
+		e.pcm = get_pcm(entry);
+	}
+
+	return install_sample(e, s, n_outputs);
+}
+
+std::vector<pending_sample> pending_samples_from_json(const json & j, const std::function<pcm_fetch(const size_t group, const json & entry)> & make_fetch)
+{
+	std::vector<pending_sample> out;
+
+	for(size_t group=0; group<j["samples"].size(); group++) {
+		const json & entry     = j["samples"][group];
+		int          midi_note = j.contains("midi-notes") ? int(j["midi-notes"][group]) : -1;
+
+		pending_sample p { sample_entry_from_json(entry, midi_note), { } };
+		if (p.entry.name.empty() == false)
+			p.fetch = make_fetch(group, entry);
+		out.push_back(std::move(p));
+	}
+
+	return out;
+}
+
+bool load_pending_samples(std::vector<pending_sample> & pending, std::vector<sample> *const sample_files, const size_t n_outputs)
+{
+	// decoding and analyzing is what takes time; that is done for all groups at the same time
+	size_t                          n_groups = std::min(sample_files->size(), pending.size());
+	std::vector<std::exception_ptr> errors(n_groups);
+	{
+		worker_pool pool;
+		for(size_t group=0; group<n_groups; group++) {
+			if (!pending[group].fetch)
+				continue;
+
+			printf("Loading \"%s\"...\n", pending[group].entry.name.c_str());
+			pool.queue([&, group] {
+					try {
+						pending[group].entry.pcm = pending[group].fetch(nullptr);
+					}
+					catch(...) {
+						errors[group] = std::current_exception();
+					}
+				});
+		}
+		pool.wait();
+	}
+	for(auto & error: errors) {
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	for(size_t group=0; group<sample_files->size(); group++) {
+		sample & s = (*sample_files)[group];
+		if (group >= pending.size()) {
+			s.s = nullptr;
+			s.name.clear();
+			continue;
+		}
+
+		if (install_sample(pending[group].entry, &s, n_outputs) == false)
+			return false;
+	}
+
+	return true;
+}
+
+bool samples_from_json(const json & j, std::vector<sample> *const sample_files, const size_t n_outputs,
+		const std::function<std::shared_ptr<const sample_pcm>(const size_t group, const json & entry)> & get_pcm)
+{
+	auto pending = pending_samples_from_json(j, [&get_pcm](const size_t group, const json & entry) -> pcm_fetch {
+			return [&get_pcm, group, entry](std::atomic<double> *const) { return get_pcm(group, entry); };
+		});
+
+	return load_pending_samples(pending, sample_files, n_outputs);
+}
+
+// decoded sample data of one pattern group
+struct streamed_pcm
+{
+	std::vector<double> interleaved;
+	size_t              n_channels { 0 };
+};
+
+// sax handler for files in the original format: builds the json document, except for the sample data
+// ("samples" -> [group] -> "data"), which goes straight into interleaved buffers. the data is by far
+// the biggest part and would otherwise be in memory three times (text, json document and pcm).
+class legacy_sax_loader
+{
+private:
+	std::vector<json *> stack;
+	std::string         last_key;
+	json               *samples_array { nullptr };
+
+	int                 data_depth    { 0 };  // > 0: inside a "data" array
+	size_t              row_size      { 0 };
+	streamed_pcm        current;
+
+	json *add(json && value)
+	{
+		if (stack.empty()) {
+			root = std::move(value);
+			return &root;
+		}
+
+		json *parent = stack.back();
+		if (parent->is_array()) {
+			parent->push_back(std::move(value));
+			return &parent->back();
+		}
+
+		(*parent)[last_key] = std::move(value);
+		return &(*parent)[last_key];
+	}
+
+	bool value(json && v)
+	{
+		if (data_depth == 0) {
+			add(std::move(v));
+			return true;
+		}
+		if (data_depth != 2 || v.is_number() == false)
+			return false;
+
+		current.interleaved.push_back(v.get<double>());
+		row_size++;
+		return true;
+	}
+
+public:
+	json                             root;
+	std::map<size_t, streamed_pcm>   pcm;  // per pattern group
+	std::string                      error;
+
+	bool null()                                                  { return value(nullptr); }
+	bool boolean(bool v)                                         { return value(v);       }
+	bool number_integer(json::number_integer_t v)                { return value(v);       }
+	bool number_unsigned(json::number_unsigned_t v)              { return value(v);       }
+	bool number_float(json::number_float_t v, const std::string &) { return value(v);     }
+	bool string(std::string & v)                                 { return value(v);       }
+	bool binary(json::binary_t &)                                { return false;          }
+
+	bool key(std::string & v)
+	{
+		last_key = v;
+		return data_depth == 0;
+	}
+
+	bool start_object(std::size_t)
+	{
+		if (data_depth)
+			return false;
+		stack.push_back(add(json::object()));
+		return true;
+	}
+
+	bool end_object()
+	{
+		stack.pop_back();
 		return true;
 	}
+
+	bool start_array(std::size_t)
+	{
+		if (data_depth) {  // a frame
+			if (++data_depth > 2)
+				return false;
+			row_size = 0;
+			return true;
+		}
+
+		if (stack.size() == 3 && stack[1] == samples_array && stack[2]->is_object() && last_key == "data") {
+			data_depth = 1;
+			current    = { };
+			return true;
+		}
+
+		stack.push_back(add(json::array()));
+		if (stack.size() == 2 && last_key == "samples")
+			samples_array = stack.back();
+		return true;
+	}
+
+	bool end_array()
+	{
+		if (data_depth == 2) {
+			data_depth = 1;
+			if (current.n_channels == 0)
+				current.n_channels = row_size;
+			return row_size == current.n_channels && row_size > 0;
+		}
+
+		if (data_depth == 1) {
+			data_depth = 0;
+			pcm[samples_array->size() - 1] = std::move(current);
+			return true;
+		}
+
+		stack.pop_back();
+		return true;
+	}
+
+	bool parse_error(std::size_t position, const std::string &, const json::exception & e)
+	{
+		error = "at " + std::to_string(position) + ": " + e.what();
+		return false;
+	}
+};
+
+// the original format: one json document with the sample data in it
+static bool read_json_file(std::ifstream & ifs, sequencer_data *const data, const std::vector<file_parameter> *const parameters,
+		song_data *const song, std::vector<pending_sample> *const samples, parameter_values *const values)
+{
+	legacy_sax_loader loader;
+	if (json::sax_parse(ifs, &loader) == false) {
+		printf("File is incorrect (%s)\n", loader.error.c_str());
+		return false;
+	}
+
+	size_t pcm_bytes = 0;
+	for(auto & element: loader.pcm)
+		pcm_bytes += element.second.interleaved.size() * sizeof(double);
+	printf("Streamed %.1f MB of sample data\n", pcm_bytes / 1048576.);
+
+	if (values)
+		*values = parameter_values_from_json(loader.root, *parameters);
+	if (metadata_from_json(loader.root, data, values ? nullptr : parameters, song) == false)
+		return false;
+
+	// the data is decoded already; what is left is analyzing it
+	*samples = pending_samples_from_json(loader.root, [&loader](const size_t group, const json & entry) -> pcm_fetch {
+			auto it = loader.pcm.find(group);
+			if (it == loader.pcm.end() || it->second.interleaved.empty())
+				return [](std::atomic<double> *const) { return std::shared_ptr<const sample_pcm>(); };
+
+			auto         decoded         = std::make_shared<streamed_pcm>(std::move(it->second));
+			unsigned int pcm_sample_rate = entry["sample-rate"];
+			return [decoded, pcm_sample_rate](std::atomic<double> *const) {
+				return share_sample(std::move(decoded->interleaved), decoded->n_channels, pcm_sample_rate);
+			};
+		});
+
+	return true;
+}
+
+static std::shared_ptr<const sample_pcm> read_chunk(const int fd, const uint64_t file_size, const json & chunk, const unsigned int pcm_sample_rate)
+{
+	uint64_t    offset     = chunk["offset"];
+	uint64_t    size       = chunk["size"];
+	size_t      n_frames   = chunk["frames"];
+	size_t      n_channels = chunk["channels"];
+	std::string encoding   = chunk["encoding"];
+
+	if (offset % chunk_alignment || offset + size > file_size || n_channels == 0 || n_frames == 0) {
+		printf("Sample chunk at %llu is invalid\n", (unsigned long long)offset);
+		return { };
+	}
+
+	std::shared_ptr<sample_pcm> pcm;
+
+	if (encoding == "f64") {
+		if (size != n_frames * n_channels * sizeof(double))
+			return { };
+
+		void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, offset);
+		if (p == MAP_FAILED) {
+			printf("Cannot map sample chunk: %s\n", strerror(errno));
+			return { };
+		}
+		madvise(p, size, MADV_WILLNEED);
+
+		pcm = std::make_shared<sample_pcm>(p, size, static_cast<const double *>(p), n_frames, n_channels, pcm_sample_rate);
+		pcm->hash = chunk["hash"];
+	}
+	else if (encoding == "flac") {
+		std::vector<uint8_t> encoded(size);
+		if (pread(fd, encoded.data(), size, offset) != ssize_t(size))
+			return { };
+
+		std::vector<double> decoded;
+		if (decode_flac(std::move(encoded), &decoded, n_frames, n_channels) == false) {
+			printf("Cannot decode sample chunk at %llu\n", (unsigned long long)offset);
+			return { };
+		}
+
+		pcm = std::make_shared<sample_pcm>(std::move(decoded), n_channels, pcm_sample_rate);
+		pcm->hash = hash_sample(pcm->frames, n_frames * n_channels, pcm_sample_rate);  // it is not bit-exact
+	}
+	else {
+		printf("Sample encoding \"%s\" is not supported\n", encoding.c_str());
+		return { };
+	}
+
+	pcm->loudest_frequency = chunk["loudest-frequency"];
+
+	return share_sample(std::move(pcm));
+}
+
+static bool read_container(const std::string & file_name, sequencer_data *const data, const std::vector<file_parameter> *const parameters,
+		song_data *const song, std::vector<pending_sample> *const samples, parameter_values *const values)
+{
+	int fd = open(file_name.c_str(), O_RDONLY);
+	if (fd == -1) {
+		printf("Cannot access %s\n", file_name.c_str());
+		return false;
+	}
+
+	container_preamble preamble { };
+	uint64_t           file_size = lseek(fd, 0, SEEK_END);
+	std::string        metadata;
+	bool               ok        = pread(fd, &preamble, sizeof preamble, 0) == sizeof preamble &&
+		preamble.metadata_offset + preamble.metadata_size <= file_size;
+	if (ok) {
+		metadata.resize(preamble.metadata_size);
+		ok = pread(fd, metadata.data(), metadata.size(), preamble.metadata_offset) == ssize_t(metadata.size());
+	}
+	if (!ok) {
+		printf("File %s is truncated\n", file_name.c_str());
+		close(fd);
+		return false;
+	}
+	if (preamble.version > container_version) {
+		printf("File %s is of a newer version (%u) than supported (%u)\n", file_name.c_str(), preamble.version, container_version);
+		close(fd);
+		return false;
+	}
+
+	// closed when the last sample has been fetched (the mappings stay valid after that)
+	std::shared_ptr<int> shared_fd(new int(fd), [](int *const p) { close(*p); delete p; });
+
+	try {
+		json j = json::parse(metadata);
+
+		if (j.value("little-endian", true) != (std::endian::native == std::endian::little)) {
+			printf("File %s was written on a system with a different byte order\n", file_name.c_str());
+			ok = false;
+		}
+		else {
+			if (values)
+				*values = parameter_values_from_json(j, *parameters);
+			ok = metadata_from_json(j, data, values ? nullptr : parameters, song);
+			if (ok) {
+				*samples = pending_samples_from_json(j, [shared_fd, file_size](const size_t group, const json & entry) -> pcm_fetch {
+						json         chunk           = entry.value("chunk", json());
+						unsigned int pcm_sample_rate = entry.value("sample-rate", 0u);
+						return [shared_fd, file_size, chunk, pcm_sample_rate](std::atomic<double> *const) -> std::shared_ptr<const sample_pcm> {
+							if (chunk.is_object() == false)
+								return { };
+							return read_chunk(*shared_fd, file_size, chunk, pcm_sample_rate);
+						};
+					});
+			}
+		}
+	}
+	catch(const json::exception & e) {
+		printf("File %s is incorrect: %s\n", file_name.c_str(), e.what());
+		ok = false;
+	}
+
+	return ok;
+}
+
+bool read_file_deferred(const std::string & file_name, sequencer_data *const data, const std::vector<file_parameter> *const parameters,
+		song_data *const song, std::vector<pending_sample> *const samples, parameter_values *const values)
+{
+	bool ok = false;
+
+	try {
+		std::ifstream ifs(file_name);
+		if (ifs.is_open() == false) {
+			printf("Cannot access file\n");
+			return false;
+		}
+		ifs.exceptions(std::ifstream::badbit);
+
+		char magic[sizeof container_magic] { };
+		ifs.read(magic, sizeof magic);
+		if (ifs.gcount() == sizeof magic && memcmp(magic, container_magic, sizeof magic) == 0) {
+			ifs.close();
+			ok = read_container(file_name, data, parameters, song, samples, values);
+		}
+		else {
+			ifs.clear();
+			ifs.seekg(0);
+			ok = read_json_file(ifs, data, parameters, song, samples, values);
+		}
+	}
 	catch(const std::ifstream::failure & e) {
 		printf("Cannot access %s\n", file_name.c_str());
 	}
@@ -240,5 +1067,83 @@ bool read_file(const std::string & file_name, std::array<pattern, pattern_groups
 		printf("File %s is incorrect\n", file_name.c_str());
 	}
 
-	return false;
+	return ok;
+}
+
+bool read_file(const std::string & file_name, sequencer_data *const data, std::vector<sample> *const sample_files,
+		const std::vector<file_parameter> *const parameters, const size_t n_outputs, song_data *const song)
+{
+	uint64_t start = get_us();
+
+	std::vector<pending_sample> pending;
+	if (read_file_deferred(file_name, data, parameters, song, &pending) == false)
+		return false;
+
+	bool ok = false;
+	try {
+		ok = load_pending_samples(pending, sample_files, n_outputs);
+	}
+	catch(const json::exception & e) {
+		printf("File %s is incorrect: %s\n", file_name.c_str(), e.what());
+	}
+
+	if (ok)
+		printf("Loaded %s in %.1f ms\n", file_name.c_str(), (get_us() - start) / 1000.);
+
+	return ok;
+}
+
+void benchmark_io(const std::string & file_name, const size_t n_groups, const size_t max_steps, const size_t n_outputs)
+{
+	const std::vector<file_parameter> parameters;
+
+	const std::vector<std::pair<file_format, std::string> > formats {
+		{ ff_json, "json" }, { ff_binary, "binary" }, { ff_binary_flac, "binary, flac" } };
+
+	// unused samples are not kept: each load then decodes and reads again instead of finding them in memory
+	const size_t prev_budget = get_sample_cache_statistics().budget;
+	set_sample_cache_budget(0);
+
+	for(auto & format: formats) {
+		sequencer_data      data(n_groups, max_steps, max_steps);
+		std::vector<sample> samples(n_groups);
+		song_data           song;
+
+		if (read_file(file_name, &data, &samples, &parameters, n_outputs, &song) == false) {
+			fprintf(stderr, "Cannot load %s\n", file_name.c_str());
+			return;
+		}
+
+		std::string temp_name = "/tmp/kaboem-benchmark-" + std::to_string(getpid()) + "." PROG_EXT;
+
+		uint64_t start_save = get_us();
+		bool     ok         = write_file(temp_name, data, samples, parameters, &song, format.first);
+		uint64_t took_save  = get_us() - start_save;
+
+		// else the samples would come from the registry instead of from the file
+		for(auto & element: samples) {
+			delete element.s;
+			element.s = nullptr;
+		}
+
+		uint64_t start_load = get_us();
+		ok = ok && read_file(temp_name, &data, &samples, &parameters, n_outputs, &song);
+		uint64_t took_load  = get_us() - start_load;
+
+		std::error_code ec;
+		uintmax_t size = std::filesystem::file_size(temp_name, ec);
+		unlink(temp_name.c_str());
+
+		for(auto & element: samples)
+			delete element.s;
+
+		if (!ok) {
+			fprintf(stderr, "Saving or loading as %s failed\n", format.second.c_str());
+			continue;
+		}
+
+		printf("%-14s save: %8.1f ms, load: %8.1f ms, %10ju bytes\n", format.second.c_str(), took_save / 1000., took_load / 1000., size);
+	}
+
+	set_sample_cache_budget(prev_budget);
 }
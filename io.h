@@ -1,9 +1,18 @@
+#pragma once
+
 #include <array>
 #include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <string>
+#include <utility>
+#include <variant>
 #include <vector>
 
 #include "gui.h"
+#include "sequencer.h"
+#include "song.h"
 #include "sound.h"
 
 struct file_parameter
@@ -18,9 +27,67 @@ struct file_parameter
 	std::atomic_bool      *ab_value { nullptr };
 };
 
-bool write_file(const std::string & file_name, const std::array<pattern, pattern_groups> & data, const std::array<sample, pattern_groups> & sample_files,
-		const std::vector<file_parameter> & parameters);
-bool read_file (const std::string & file_name, std::array<pattern, pattern_groups> *const data, std::array<sample, pattern_groups> *const sample_files,
-		const std::vector<file_parameter> *const parameters);
+// ff_json: everything in one json document (the original format, still read)
+// ff_binary: the sample data in chunks that are mmap'ed when loading; ff_binary_flac: those chunks flac-compressed
+enum file_format { ff_json, ff_binary, ff_binary_flac };
+
+// a value per file_parameter, by name
+typedef std::vector<std::pair<std::string, std::variant<int, double, bool> > > parameter_values;
+
+// everything that goes in a .kaboem-file, copied so that it can be written while editing and playback go on
+// (the sample data itself is shared, not copied)
+struct file_snapshot
+{
+	struct sample_entry
+	{
+		std::string                       name;
+		std::optional<int>                midi_note;
+		std::shared_ptr<const sample_pcm> pcm;  // nullptr: no sample
+		double                            vol_left  { 0. };
+		double                            vol_right { 0. };
+		double                            pitch     { 1. };
+		bool                              mute      { false };
+	};
+
+	sequencer_data            data;
+	std::vector<sample_entry> samples;
+	parameter_values          parameters;  // the ones that have a value
+	std::optional<song_data>  song;
+};
+
+// gets the audio of a sample in a file. that takes a while (decoding, analyzing), so it can be done on a loader
+// thread; 'progress' (0...1) is updated when it is set
+typedef std::function<std::shared_ptr<const sample_pcm>(std::atomic<double> *const progress)> pcm_fetch;
+
+// a sample of a file of which the audio has not been fetched yet
+struct pending_sample
+{
+	file_snapshot::sample_entry entry;  // without the pcm
+	pcm_fetch                   fetch;  // not set when there is no sample
+};
+
+// a sound_sample for 'entry' (of which the pcm must be set), configured as it was saved; nullptr when it cannot be used
+sound_sample *create_sample(const file_snapshot::sample_entry & entry, const size_t n_outputs);
+
+file_snapshot take_snapshot(const sequencer_data & data, const std::vector<sample> & sample_files,
+		const std::vector<file_parameter> & parameters, const song_data *const song = nullptr);
+// the file is written next to 'file_name', synced and then renamed, so that after a crash either the
+// old or the new version is there. 'progress' (0...1) is updated while writing when it is set.
+bool write_file(const std::string & file_name, const file_snapshot & snapshot, const file_format format = ff_binary,
+		std::atomic<double> *const progress = nullptr);
+bool write_file(const std::string & file_name, const sequencer_data & data, const std::vector<sample> & sample_files,
+		const std::vector<file_parameter> & parameters, const song_data *const song = nullptr, const file_format format = ff_binary);
+// the sound_samples that are in 'sample_files' must have been taken out (e.g. retired) by the caller
+bool read_file (const std::string & file_name, sequencer_data *const data, std::vector<sample> *const sample_files,
+		const std::vector<file_parameter> *const parameters, const size_t n_outputs, song_data *const song = nullptr);
+// everything but the audio of the samples: 'samples' (one per pattern group in the file) tells how to fetch that,
+// so that the caller can do so in the background and put each sample in its channel when it is ready. with 'values'
+// set, the parameters go in there instead of in their variables, so that this can run on another thread.
+bool read_file_deferred(const std::string & file_name, sequencer_data *const data, const std::vector<file_parameter> *const parameters,
+		song_data *const song, std::vector<pending_sample> *const samples, parameter_values *const values = nullptr);
+// puts 'values' (see read_file_deferred()) in the variables of 'parameters'
+void set_parameters(const parameter_values & values, const std::vector<file_parameter> & parameters);
 std::string get_filename(const std::string & path);
 sound_sample *find_sample(const std::vector<std::string> & search_paths, const std::string & file_name);
+// prints how long saving and loading 'file_name' takes in each format
+void benchmark_io(const std::string & file_name, const size_t n_groups, const size_t max_steps, const size_t n_outputs);
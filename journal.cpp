@@ -0,0 +1,534 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <variant>
+
+#include "io-json.h"
+#include "journal.h"
+#include "sample.h"
+#include "time.h"
+
+
+constexpr const size_t compact_after = 10000;  // records
+
+// a sample in the store: this header and then the interleaved frames (mmap'ed when it is read back)
+struct stored_sample_header
+{
+	char     magic[8];
+	uint32_t n_channels;
+	uint32_t sample_rate;
+	uint64_t n_frames;
+	uint64_t hash;
+	double   loudest_frequency;
+};
+
+static const char stored_sample_magic[8] = { 'K', 'A', 'B', 'O', 'E', 'M', 'S', '1' };
+
+static std::string get_sample_name(const std::string & dir, const uint64_t hash)
+{
+	char name[32];
+	snprintf(name, sizeof name, "%016llx.pcm", (unsigned long long)hash);
+	return dir + "/samples/" + name;
+}
+
+static std::shared_ptr<const sample_pcm> load_stored_sample(const std::string & dir, const uint64_t hash)
+{
+	std::string file_name = get_sample_name(dir, hash);
+
+	int fd = open(file_name.c_str(), O_RDONLY);
+	if (fd == -1) {
+		printf("Sample %s is not in the journal\n", file_name.c_str());
+		return { };
+	}
+
+	struct stat st { };
+	stored_sample_header header { };
+	bool ok = fstat(fd, &st) == 0 && pread(fd, &header, sizeof header, 0) == sizeof header &&
+		memcmp(header.magic, stored_sample_magic, sizeof header.magic) == 0 && header.n_channels > 0 &&
+		uint64_t(st.st_size) == sizeof header + header.n_frames * header.n_channels * sizeof(double);
+
+	void *p = ok ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (p == MAP_FAILED) {
+		printf("Sample %s in the journal is invalid\n", file_name.c_str());
+		return { };
+	}
+
+	const double *frames = reinterpret_cast<const double *>(static_cast<const uint8_t *>(p) + sizeof header);
+	auto pcm = std::make_shared<sample_pcm>(p, st.st_size, frames, header.n_frames, header.n_channels, header.sample_rate);
+	pcm->hash              = header.hash;
+	pcm->loudest_frequency = header.loudest_frequency;
+
+	return share_sample(std::move(pcm));
+}
+
+static bool store_sample(const std::string & dir, const sample_pcm & pcm)
+{
+	std::string file_name = get_sample_name(dir, pcm.hash);
+	if (access(file_name.c_str(), F_OK) == 0)  // content-addressed: it is already there
+		return true;
+
+	stored_sample_header header { };
+	memcpy(header.magic, stored_sample_magic, sizeof header.magic);
+	header.n_channels        = pcm.n_channels;
+	header.sample_rate       = pcm.sample_rate;
+	header.n_frames          = pcm.n_frames;
+	header.hash              = pcm.hash;
+	header.loudest_frequency = pcm.loudest_frequency;
+
+	return replace_file(file_name, [&](const int fd) {
+			return write_all(fd, &header, sizeof header) && write_all(fd, pcm.frames, pcm.get_size_in_bytes());
+		});
+}
+
+static bool same_pattern(const sequencer_data & a, const sequencer_data & b)
+{
+	return a.dim == b.dim && a.steps == b.steps && a.note_delta == b.note_delta && a.volume_left == b.volume_left && a.volume_right == b.volume_right;
+}
+
+
+static bool same_sample(const file_snapshot::sample_entry & a, const file_snapshot::sample_entry & b)
+{
+	return a.name == b.name && a.midi_note == b.midi_note && a.pcm == b.pcm && a.vol_left == b.vol_left &&
+		a.vol_right == b.vol_right && a.pitch == b.pitch && a.mute == b.mute;
+}
+
+static json sample_to_json(const file_snapshot::sample_entry & entry)
+{
+	json out;
+	out["file-name"] = entry.name;
+	out["vol-left"]  = entry.vol_left;
+	out["vol-right"] = entry.vol_right;
+	out["pitch"]     = entry.pitch;
+	out["mute"]      = entry.mute;
+	if (entry.pcm)
+		out["hash"]  = entry.pcm->hash;
+	return out;
+}
+
+static json song_to_json(const song_data & song)
+{
+	json patterns = json::array();
+	for(auto & pattern: song.patterns)
+		patterns.push_back(patterns_to_json(pattern));
+
+	json out;
+	out["patterns"]    = patterns;
+	out["arrangement"] = song.arrangement;
+	out["current"]     = song.current;
+	return out;
+}
+
+static void add_record(std::string *const records, size_t *const n, const json & record)
+{
+	*records += record.dump();
+	*records += '\n';
+	(*n)++;
+}
+
+// what changed in the song: the patterns that are not being edited, the arrangement and which one is edited;
+// returns the pattern that replaying these leaves in 'data' (nothing when that is not changed). when patterns
+// were removed (e.g. a new song was loaded), the whole song is logged
+static std::optional<sequencer_data> diff_song(const std::optional<song_data> & before, const std::optional<song_data> & after,
+		std::string *const records, size_t *const n)
+{
+	if (!before.has_value() && !after.has_value())
+		return { };
+
+	if (!before.has_value() || !after.has_value() || after->patterns.size() < before->patterns.size()) {
+		add_record(records, n, { { "song", after.has_value() ? song_to_json(after.value()) : json() } });
+		return { };
+	}
+
+	// the one that is being edited is logged with the edits of 'data' instead (and may be outdated in the song)
+	const bool switched = after->current != before->current;
+	for(size_t i=0; i<after->patterns.size(); i++) {
+		if (i == after->current && !switched)
+			continue;
+		if (i < before->patterns.size() && same_pattern(before->patterns[i], after->patterns[i]))
+			continue;
+		add_record(records, n, { { "sp", { i, patterns_to_json(after->patterns[i]) } } });
+	}
+
+	if (after->arrangement != before->arrangement)
+		add_record(records, n, { { "arr", after->arrangement } });
+
+	if (!switched)
+		return { };
+
+	add_record(records, n, { { "cur", after->current } });
+	return after->patterns[after->current];
+}
+
+// each record sets a value (instead of e.g. flipping it) so that replaying one twice does no harm
+static void diff_patterns(const sequencer_data & before, const sequencer_data & after, std::string *const records, size_t *const n)
+{
+	if (same_pattern(before, after))
+		return;
+
+	for(size_t group=0; group<after.n_groups; group++) {
+		if (before.dim[group] != after.dim[group])
+			add_record(records, n, { { "d", { group, after.dim[group] } } });
+
+		for(size_t step=0; step<after.max_dim; step++) {
+			if (before.is_set(group, step) != after.is_set(group, step))
+				add_record(records, n, { { "s", { group, step, after.is_set(group, step) } } });
+			if (before.note_delta_at(group, step) != after.note_delta_at(group, step))
+				add_record(records, n, { { "n", { group, step, after.note_delta_at(group, step) } } });
+			if (before.volume_left_at(group, step) != after.volume_left_at(group, step) || before.volume_right_at(group, step) != after.volume_right_at(group, step))
+				add_record(records, n, { { "v", { group, step, after.volume_left_at(group, step), after.volume_right_at(group, step) } } });
+		}
+	}
+}
+
+journal::journal(const std::string & dir) : dir(dir)
+{
+	mkdir(dir.c_str(), 0755);
+	mkdir((dir + "/samples").c_str(), 0755);
+
+	// continue the numbering of a recovered session
+	std::ifstream ifs(get_base_name());
+	if (ifs.is_open()) {
+		json base = json::parse(ifs, nullptr, false);
+		if (base.is_object())
+			generation = base.value("generation", uint64_t(0));
+	}
+
+	th = new std::thread(&journal::run, this);
+}
+
+journal::~journal()
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		stop_flag = true;
+		cv.notify_all();
+	}
+
+	if (th) {
+		th->join();
+		delete th;
+	}
+
+	if (fd != -1)
+		close(fd);
+}
+
+std::string journal::get_base_name() const
+{
+	return dir + "/base.json";
+}
+
+std::string journal::get_log_name(const uint64_t nr) const
+{
+	return dir + "/log-" + std::to_string(nr) + ".jsonl";
+}
+
+void journal::queue(job && j)
+{
+	std::unique_lock<std::mutex> lck(lock);
+	jobs.push_back(std::move(j));
+	cv.notify_all();
+}
+
+void journal::store_samples(const file_snapshot & snapshot)
+{
+	for(auto & entry: snapshot.samples) {
+		if (entry.pcm && stored.insert(entry.pcm->hash).second)
+			queue({ job::j_store, { }, entry.pcm, 0 });
+	}
+}
+
+void journal::compact(const file_snapshot & snapshot)
+{
+	store_samples(snapshot);
+
+	json base = to_json(snapshot, false);
+	for(size_t group=0; group<snapshot.samples.size(); group++) {
+		if (snapshot.samples[group].pcm)
+			base["samples"][group]["hash"] = snapshot.samples[group].pcm->hash;
+	}
+	base["generation"] = ++generation;
+
+	queue({ job::j_compact, base.dump(), { }, generation });
+
+	n_records = 0;
+	last      = snapshot;
+}
+
+void journal::update(const file_snapshot & current)
+{
+	if (!last.has_value()) {
+		compact(current);
+		return;
+	}
+
+	const file_snapshot & before  = last.value();
+	std::string           records;
+	size_t                n       = 0;
+
+	// the song first: switching patterns changes both the song and the pattern that is edited; then only
+	// the edits relative to the pattern that was switched to are logged
+	auto switched_to = diff_song(before.song, current.song, &records, &n);
+
+	diff_patterns(switched_to.has_value() ? switched_to.value() : before.data, current.data, &records, &n);
+
+	for(auto & parameter: current.parameters) {
+		auto it = std::find_if(before.parameters.begin(), before.parameters.end(), [&parameter](const auto & p) { return p.first == parameter.first; });
+		if (it != before.parameters.end() && it->second == parameter.second)
+			continue;
+
+		json value;
+		std::visit([&value](const auto & v) { value = v; }, parameter.second);
+		add_record(&records, &n, { { "p", { parameter.first, value } } });
+	}
+
+	for(size_t group=0; group<current.samples.size(); group++) {
+		const auto & entry = current.samples[group];
+		if (group < before.samples.size() && same_sample(before.samples[group], entry))
+			continue;
+
+		if (entry.pcm && stored.insert(entry.pcm->hash).second)
+			queue({ job::j_store, { }, entry.pcm, 0 });
+
+		add_record(&records, &n, { { "x", { { "group", group }, { "sample", sample_to_json(entry) }, { "midi-note", entry.midi_note.value_or(-1) } } } });
+	}
+
+	if (n == 0)
+		return;
+
+	queue({ job::j_records, records, { }, 0 });
+	n_records += n;
+	last       = current;
+
+	if (n_records >= compact_after)
+		compact(current);
+}
+
+void journal::finish(const file_snapshot & keep)
+{
+	{  // wait for everything that was queued
+		std::unique_lock<std::mutex> lck(lock);
+		stop_flag = true;
+		cv.notify_all();
+	}
+	th->join();
+	delete th;
+	th = nullptr;
+
+	if (fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+
+	unlink(get_base_name().c_str());
+	unlink(get_log_name(generation).c_str());
+
+	// the samples are kept when they are still used, so that they need not be written again next time
+	std::set<std::string> used;
+	for(auto & entry: keep.samples) {
+		if (entry.pcm)
+			used.insert(get_sample_name(dir, entry.pcm->hash));
+	}
+
+	std::error_code ec;
+	for(auto & file: std::filesystem::directory_iterator(dir + "/samples", ec)) {
+		if (used.find(file.path().string()) == used.end())
+			std::filesystem::remove(file.path(), ec);
+	}
+}
+
+void journal::run()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(;;) {
+		cv.wait(lck, [this] { return stop_flag || jobs.empty() == false; });
+		if (jobs.empty())
+			break;
+
+		job j = std::move(jobs.front());
+		jobs.pop_front();
+		lck.unlock();
+
+		if (j.type == job::j_store) {
+			if (store_sample(dir, *j.pcm) == false)
+				printf("Cannot store sample in journal %s\n", dir.c_str());
+		}
+		else if (j.type == job::j_compact) {
+			// the log of the previous base is only removed when the new base is on disk
+			if (replace_file(get_base_name(), [&j](const int fd) { return write_all(fd, j.text.data(), j.text.size()); })) {
+				if (fd != -1)
+					close(fd);
+				fd = open(get_log_name(j.generation).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+				if (fd == -1)
+					printf("Cannot create journal %s: %s\n", get_log_name(j.generation).c_str(), strerror(errno));
+				unlink(get_log_name(j.generation - 1).c_str());
+				n_bytes = 0;
+			}
+		}
+		else if (j.type == job::j_records && fd != -1) {
+			if (write_all(fd, j.text.data(), j.text.size()) == false || fdatasync(fd) == -1)
+				printf("Cannot write to journal: %s\n", strerror(errno));
+			n_bytes += j.text.size();
+		}
+
+		lck.lock();
+	}
+}
+
+static bool apply_record(const json & record, const std::string & dir, reclaimer *const reclaim, sequencer_data *const data, std::vector<sample> *const sample_files,
+		const std::vector<file_parameter> *const parameters, const size_t n_outputs, song_data *const song)
+{
+	if (record.contains("s") || record.contains("n") || record.contains("v")) {
+		const json & r     = record.begin().value();
+		size_t       group = r[0];
+		size_t       step  = r[1];
+		if (group >= data->n_groups || step >= data->max_dim)
+			return true;
+
+		if (record.contains("s"))
+			data->set(group, step, r[2]);
+		else if (record.contains("n"))
+			data->note_delta_at(group, step) = int(r[2]);
+		else {
+			data->volume_left_at (group, step) = r[2];
+			data->volume_right_at(group, step) = r[3];
+		}
+	}
+	else if (record.contains("d")) {
+		size_t group = record["d"][0];
+		size_t dim   = record["d"][1];
+		if (group < data->n_groups && dim >= 2 && dim <= data->max_dim)
+			data->dim[group] = dim;
+	}
+	else if (record.contains("p")) {
+		json parameter;
+		parameter[std::string(record["p"][0])] = record["p"][1];
+		parameters_from_json(parameter, parameters);
+	}
+	else if (record.contains("x")) {
+		size_t group = record["x"]["group"];
+		if (group < sample_files->size()) {
+			reclaim->retire((*sample_files)[group].s);  // a voice may still play it
+
+			return sample_from_json(record["x"]["sample"], record["x"]["midi-note"], &(*sample_files)[group], n_outputs, [&dir](const json & entry) -> std::shared_ptr<const sample_pcm> {
+					if (entry.contains("hash") == false)
+						return { };
+					return load_stored_sample(dir, entry["hash"]);
+				});
+		}
+	}
+	else if (record.contains("sp") && song) {
+		size_t         nr      = record["sp"][0];
+		sequencer_data pattern = *data;
+		if (nr > song->patterns.size() || patterns_from_json(record["sp"][1], &pattern) == false)
+			return false;
+
+		if (nr == song->patterns.size())
+			song->patterns.push_back(pattern);
+		else
+			song->patterns[nr] = pattern;
+	}
+	else if (record.contains("arr") && song) {
+		song->arrangement.clear();
+		for(auto & element: record["arr"]) {
+			size_t nr = element;
+			if (nr < song->patterns.size())
+				song->arrangement.push_back(nr);
+		}
+	}
+	else if (record.contains("cur") && song) {
+		size_t nr = record["cur"];
+		if (nr >= song->patterns.size())
+			return false;
+
+		song->current = nr;
+		*data         = song->patterns[nr];  // the edits that follow are relative to this one
+	}
+	else if (record.contains("song") && song) {
+		const json & j = record["song"];
+		song_data    new_song;
+
+		if (j.is_object()) {
+			for(auto & element: j["patterns"]) {
+				sequencer_data pattern = *data;
+				if (patterns_from_json(element, &pattern) == false)
+					return false;
+				new_song.patterns.push_back(pattern);
+			}
+
+			for(auto & element: j["arrangement"]) {
+				size_t nr = element;
+				if (nr < new_song.patterns.size())
+					new_song.arrangement.push_back(nr);
+			}
+
+			new_song.current = j["current"];
+		}
+
+		if (new_song.current >= new_song.patterns.size()) {
+			new_song.patterns.push_back(*data);
+			new_song.current = new_song.patterns.size() - 1;
+		}
+
+		*song = new_song;
+	}
+
+	return true;
+}
+
+bool journal::recover(const std::string & dir, reclaimer *const reclaim, sequencer_data *const data, std::vector<sample> *const sample_files,
+		const std::vector<file_parameter> *const parameters, const size_t n_outputs, song_data *const song)
+{
+	std::ifstream ifs(dir + "/base.json");
+	if (ifs.is_open() == false)
+		return false;
+
+	uint64_t start = get_us();
+
+	try {
+		json base = json::parse(ifs);
+
+		if (metadata_from_json(base, data, parameters, song) == false)
+			return false;
+
+		bool ok = samples_from_json(base, sample_files, n_outputs, [&dir](const size_t group, const json & entry) -> std::shared_ptr<const sample_pcm> {
+				if (entry.contains("hash") == false)
+					return { };
+				return load_stored_sample(dir, entry["hash"]);
+			});
+		if (!ok)
+			return false;
+
+		uint64_t      generation = base["generation"];
+		std::ifstream log(dir + "/log-" + std::to_string(generation) + ".jsonl");
+		std::string   line;
+		size_t        n          = 0;
+		while(std::getline(log, line)) {
+			json record = json::parse(line, nullptr, false);
+			if (record.is_discarded())  // the last one may have been written partially
+				break;
+			if (apply_record(record, dir, reclaim, data, sample_files, parameters, n_outputs, song) == false)
+				return false;
+			n++;
+		}
+
+		printf("Recovered session from %s: %zu edits replayed in %.1f ms\n", dir.c_str(), n, (get_us() - start) / 1000.);
+
+		return true;
+	}
+	catch(const json::exception & e) {
+		printf("Journal %s is incorrect: %s\n", dir.c_str(), e.what());
+	}
+
+	return false;
+}
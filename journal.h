@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gui.h"
+#include "io.h"
+#include "reclaimer.h"
+#include "sample.h"
+#include "sequencer.h"
+#include "song.h"
+
+
+// an append-only log of the edits of a session, in a directory next to the song, so that a crash does not
+// lose it. the gui hands it a snapshot now and then; only what changed since the previous one is written
+// (a json line of a few bytes per edit). now and then it is compacted into a new base (without sample data)
+// and a new, empty log. samples are stored once, under their hash, in the same directory.
+class journal
+{
+private:
+	struct job
+	{
+		enum { j_records, j_store, j_compact } type;
+		std::string                       text;        // records or the new base
+		std::shared_ptr<const sample_pcm> pcm;         // j_store
+		uint64_t                          generation;  // j_compact
+	};
+
+	const std::string            dir;
+	std::thread                 *th         { nullptr };
+	std::mutex                   lock;
+	std::condition_variable      cv;
+	std::deque<job>              jobs;
+	bool                         stop_flag  { false };
+
+	// gui thread
+	std::optional<file_snapshot> last;  // what has been journaled so far
+	std::set<uint64_t>           stored;  // samples that are (being) written to the store
+	uint64_t                     generation { 0 };
+	size_t                       n_records  { 0 };  // since the last compaction
+
+	// journal thread
+	int                          fd         { -1 };
+	std::atomic_uint64_t         n_bytes    { 0 };  // since the last compaction
+
+	std::string get_base_name() const;
+	std::string get_log_name(const uint64_t nr) const;
+
+	void queue(job && j);
+	void store_samples(const file_snapshot & snapshot);
+	void compact(const file_snapshot & snapshot);
+	void run();
+
+public:
+	// 'dir' is created when it does not exist
+	journal(const std::string & dir);
+	virtual ~journal();
+
+	// restores a session that did not end with a normal save; returns false if there is none. 'sample_files' must
+	// be empty; samples that are replaced while replaying go to 'reclaim'
+	static bool recover(const std::string & dir, reclaimer *const reclaim, sequencer_data *const data, std::vector<sample> *const sample_files,
+			const std::vector<file_parameter> *const parameters, const size_t n_outputs, song_data *const song);
+
+	// the first one becomes the base, after that only the differences are logged
+	void update(const file_snapshot & current);
+	// after the song was saved normally: removes the base and the log (but not the samples that 'keep' uses)
+	void finish(const file_snapshot & keep);
+
+	size_t   get_n_records() const { return n_records; }
+	uint64_t get_n_bytes()   const { return n_bytes;   }
+};
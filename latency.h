@@ -0,0 +1,22 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+
+// how long it took from the arrival of an event until something was done with it
+// written by one thread only
+struct latency_statistics
+{
+	std::atomic_uint64_t avg_ns { 0 };
+	std::atomic_uint64_t max_ns { 0 };
+	std::atomic_uint64_t n      { 0 };
+
+	void add(const uint64_t ns)
+	{
+		avg_ns = n ? (avg_ns * 63 + ns) / 64 : ns;
+		if (ns > max_ns)
+			max_ns = ns;
+		n++;
+	}
+};
@@ -0,0 +1,74 @@
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+
+#include "midi-clock.h"
+
+
+// loop gains (per pulse): how much of the phase error goes into the phase and into the period
+constexpr const double pll_alpha = 0.1;
+constexpr const double pll_beta  = 0.005;
+
+midi_clock_pll::midi_clock_pll()
+{
+}
+
+midi_clock_pll::~midi_clock_pll()
+{
+}
+
+void midi_clock_pll::reset()
+{
+	next_ns        = 0.;
+	prev_ns        = 0;
+	n_pulses       = 0;
+	phase_error_ns = 0.;
+	jitter_ns      = 0.;
+	// period_ns is kept: the tempo is usually the same after a stop/start
+}
+
+void midi_clock_pll::pulse(const uint64_t t_ns)
+{
+	n_pulses++;
+
+	if (prev_ns == 0) {  // first one after a reset
+		prev_ns = t_ns;
+		next_ns = period_ns > 0. ? t_ns + period_ns : 0.;
+		return;
+	}
+
+	double delta = double(t_ns - prev_ns);
+	prev_ns = t_ns;
+
+	// no estimate yet or way off (tempo jump, pulses lost): start over from what was measured
+	if (period_ns <= 0. || next_ns <= 0. || fabs(t_ns - next_ns) > period_ns * 2) {
+		period_ns = delta;
+		next_ns   = t_ns + period_ns;
+		return;
+	}
+
+	double error = t_ns - next_ns;
+	period_ns += pll_beta  * error;
+	next_ns   += period_ns + pll_alpha * error;
+
+	phase_error_ns = (phase_error_ns * 63 + error) / 64;
+	jitter_ns      = (jitter_ns * 63 + fabs(error - phase_error_ns)) / 64;
+}
+
+double follow_midi_clock(const midi_clock_pll & pll, const double pulse_ms, std::atomic<double> *const sleep_ms, std::atomic<double> *const t_start)
+{
+	if (pll.is_locked() == false)
+		return 0.;
+
+	double step_ms    = pll.get_step_ms();
+	double pulse_at   = pulse_ms + pll.get_pulse_offset_ns() / 1000000.;  // where the loop has it
+	// where the step clock should have started for this pulse to be at the right position
+	double pulses_ms  = double(pll.get_n_pulses() - 1) * step_ms / midi_clock_ppqn;
+	double difference = pulse_at - pulses_ms - *t_start;
+
+	// the loop filter is in the pll: its period and phase are taken over as they are
+	*sleep_ms = step_ms;
+	*t_start  = pulse_at - pulses_ms;
+
+	return difference;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+
+// 24 pulses per step (a step is what the BPM counts)
+constexpr const int midi_clock_ppqn = 24;
+
+enum midi_sync_mode { ms_none, ms_master, ms_slave };
+
+// follows incoming midi clock: a (second order) phase locked loop that smooths the jitter of the
+// pulses into a steady tempo and a prediction of when the next pulse comes in
+class midi_clock_pll
+{
+private:
+	double   period_ns      { 0. };  // between pulses
+	double   next_ns        { 0. };  // when the next pulse is expected
+	uint64_t prev_ns        { 0  };
+	uint64_t n_pulses       { 0  };  // since start
+	double   phase_error_ns { 0. };  // average
+	double   jitter_ns      { 0. };  // average deviation from that
+
+public:
+	midi_clock_pll();
+	virtual ~midi_clock_pll();
+
+	void reset();
+	// 't_ns': when a pulse came in
+	void pulse(const uint64_t t_ns);
+
+	bool     is_locked()          const { return n_pulses >= midi_clock_ppqn && period_ns > 0.; }
+	uint64_t get_n_pulses()       const { return n_pulses;       }
+	double   get_step_ms()        const { return period_ns * midi_clock_ppqn / 1000000.; }
+	double   get_bpm()            const { return period_ns > 0. ? 60000000000. / (period_ns * midi_clock_ppqn) : 0.; }
+	double   get_phase_error_ns() const { return phase_error_ns; }
+	double   get_jitter_ns()      const { return jitter_ns;      }
+	// where the loop puts the last pulse relative to when it came in (the jitter filtered out)
+	double   get_pulse_offset_ns() const { return next_ns > 0. ? next_ns - period_ns - prev_ns : 0.; }
+};
+
+// slave: puts the step clock ('t_start' and 'sleep_ms', both in ms and fractional) on the phase and
+// period of the pll, which already smooths them, so that the tempo follows without steps and the
+// pattern position does not jump. 'pulse_ms': when the last pulse came in (same clock as t_start).
+// returns the difference with the master in ms before it was followed
+double follow_midi_clock(const midi_clock_pll & pll, const double pulse_ms, std::atomic<double> *const sleep_ms, std::atomic<double> *const t_start);
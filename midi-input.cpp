@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <poll.h>
+#include <thread>
+#include <vector>
+#include <alsa/asoundlib.h>
+
+#include "midi.h"
+#include "midi-input.h"
+#include "ringbuffer.h"
+#include "time.h"
+
+
+midi_input::midi_input()
+{
+	auto input = allocate_midi_input_port(&queue);
+	seq  = input.first;
+	port = input.second;
+	if (!seq)
+		return;
+
+	snd_seq_nonblock(seq, 1);
+	snd_seq_queue_status_malloc(&status);
+}
+
+midi_input::~midi_input()
+{
+	if (th) {
+		stop_flag = true;
+		th->join();
+		delete th;
+	}
+
+	for(auto & c: consumers)
+		delete c.events;
+
+	if (seq) {
+		snd_seq_queue_status_free(status);
+		snd_seq_close(seq);
+	}
+}
+
+ringbuffer<midi_event> *midi_input::subscribe(const std::vector<int> & types, const size_t queue_size)
+{
+	consumer c { types, new ringbuffer<midi_event>(queue_size) };
+	consumers.push_back(c);
+	return c.events;
+}
+
+void midi_input::begin()
+{
+	if (seq)
+		th = new std::thread(&midi_input::run, this);
+}
+
+// events are timestamped by alsa with the time of the queue of the input port
+uint64_t midi_input::get_arrival_ns(const snd_seq_event_t *const ev)
+{
+	uint64_t now_ns = get_ns_mono();
+
+	if (snd_seq_get_queue_status(seq, queue, status) < 0)
+		return now_ns;
+
+	const snd_seq_real_time_t *rt = snd_seq_queue_status_get_real_time(status);
+	int64_t queue_now_ns = rt->tv_sec * 1000000000ll + rt->tv_nsec;
+	int64_t event_ns     = ev->time.time.tv_sec * 1000000000ll + ev->time.time.tv_nsec;
+
+	return now_ns - std::max(int64_t(0), queue_now_ns - event_ns);
+}
+
+void midi_input::run()
+{
+	int                 n_fds = snd_seq_poll_descriptors_count(seq, POLLIN);
+	std::vector<pollfd> fds(n_fds);
+	snd_seq_poll_descriptors(seq, fds.data(), n_fds, POLLIN);
+
+	while(!stop_flag) {
+		// the timeout is only for noticing stop_flag
+		if (poll(fds.data(), n_fds, 100) <= 0)
+			continue;
+
+		// everything that is pending, not one per wakeup
+		for(;;) {
+			snd_seq_event_t *ev = nullptr;
+			int rc = snd_seq_event_input(seq, &ev);
+			if (rc == -ENOSPC) {  // alsa's input buffer overflowed
+				n_dropped++;
+				continue;
+			}
+			if (rc < 0 || !ev)
+				break;
+
+			midi_event e { };
+			e.type       = ev->type;
+			e.arrival_ns = get_arrival_ns(ev);
+			if (ev->type == SND_SEQ_EVENT_NOTEON || ev->type == SND_SEQ_EVENT_NOTEOFF) {
+				e.channel = ev->data.note.channel;
+				e.note    = ev->data.note.note;
+				e.value   = ev->data.note.velocity;
+			}
+			else if (ev->type == SND_SEQ_EVENT_CONTROLLER) {
+				e.channel = ev->data.control.channel;
+				e.note    = ev->data.control.param;
+				e.value   = ev->data.control.value;
+			}
+
+			n_events++;
+
+			if (handler)
+				handler(e);
+
+			for(auto & c: consumers) {
+				if (std::find(c.types.begin(), c.types.end(), e.type) == c.types.end())
+					continue;
+				if (c.events->push(e) == false)
+					n_dropped++;
+			}
+		}
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+#include <alsa/asoundlib.h>
+
+#include "latency.h"
+#include "ringbuffer.h"
+
+
+struct midi_event
+{
+	int      type;        // SND_SEQ_EVENT_...
+	uint8_t  channel;
+	uint8_t  note;        // or the controller
+	int      value;       // velocity or value of the controller
+	uint64_t arrival_ns;  // CLOCK_MONOTONIC, from the timestamp that alsa gave it
+};
+
+// a thread that waits (in poll()) for midi events and hands them to the threads that are interested
+// in them, each via its own lock-free queue
+class midi_input
+{
+private:
+	struct consumer
+	{
+		std::vector<int>        types;
+		ringbuffer<midi_event> *events;
+	};
+
+	snd_seq_t              *seq       { nullptr };
+	int                     port      { -1 };
+	int                     queue     { -1 };
+	snd_seq_queue_status_t *status    { nullptr };
+	std::vector<consumer>   consumers;
+	std::function<void(const midi_event &)> handler;
+	std::thread            *th        { nullptr };
+	std::atomic_bool        stop_flag { false };
+	std::atomic_uint64_t    n_events  { 0 };
+	std::atomic_uint64_t    n_dropped { 0 };  // a queue was full or alsa lost them
+
+	uint64_t get_arrival_ns(const snd_seq_event_t *const ev);
+	void run();
+
+public:
+	midi_input();
+	virtual ~midi_input();
+
+	bool is_ok() const { return seq != nullptr; }
+
+	// only before begin(); the queue stays owned by midi_input
+	ringbuffer<midi_event> *subscribe(const std::vector<int> & types, const size_t queue_size = 256);
+	// only before begin(); invoked from the midi thread for each event, so it must not block
+	void set_handler(const std::function<void(const midi_event &)> & handler_in) { handler = handler_in; }
+	void begin();
+
+	uint64_t get_n_events()  const { return n_events;  }
+	uint64_t get_n_dropped() const { return n_dropped; }
+};
@@ -1,7 +1,11 @@
+#include <cstdint>
+#include <cstdlib>
 #include <utility>
 #include <alsa/asoundlib.h>
 
 #include "gui.h"
+#include "midi.h"
+#include "time.h"
 
 
 std::pair<snd_seq_t *, int> allocate_midi_output_port()
@@ -26,36 +30,162 @@ std::pair<snd_seq_t *, int> allocate_midi_output_port()
 	return { seq, out_port };
 }
 
-void send_note(snd_seq_t *const seq, const int out_port, const int note, const int velocity)
-{
-        snd_seq_event_t ev { };
-        snd_seq_ev_clear(&ev);
-        snd_seq_ev_set_source(&ev, out_port);
-        snd_seq_ev_set_subs(&ev);
-        snd_seq_ev_set_direct(&ev);
-        snd_seq_ev_set_noteon(&ev, 10 - 1, note, velocity);  // midi is 1 based
-        snd_seq_event_output_direct(seq, &ev);
-}
-
-std::pair<snd_seq_t *, int> allocate_midi_input_port()
+std::pair<snd_seq_t *, int> allocate_midi_input_port(int *const queue)
 {
         snd_seq_t *seq = nullptr;
-        if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, 0) < 0) {
+        // starting a queue requires being able to send
+        if (snd_seq_open(&seq, "default", queue ? SND_SEQ_OPEN_DUPLEX : SND_SEQ_OPEN_INPUT, 0) < 0) {
                 fprintf(stderr, "Error opening ALSA sequencer\n");
                 return { nullptr, -1 };
         }
 
         snd_seq_set_client_name(seq, PROG_NAME);
 
-        int in_port = snd_seq_create_simple_port(seq, "input",
-                        SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
-                        SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION);
+        if (queue) {
+                *queue = snd_seq_alloc_named_queue(seq, PROG_NAME " input");
+                if (*queue < 0) {
+                        fprintf(stderr, "Cannot allocate sequencer queue: %s\n", snd_strerror(*queue));
+                        snd_seq_close(seq);
+                        return { nullptr, -1 };
+                }
+        }
+
+        // incoming events get the time (of the queue) at which they arrived
+        snd_seq_port_info_t *info = nullptr;
+        snd_seq_port_info_malloc(&info);
+        snd_seq_port_info_set_name(info, "input");
+        snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE);
+        snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC|SND_SEQ_PORT_TYPE_APPLICATION);
+        if (queue) {
+                snd_seq_port_info_set_timestamping(info, 1);
+                snd_seq_port_info_set_timestamp_real(info, 1);
+                snd_seq_port_info_set_timestamp_queue(info, *queue);
+        }
+
+        int rc      = snd_seq_create_port(seq, info);
+        int in_port = snd_seq_port_info_get_port(info);
+        snd_seq_port_info_free(info);
 
-        if (in_port < 0) {
+        if (rc < 0) {
                 fprintf(stderr, "Error creating sequencer port\n");
                 return { nullptr, -1 };
         }
 
+        if (queue) {
+                snd_seq_start_queue(seq, *queue, nullptr);
+                snd_seq_drain_output(seq);
+        }
+
         return { seq, in_port };
 }
 
+midi_scheduler::midi_scheduler()
+{
+	auto output = allocate_midi_output_port();
+	seq  = output.first;
+	port = output.second;
+	if (!seq)
+		return;
+
+	queue = snd_seq_alloc_named_queue(seq, PROG_NAME);
+	if (queue < 0) {
+		fprintf(stderr, "Cannot allocate sequencer queue: %s\n", snd_strerror(queue));
+		return;
+	}
+
+	snd_seq_queue_status_malloc(&status);
+	snd_seq_start_queue(seq, queue, nullptr);
+	snd_seq_drain_output(seq);
+}
+
+midi_scheduler::~midi_scheduler()
+{
+	if (!seq)
+		return;
+
+	if (queue >= 0) {
+		// what is still on the queue is dropped, also the note offs
+		snd_seq_event_t ev { };
+		snd_seq_ev_clear(&ev);
+		snd_seq_ev_set_source(&ev, port);
+		snd_seq_ev_set_subs(&ev);
+		snd_seq_ev_set_direct(&ev);
+		snd_seq_ev_set_controller(&ev, 10 - 1, 123, 0);  // all notes off
+		snd_seq_event_output_direct(seq, &ev);
+
+		snd_seq_stop_queue(seq, queue, nullptr);
+		snd_seq_drain_output(seq);
+		snd_seq_free_queue(seq, queue);
+		snd_seq_queue_status_free(status);
+	}
+
+	snd_seq_close(seq);
+}
+
+// the queue has its own clock (starting at 0); this is re-determined for each note so that it cannot drift
+int64_t midi_scheduler::get_queue_offset(const uint64_t now_ns)
+{
+	if (snd_seq_get_queue_status(seq, queue, status) < 0)
+		return 0;
+
+	const snd_seq_real_time_t *rt = snd_seq_queue_status_get_real_time(status);
+	return int64_t(now_ns) - int64_t(rt->tv_sec * 1000000000ll + rt->tv_nsec);
+}
+
+void midi_scheduler::schedule(snd_seq_event_t *const ev, const int64_t queue_ns)
+{
+	snd_seq_real_time_t rt { };
+	if (queue_ns > 0) {
+		rt.tv_sec  = queue_ns / 1000000000;
+		rt.tv_nsec = queue_ns % 1000000000;
+	}
+
+	snd_seq_ev_schedule_real(ev, queue, 0, &rt);
+	snd_seq_event_output(seq, ev);
+}
+
+void midi_scheduler::note(const int note, const int velocity, const uint64_t at_ns)
+{
+	if (queue < 0)
+		return;
+
+	uint64_t now_ns = get_ns_mono();
+	int64_t  offset = get_queue_offset(now_ns);
+
+	snd_seq_event_t ev { };
+	snd_seq_ev_clear(&ev);
+	snd_seq_ev_set_source(&ev, port);
+	snd_seq_ev_set_subs(&ev);
+
+	snd_seq_ev_set_noteon(&ev, 10 - 1, note, velocity);  // midi is 1 based
+	schedule(&ev, int64_t(at_ns) - offset);
+	snd_seq_ev_set_noteoff(&ev, 10 - 1, note, 0);
+	schedule(&ev, int64_t(at_ns + note_length_ns) - offset);
+
+	snd_seq_drain_output(seq);
+
+	int64_t lead = int64_t(at_ns) - int64_t(now_ns);
+	if (lead < 0)
+		n_late++;
+	lead_ns        = (lead_ns * 63 + lead) / 64;
+	lead_spread_ns = (lead_spread_ns * 63 + uint64_t(std::abs(lead - lead_ns))) / 64;
+}
+
+void midi_scheduler::system_realtime(const int type, const uint64_t at_ns)
+{
+	if (queue < 0)
+		return;
+
+	int64_t offset = get_queue_offset(get_ns_mono());
+
+	snd_seq_event_t ev { };
+	snd_seq_ev_clear(&ev);
+	snd_seq_ev_set_source(&ev, port);
+	snd_seq_ev_set_subs(&ev);
+	snd_seq_ev_set_fixed(&ev);
+	ev.type = type;
+
+	schedule(&ev, int64_t(at_ns) - offset);
+
+	snd_seq_drain_output(seq);
+}
@@ -1,6 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
 #include <alsa/asoundlib.h>
 
 
-void send_note(snd_seq_t *const seq, const int out_port, const int note, const int velocity);
 std::pair<snd_seq_t *, int> allocate_midi_output_port();
-std::pair<snd_seq_t *, int> allocate_midi_input_port();
+// with 'queue': incoming events are timestamped with the time of that queue
+std::pair<snd_seq_t *, int> allocate_midi_input_port(int *const queue = nullptr);
+
+// midi output through an alsa sequencer queue: notes are put on it ahead of time with a timestamp
+// so that when they are sent does not depend on when the player thread happens to run
+class midi_scheduler
+{
+private:
+	snd_seq_t              *seq            { nullptr };
+	int                     port           { -1 };
+	int                     queue          { -1 };
+	snd_seq_queue_status_t *status         { nullptr };
+	uint64_t                note_length_ns { 50000000 };
+
+	// statistics (only accessed by the thread that schedules)
+	int64_t                 lead_ns        { 0 };
+	uint64_t                lead_spread_ns { 0 };
+	uint32_t                n_late         { 0 };
+
+	int64_t get_queue_offset(const uint64_t now_ns);
+	void    schedule(snd_seq_event_t *const ev, const int64_t queue_ns);
+
+public:
+	midi_scheduler();
+	virtual ~midi_scheduler();
+
+	bool is_ok() const { return queue >= 0; }
+
+	void set_note_length(const uint64_t ns) { note_length_ns = ns; }
+	// note on at 'at_ns' (CLOCK_MONOTONIC) and the matching note off after the note length
+	void note(const int note, const int velocity, const uint64_t at_ns);
+	// clock, start, stop or continue
+	void system_realtime(const int type, const uint64_t at_ns);
+
+	// how far ahead notes are put on the queue (average) and how much that varies; when the sequencer
+	// sends them relative to the audio output is not measured here
+	int64_t  get_lead_ns()        const { return lead_ns;        }
+	uint64_t get_lead_spread_ns() const { return lead_spread_ns; }
+	uint32_t get_n_late()         const { return n_late;         }  // notes that were due before they could be scheduled
+};
@@ -0,0 +1,51 @@
+#include <cmath>
+#include <cstdint>
+
+#include "parameters.h"
+
+
+parameter_store::parameter_store()
+{
+	// the defaults: full volume, no saturation
+	entries[p_volume    ].target  = 1.;
+	entries[p_volume    ].current = 1.;
+	entries[p_saturation].target  = 1.;
+	entries[p_saturation].current = 1.;
+
+	// 7: channel volume, 0...1.1 (like the volume setting in the gui); 12: effect control 1
+	controls.push_back({ sound_control::cm_continuous_controller,  7, p_volume,     "volume",     127. / 1.1, 0., 1. });
+	controls.push_back({ sound_control::cm_continuous_controller, 12, p_saturation, "saturation", -127.,      1., 1. });
+}
+
+parameter_store::~parameter_store()
+{
+}
+
+bool parameter_store::set_control(const uint8_t controller, const int value)
+{
+	for(auto & c: controls) {
+		if (c.cm_mode != sound_control::cm_continuous_controller || c.cm_index != controller)
+			continue;
+
+		// only the (atomic) target is changed: the controls themselves are shared with other threads
+		set(parameter(c.index), value / c.divide_by + c.add);
+		return true;
+	}
+
+	return false;
+}
+
+void parameter_store::begin_period(const int period_size, const int sample_rate)
+{
+	// get 'smoothing' of the way to the target in each period, for a time constant of 10 ms
+	const double smoothing = 1. - exp(-period_size / (sample_rate * 0.010));
+
+	for(auto & e: entries) {
+		double target = e.target;
+		double next   = e.current + (target - e.current) * smoothing;
+		if (fabs(target - next) < 1e-6)
+			next = target;
+
+		e.step = (next - e.current) / period_size;
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+class sound_control
+{
+public:
+	// name
+	enum { cm_continuous_controller } cm_mode;
+	uint8_t cm_index;  // midi index (for 0xb0: data-1)
+	int index;  // internal index
+	std::string name;
+	// how to transform a value
+	double divide_by;
+	double add;
+	// last transformed value
+	double current_setting;
+};
+
+// master parameters that are changed by the gui and by midi controllers while the audio thread
+// uses them. setting one only stores the target (no lock); the audio thread moves towards it
+// in a ramp per period so that a sweep does not give zipper noise.
+class parameter_store
+{
+public:
+	enum parameter { p_volume, p_saturation, n_parameters };
+
+private:
+	struct entry {
+		std::atomic<double> target  { 0. };
+		double              current { 0. };  // audio thread only
+		double              step    { 0. };  // per frame, in the current period
+	};
+	entry entries[n_parameters];
+
+	// midi controllers that are mapped on a parameter ('index')
+	std::vector<sound_control> controls;
+
+public:
+	parameter_store();
+	virtual ~parameter_store();
+
+	// any thread
+	void   set       (const parameter p, const double value) { entries[p].target = value; }
+	double get_target(const parameter p) const               { return entries[p].target;  }
+
+	// returns false when 'controller' is not mapped
+	bool set_control(const uint8_t controller, const int value);
+	// the mappings, these are not changed after construction; the value of one is get_target(index)
+	// (their current_setting is not used)
+	const std::vector<sound_control> & get_controls() const { return controls; }
+
+	// audio thread: at the start of a period
+	void begin_period(const int period_size, const int sample_rate);
+	// audio thread: the value for the next frame of the period
+	double next(const parameter p)
+	{
+		entry & e = entries[p];
+		double  v = e.current;
+		e.current += e.step;
+		return v;
+	}
+};
@@ -0,0 +1,343 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "io-json.h"
+#include "pcm-cache.h"
+#include "sample.h"
+
+
+constexpr const uint64_t max_cache_bytes = uint64_t(4) * 1024 * 1024 * 1024;
+
+static bool                 pcm_cache_enabled = true;
+static std::mutex           prune_lock;
+static std::thread         *prune_thread      = nullptr;
+static std::atomic_uint64_t cache_total       { 0 };  // bytes in the cache, as far as known (see prune_pcm_cache())
+
+// followed by the path of the file it was decoded from; the frames start at 'data_offset' (page aligned)
+struct pcm_cache_header
+{
+	char     magic[8];
+	uint64_t file_size;
+	int64_t  file_mtime_ns;
+	uint32_t path_length;
+	uint32_t n_channels;
+	uint32_t sample_rate;
+	uint32_t data_offset;
+	uint64_t n_frames;
+	uint64_t hash;
+	double   loudest_frequency;
+};
+
+static const char pcm_cache_magic[8] = { 'K', 'A', 'B', 'O', 'E', 'M', 'C', '1' };
+
+void set_pcm_cache(const bool on)
+{
+	pcm_cache_enabled = on;
+}
+
+static std::string get_cache_dir()
+{
+	const char *xdg  = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (xdg && xdg[0])
+		return std::string(xdg) + "/kaboem";
+	if (home && home[0])
+		return std::string(home) + "/.cache/kaboem";
+	return { };
+}
+
+// empty when there is no cache
+static std::string get_cache_name(const std::string & path, struct stat *const st)
+{
+	if (pcm_cache_enabled == false || stat(path.c_str(), st) == -1)
+		return { };
+
+	std::string dir = get_cache_dir();
+	if (dir.empty())
+		return { };
+
+	char name[32];
+	snprintf(name, sizeof name, "/%016zx.pcm", std::hash<std::string>{}(path));
+	return dir + name;
+}
+
+// the cache is keyed by the absolute path
+static std::string get_full_path(const std::string & file_name)
+{
+	char *temp = realpath(file_name.c_str(), nullptr);
+	if (!temp)
+		return file_name;
+
+	std::string out = temp;
+	free(temp);
+	return out;
+}
+
+static int64_t get_mtime_ns(const struct stat & st)
+{
+	return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// false when the file that an entry was decoded from is gone or was changed
+static bool is_entry_current(const std::string & cache_name)
+{
+	int fd = open(cache_name.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	pcm_cache_header header { };
+	std::string      path;
+	bool ok = pread(fd, &header, sizeof header, 0) == sizeof header && memcmp(header.magic, pcm_cache_magic, sizeof header.magic) == 0;
+	if (ok) {
+		path.resize(header.path_length);
+		ok = pread(fd, path.data(), path.size(), sizeof header) == ssize_t(path.size());
+	}
+	close(fd);
+
+	struct stat st { };
+	return ok && stat(path.c_str(), &st) == 0 && header.file_size == uint64_t(st.st_size) && header.file_mtime_ns == get_mtime_ns(st);
+}
+
+// with 'check_entries' it removes entries of files that were changed or deleted (that opens every entry, so it
+// is done once, at startup), and then the least recently used ones until the cache is below max_cache_bytes
+static void prune_pcm_cache(const std::string & dir, const bool check_entries)
+{
+	std::lock_guard<std::mutex> lck(prune_lock);
+
+	DIR *d = opendir(dir.c_str());
+	if (!d)
+		return;
+
+	struct entry {
+		std::string name;
+		uint64_t    size;
+		int64_t     used_ns;
+	};
+	std::vector<entry> entries;
+	uint64_t           total = 0;
+	time_t             now   = time(nullptr);
+
+	while(dirent *de = readdir(d)) {
+		std::string name = de->d_name;
+		std::string full = dir + "/" + name;
+		struct stat st { };
+		if (name[0] == '.' || stat(full.c_str(), &st) == -1)
+			continue;
+
+		// left behind by a crash (one that is being written is recent)
+		if (name.find(".tmp") != std::string::npos) {
+			if (now - st.st_mtime > 3600)
+				unlink(full.c_str());
+			continue;
+		}
+
+		if (check_entries && is_entry_current(full) == false) {
+			unlink(full.c_str());
+			continue;
+		}
+
+		entries.push_back({ full, uint64_t(st.st_size), get_mtime_ns(st) });
+		total += st.st_size;
+	}
+	closedir(d);
+
+	cache_total = total;
+	if (total <= max_cache_bytes)
+		return;
+
+	std::sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) { return a.used_ns < b.used_ns; });
+	for(auto & e: entries) {
+		if (total <= max_cache_bytes)
+			break;
+		// a sample that is mapped from it keeps working: the data is only freed after the munmap
+		unlink(e.name.c_str());
+		total -= e.size;
+	}
+
+	cache_total = total;
+}
+
+void begin_pcm_cache_prune()
+{
+	std::string dir = get_cache_dir();
+	if (pcm_cache_enabled == false || dir.empty() || prune_thread)
+		return;
+
+	prune_thread = new std::thread(prune_pcm_cache, dir, true);
+}
+
+void end_pcm_cache_prune()
+{
+	if (prune_thread) {
+		prune_thread->join();
+		delete prune_thread;
+		prune_thread = nullptr;
+	}
+}
+
+std::shared_ptr<sample_pcm> find_in_pcm_cache(const std::string & file_name)
+{
+	struct stat st { };
+	std::string path       = get_full_path(file_name);
+	std::string cache_name = get_cache_name(path, &st);
+	if (cache_name.empty())
+		return { };
+
+	int fd = open(cache_name.c_str(), O_RDONLY);
+	if (fd == -1)
+		return { };
+
+	struct stat      cache_st { };
+	pcm_cache_header header   { };
+	std::string      stored_path;
+	bool ok = fstat(fd, &cache_st) == 0 && pread(fd, &header, sizeof header, 0) == sizeof header &&
+		memcmp(header.magic, pcm_cache_magic, sizeof header.magic) == 0 && header.n_channels > 0 &&
+		header.file_size == uint64_t(st.st_size) && header.file_mtime_ns == get_mtime_ns(st) &&
+		uint64_t(cache_st.st_size) == header.data_offset + header.n_frames * header.n_channels * sizeof(double);
+
+	if (ok) {  // a different file with the same hash of its name
+		stored_path.resize(header.path_length);
+		ok = pread(fd, stored_path.data(), stored_path.size(), sizeof header) == ssize_t(stored_path.size()) && stored_path == path;
+	}
+
+	void *p = ok ? mmap(nullptr, cache_st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (p != MAP_FAILED)
+		futimens(fd, nullptr);  // the modification time of an entry is when it was last used (see prune_pcm_cache)
+	close(fd);
+	if (p == MAP_FAILED)
+		return { };
+
+	const double *frames = reinterpret_cast<const double *>(static_cast<const uint8_t *>(p) + header.data_offset);
+	auto pcm = std::make_shared<sample_pcm>(p, cache_st.st_size, frames, header.n_frames, header.n_channels, header.sample_rate);
+	pcm->hash              = header.hash;
+	pcm->loudest_frequency = header.loudest_frequency;
+
+	return pcm;
+}
+
+bool is_pcm_cache_available()
+{
+	return pcm_cache_enabled && get_cache_dir().empty() == false;
+}
+
+pcm_cache_writer::pcm_cache_writer(const std::string & file_name, const size_t n_channels, const unsigned int sample_rate) :
+	file_name(file_name),
+	n_channels(n_channels),
+	sample_rate(sample_rate)
+{
+	static std::atomic_uint64_t n_writers { 0 };
+
+	struct stat st { };
+	path       = get_full_path(file_name);
+	cache_name = get_cache_name(path, &st);
+	if (cache_name.empty())
+		return;
+
+	dir = get_cache_dir();
+	mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+	mkdir(dir.c_str(), 0755);
+
+	file_size     = st.st_size;
+	file_mtime_ns = get_mtime_ns(st);
+	data_offset   = (sizeof(pcm_cache_header) + path.size() + 4095) & ~size_t(4095);
+
+	// a partially written entry is never seen under its real name
+	temp_name = cache_name + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(n_writers++);
+	fd        = open(temp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		printf("Cannot create \"%s\": %s\n", temp_name.c_str(), strerror(errno));
+		return;
+	}
+
+	// the header goes in front of it when the data is complete
+	if (ftruncate(fd, data_offset) == -1 || lseek(fd, data_offset, SEEK_SET) == -1)
+		fail();
+}
+
+pcm_cache_writer::~pcm_cache_writer()
+{
+	fail();
+}
+
+void pcm_cache_writer::fail()
+{
+	if (fd == -1)
+		return;
+
+	close(fd);
+	fd = -1;
+	unlink(temp_name.c_str());
+}
+
+bool pcm_cache_writer::add(const double *const frames, const size_t n)
+{
+	if (fd == -1)
+		return false;
+
+	if (write_all(fd, frames, n * n_channels * sizeof(double)) == false) {
+		printf("Cannot store \"%s\" in the sample cache: %s\n", file_name.c_str(), strerror(errno));
+		fail();
+		return false;
+	}
+
+	n_frames += n;
+	return true;
+}
+
+bool pcm_cache_writer::finish(const uint64_t hash, const double loudest_frequency)
+{
+	if (fd == -1)
+		return false;
+
+	pcm_cache_header header { };
+	memcpy(header.magic, pcm_cache_magic, sizeof header.magic);
+	header.file_size         = file_size;
+	header.file_mtime_ns     = file_mtime_ns;
+	header.path_length       = path.size();
+	header.n_channels        = n_channels;
+	header.sample_rate       = sample_rate;
+	header.data_offset       = data_offset;
+	header.n_frames          = n_frames;
+	header.hash              = hash;
+	header.loudest_frequency = loudest_frequency;
+
+	bool ok = lseek(fd, 0, SEEK_SET) != -1 && write_all(fd, &header, sizeof header) && write_all(fd, path.data(), path.size());
+	if (close(fd) == -1)
+		ok = false;
+	fd = -1;
+
+	if (!ok || rename(temp_name.c_str(), cache_name.c_str()) == -1) {
+		printf("Cannot store \"%s\" in the sample cache: %s\n", file_name.c_str(), strerror(errno));
+		unlink(temp_name.c_str());
+		return false;
+	}
+
+	// only when it becomes too big the directory is looked at again
+	if ((cache_total += data_offset + n_frames * n_channels * sizeof(double)) > max_cache_bytes)
+		prune_pcm_cache(dir, false);
+
+	return true;
+}
+
+void add_to_pcm_cache(const std::string & file_name, const sample_pcm & pcm)
+{
+	pcm_cache_writer writer(file_name, pcm.n_channels, pcm.sample_rate);
+	if (writer.add(pcm.frames, pcm.n_frames))
+		writer.finish(pcm.hash, pcm.loudest_frequency);
+}
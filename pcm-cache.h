@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "sample.h"
+
+
+// decoded samples with their analysis (loudest frequency and content hash), in ~/.cache/kaboem, so that loading a
+// file again (also after a restart) is a memory-mapped open instead of decoding it and running the fft over it.
+// an entry is only used when the path, size and modification time of the file are the same as when it was stored.
+// entries of files that changed are removed at startup, and the least recently used ones when the cache grows
+// beyond 4 GB.
+void set_pcm_cache(const bool on);
+// the startup clean-up, on a thread of its own
+void begin_pcm_cache_prune();
+void end_pcm_cache_prune();
+// false with -N or when there is no place for it (no $HOME)
+bool is_pcm_cache_available();
+std::shared_ptr<sample_pcm> find_in_pcm_cache(const std::string & file_name);
+void add_to_pcm_cache(const std::string & file_name, const sample_pcm & pcm);
+
+// writes an entry while the file is being decoded, so that a long sample never has to be in memory completely;
+// find_in_pcm_cache() then maps it
+class pcm_cache_writer
+{
+private:
+	const std::string  file_name;
+	const size_t       n_channels;
+	const unsigned int sample_rate;
+	std::string        path;
+	std::string        dir;
+	std::string        cache_name;
+	std::string        temp_name;
+	int                fd            { -1 };
+	uint64_t           file_size     { 0  };
+	int64_t            file_mtime_ns { 0  };
+	size_t             data_offset   { 0  };
+	size_t             n_frames      { 0  };
+
+	void fail();
+
+public:
+	pcm_cache_writer(const std::string & file_name, const size_t n_channels, const unsigned int sample_rate);
+	virtual ~pcm_cache_writer();  // what was written is removed when finish() was not invoked (or failed)
+
+	bool is_ok() const { return fd != -1; }
+	// 'n' frames of 'n_channels'
+	bool add(const double *const frames, const size_t n);
+	bool finish(const uint64_t hash, const double loudest_frequency);
+};
@@ -1,71 +1,293 @@
 #include <cmath>
 #include <mutex>
+#include <string>
 #include <pipewire/pipewire.h>
 #include <spa/param/audio/format-utils.h>
 
 #include "gui.h"
 #include "pipewire-audio.h"
+#include "sound.h"
+#include "time.h"
 
 
-void on_process_audio(void *userdata);
+constexpr const int max_quantum = 8192;  // pipewire's default clock.max-quantum; larger periods are mixed in pieces
 
 static void on_state_changed(void *data, enum pw_stream_state old, enum pw_stream_state state, const char *error)
 {
 //	printf("%d --> %d | %s\n", old, state, error);
 }
 
-void configure_pipewire_audio(sound_parameters *const target)
+static void set_channel_positions(spa_audio_info_raw *const saiw)
 {
-	const char prog_name[] = PROG_NAME;
+	// as in the WAVE_FORMAT_EXTENSIBLE defaults: mono, stereo, quad, 5.1 and 7.1
+	switch(saiw->channels) {
+		case 1:
+			saiw->position[0] = SPA_AUDIO_CHANNEL_MONO;
+			break;
+		case 4:
+			saiw->position[2] = SPA_AUDIO_CHANNEL_RL;
+			saiw->position[3] = SPA_AUDIO_CHANNEL_RR;
+			[[fallthrough]];
+		case 2:
+			saiw->position[0] = SPA_AUDIO_CHANNEL_FL;
+			saiw->position[1] = SPA_AUDIO_CHANNEL_FR;
+			break;
+		case 8:
+			saiw->position[6] = SPA_AUDIO_CHANNEL_SL;
+			saiw->position[7] = SPA_AUDIO_CHANNEL_SR;
+			[[fallthrough]];
+		case 6:
+			saiw->position[0] = SPA_AUDIO_CHANNEL_FL;
+			saiw->position[1] = SPA_AUDIO_CHANNEL_FR;
+			saiw->position[2] = SPA_AUDIO_CHANNEL_FC;
+			saiw->position[3] = SPA_AUDIO_CHANNEL_LFE;
+			saiw->position[4] = SPA_AUDIO_CHANNEL_RL;
+			saiw->position[5] = SPA_AUDIO_CHANNEL_RR;
+			break;
+		default:  // leave it to pipewire
+			break;
+	}
+}
+
+audio_backend_pipewire::audio_backend_pipewire(sound_parameters *const sp) : audio_backend(sp)
+{
+}
+
+audio_backend_pipewire::~audio_backend_pipewire()
+{
+	end();
+}
+
+std::string audio_backend_pipewire::get_name() const
+{
+	return sp->n_stems > 0 ? "pipewire (with a port per channel)" : "pipewire";
+}
+
+void audio_backend_pipewire::on_process_audio(void *userdata)
+{
+	audio_backend_pipewire *backend = reinterpret_cast<audio_backend_pipewire *>(userdata);
+	sound_parameters       *sp      = backend->sp;
+	pw_buffer              *b       = pw_stream_dequeue_buffer(backend->pw.stream);
+	if (b == nullptr) {
+		pw_log_warn("out of buffers: %m");
+		return;
+	}
+	spa_buffer *buf      = b->buffer;
+
+	int     stride       = sizeof(double) * sp->n_channels;
+	int     period_size  = std::min(buf->datas[0].maxsize / stride, uint32_t(sp->period_size));
+
+	double *dest         = reinterpret_cast<double *>(buf->datas[0].data);
+	if (!dest) {
+		printf("no buffer\n");
+		return;
+	}
+
+	// how long it takes before what is rendered now is heard: the delay to the device and what the stream still buffers
+	pw_time pt { };
+	if (pw_stream_get_time_n(backend->pw.stream, &pt, sizeof pt) == 0 && pt.rate.denom > 0) {
+		int64_t frames = pt.delay * sp->sample_rate * int64_t(pt.rate.num) / pt.rate.denom + int64_t(pt.buffered);
+		if (frames >= 0) {
+			sp->latency_frames   = frames;
+			sp->latency_measured = true;
+		}
+	}
 
-	target->pw.th = new std::thread([prog_name, target]() {
-			target->pw.b    = SPA_POD_BUILDER_INIT(target->pw.buffer, sizeof(target->pw.buffer));
+	render_audio(sp, dest, period_size);
+
+	buf->datas[0].chunk->offset = 0;
+	buf->datas[0].chunk->stride = stride;
+	buf->datas[0].chunk->size   = period_size * stride;
+	if (pw_stream_queue_buffer(backend->pw.stream, b))
+		printf("pw_stream_queue_buffer failed\n");
+}
+
+// stems mode: the master channels and a stereo pair per pattern group, each a mono float port
+void audio_backend_pipewire::on_process_audio_ports(void *userdata, spa_io_position *position)
+{
+	audio_backend_pipewire *backend     = reinterpret_cast<audio_backend_pipewire *>(userdata);
+	sound_parameters       *sp          = backend->sp;
+	int                     n_samples   = int(position->clock.duration);
+	size_t                  n_ports     = backend->pw.ports.size();
+
+	// the port buffers are written to directly; unconnected ports have no buffer
+	float **port_buffers = backend->pw.port_buffers;
+	for(size_t i=0; i<n_ports; i++) {
+		port_buffers[i] = backend->pw.ports[i] ? reinterpret_cast<float *>(pw_filter_get_dsp_buffer(backend->pw.ports[i], n_samples)) : nullptr;
+		if (port_buffers[i])
+			memset(port_buffers[i], 0x00, n_samples * sizeof(float));
+	}
+
+	double *master_buffer = backend->pw.master_buffer;
+
+	// in pieces that fit in the master buffer; the port buffers are moved along
+	for(int offset=0; offset<n_samples; offset += max_quantum) {
+		int period_size = std::min(n_samples - offset, max_quantum);
+
+		render_audio(sp, master_buffer, period_size, &port_buffers[sp->n_channels]);
+
+		for(int c=0; c<sp->n_channels; c++) {
+			float *master = port_buffers[c];
+			if (master) {
+				for(int i=0; i<period_size; i++)
+					master[i] = master_buffer[i * sp->n_channels + c];
+			}
+		}
+
+		for(size_t i=0; i<n_ports; i++) {
+			if (port_buffers[i])
+				port_buffers[i] += period_size;
+		}
+	}
+}
+
+void audio_backend_pipewire::add_port(const std::string & name)
+{
+	void *port = pw_filter_add_port(pw.filter,
+			PW_DIRECTION_OUTPUT,
+			PW_FILTER_PORT_FLAG_MAP_BUFFERS,
+			0,
+			pw_properties_new(
+				PW_KEY_FORMAT_DSP, "32 bit float mono audio",
+				PW_KEY_PORT_NAME, name.c_str(),
+				nullptr),
+			nullptr, 0);
+	if (!port)
+		fprintf(stderr, "pw_filter_add_port for %s failed\n", name.c_str());
+	pw.ports.push_back(port);
+}
 
-			target->pw.loop = pw_main_loop_new(nullptr);
-			if (!target->pw.loop)
+// one node with a mono port per master channel and a stereo pair of ports per pattern group
+void audio_backend_pipewire::configure_pipewire_ports(const char *const prog_name)
+{
+	pw.filter_events.version = PW_VERSION_FILTER_EVENTS;
+	pw.filter_events.process = on_process_audio_ports;
+
+	std::string latency = std::to_string(sp->period_size) + "/" + std::to_string(sp->sample_rate);
+
+	pw.filter = pw_filter_new_simple(
+			pw_main_loop_get_loop(pw.loop),
+			prog_name,
+			pw_properties_new(
+				PW_KEY_APP_NAME, prog_name,
+				PW_KEY_NODE_NAME, prog_name,
+				PW_KEY_MEDIA_TYPE, "Audio",
+				PW_KEY_MEDIA_CATEGORY, "Source",
+				PW_KEY_MEDIA_ROLE, "DSP",
+				PW_KEY_NODE_LATENCY, latency.c_str(),
+				nullptr),
+			&pw.filter_events,
+			this);
+	if (!pw.filter) {
+		fprintf(stderr, "pw_filter_new_simple failed\n");
+		return;
+	}
+
+	for(int c=0; c<sp->n_channels; c++)
+		add_port("master_" + std::to_string(c + 1));
+
+	for(int g=0; g<sp->n_stems; g++) {
+		add_port("channel_" + std::to_string(g + 1) + "_FL");
+		add_port("channel_" + std::to_string(g + 1) + "_FR");
+	}
+
+	pw.port_buffers  = new float *[pw.ports.size()];
+	pw.master_buffer = new double[sp->n_channels * max_quantum];
+
+	if (pw_filter_connect(pw.filter, PW_FILTER_FLAG_RT_PROCESS, nullptr, 0))
+		fprintf(stderr, "pw_filter_connect failed\n");
+}
+
+void audio_backend_pipewire::configure_pipewire_stream(const char *const prog_name)
+{
+	pw.stream_events.version       = PW_VERSION_STREAM_EVENTS;
+	pw.stream_events.process       = on_process_audio;
+	pw.stream_events.state_changed = on_state_changed;
+
+	pw.stream = pw_stream_new_simple(
+			pw_main_loop_get_loop(pw.loop),
+			prog_name,
+			pw_properties_new(
+				PW_KEY_APP_NAME, prog_name,
+				PW_KEY_NODE_NAME, prog_name,
+				PW_KEY_MEDIA_TYPE, "Audio",
+				PW_KEY_MEDIA_CATEGORY, "Playback",
+				PW_KEY_MEDIA_ROLE, "Music",
+				nullptr),
+			&pw.stream_events,
+			this);
+	if (!pw.stream)
+		fprintf(stderr, "pw_stream_new_simple failed\n");
+
+	memset(pw.saiw.position, 0x00, sizeof pw.saiw.position);
+
+	pw.saiw.flags    = 0;
+	pw.saiw.format   = SPA_AUDIO_FORMAT_F64;
+	pw.saiw.channels = sp->n_channels;
+	pw.saiw.rate     = sp->sample_rate;
+	set_channel_positions(&pw.saiw);
+
+	pw.params[0] = spa_format_audio_raw_build(&pw.b, SPA_PARAM_EnumFormat, &pw.saiw);
+
+	if (pw_stream_connect(pw.stream,
+			PW_DIRECTION_OUTPUT,
+			PW_ID_ANY,
+			pw_stream_flags(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS),
+			pw.params, 1))
+		fprintf(stderr, "pw_stream_connect failed\n");
+}
+
+bool audio_backend_pipewire::begin()
+{
+	// the audio is rendered on the data thread of pipewire, which it shares with other nodes and makes realtime itself
+	if (rt.audio_cpu.has_value())
+		printf("pipewire: the audio thread belongs to pipewire, it is not pinned to cpu %d\n", rt.audio_cpu.value());
+
+	// the node latency that is requested; in stream mode it is measured once the audio runs (the filter node
+	// of the port mode has no such call, so there it remains this estimate)
+	sp->latency_frames   = sp->period_size;
+	sp->latency_measured = false;
+
+	pw.th = new std::thread([this]() {
+			const char prog_name[] = PROG_NAME;
+
+			pw.b    = SPA_POD_BUILDER_INIT(pw.buffer, sizeof(pw.buffer));
+
+			pw.loop = pw_main_loop_new(nullptr);
+			if (!pw.loop)
 				fprintf(stderr, "pw_main_loop_new failed\n");
 
-			target->pw.stream_events.version       = PW_VERSION_STREAM_EVENTS;
-			target->pw.stream_events.process       = on_process_audio;
-			target->pw.stream_events.state_changed = on_state_changed;
-
-			target->pw.stream = pw_stream_new_simple(
-					pw_main_loop_get_loop(target->pw.loop),
-					prog_name,
-					pw_properties_new(
-						PW_KEY_APP_NAME, prog_name,
-						PW_KEY_NODE_NAME, prog_name,
-						PW_KEY_MEDIA_TYPE, "Audio",
-						PW_KEY_MEDIA_CATEGORY, "Playback",
-						PW_KEY_MEDIA_ROLE, "Music",
-						nullptr),
-					&target->pw.stream_events,
-					target);
-			if (!target->pw.stream)
-				fprintf(stderr, "pw_stream_new_simple failed\n");
-
-			memset(target->pw.saiw.position, 0x00, sizeof target->pw.saiw.position);
-
-			target->pw.saiw.flags    = 0;
-			target->pw.saiw.format   = SPA_AUDIO_FORMAT_F64;
-			target->pw.saiw.channels = target->n_channels;
-			target->pw.saiw.rate     = target->sample_rate;
-
-			target->pw.params[0] = spa_format_audio_raw_build(&target->pw.b, SPA_PARAM_EnumFormat, &target->pw.saiw);
-
-			if (pw_stream_connect(target->pw.stream,
-					PW_DIRECTION_OUTPUT,
-					PW_ID_ANY,
-					pw_stream_flags(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS),
-					target->pw.params, 1))
-				fprintf(stderr, "pw_stream_connect failed\n");
-
-			if (pw_main_loop_run(target->pw.loop))
+			if (sp->n_stems > 0)
+				configure_pipewire_ports(prog_name);
+			else
+				configure_pipewire_stream(prog_name);
+
+			if (pw_main_loop_run(pw.loop))
 				fprintf(stderr, "pw_main_loop_run failed\n");
 
-			pw_stream_destroy   (target->pw.stream);
-			pw_main_loop_destroy(target->pw.loop  );
+			if (pw.filter)
+				pw_filter_destroy(pw.filter);
+			if (pw.stream)
+				pw_stream_destroy(pw.stream);
+			pw_main_loop_destroy(pw.loop);
 
 			printf("pipewire thread terminating\n");
 	});
+
+	return true;
+}
+
+void audio_backend_pipewire::end()
+{
+	if (pw.th) {
+		pw_main_loop_quit(pw.loop);
+		pw.th->join();
+		delete pw.th;
+		pw.th = nullptr;
+	}
+
+	delete [] pw.port_buffers;
+	pw.port_buffers  = nullptr;
+	delete [] pw.master_buffer;
+	pw.master_buffer = nullptr;
 }
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <thread>
+#include <vector>
 
 #include <pipewire/pipewire.h>
 #include <spa/param/audio/format-utils.h>
 
+#include "audio-backend.h"
+
 
 class pipewire_data_audio
 {
@@ -18,8 +21,32 @@ public:
         uint8_t            buffer[1024]  { 0       };
 	spa_audio_info_raw saiw          { SPA_AUDIO_FORMAT_UNKNOWN };
 	pw_stream_events   stream_events { 0       };
+
+	// stems mode
+	pw_filter         *filter        { nullptr };
+	pw_filter_events   filter_events { 0       };
+	std::vector<void *> ports;  // master channels, then left/right for each pattern group
+	float            **port_buffers  { nullptr };  // allocated up front: the process callback is realtime
+	double            *master_buffer { nullptr };
 };
 
-class sound_parameters;
+class audio_backend_pipewire : public audio_backend
+{
+private:
+	pipewire_data_audio pw;
+
+	static void on_process_audio      (void *userdata);
+	static void on_process_audio_ports(void *userdata, spa_io_position *position);
 
-void configure_pipewire_audio(sound_parameters *const pw);
+	void add_port(const std::string & name);
+	void configure_pipewire_ports(const char *const prog_name);
+	void configure_pipewire_stream(const char *const prog_name);
+
+public:
+	audio_backend_pipewire(sound_parameters *const sp);
+	virtual ~audio_backend_pipewire();
+
+	bool        begin() override;
+	void        end()   override;
+	std::string get_name() const override;
+};
@@ -0,0 +1,233 @@
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+
+#include "gui.h"
+#include "pipewire-capture.h"
+#include "sound.h"
+
+
+pipewire_capture::pipewire_capture(const int sample_rate, const size_t n_outputs) :
+	sample_rate(sample_rate),
+	n_outputs(n_outputs),
+	ring(sample_rate * n_channels)  // 1 second
+{
+}
+
+pipewire_capture::~pipewire_capture()
+{
+	stop_flag = true;
+	cv.notify_all();
+
+	if (collector) {
+		collector->join();
+		delete collector;
+	}
+
+	if (pw_th) {
+		pw_main_loop_quit(loop);
+		pw_th->join();
+		delete pw_th;
+	}
+
+	if (finished.has_value())
+		delete finished.value().second;
+}
+
+void pipewire_capture::on_process(void *userdata)
+{
+	pipewire_capture *pc = reinterpret_cast<pipewire_capture *>(userdata);
+	pw_buffer        *b  = pw_stream_dequeue_buffer(pc->stream);
+	if (b == nullptr) {
+		pw_log_warn("out of buffers: %m");
+		return;
+	}
+
+	spa_buffer *buf  = b->buffer;
+	float      *data = reinterpret_cast<float *>(buf->datas[0].data);
+	// after a disarm, keep recording until the pattern boundary that ends the take
+	capture_state state = pc->state;
+	if (data && (state == cs_recording || state == cs_stopping)) {
+		size_t n = buf->datas[0].chunk->size / sizeof(float);
+		n -= n % pc->n_channels;  // whole frames only
+		if (pc->ring.push(data, n) == false)
+			pc->n_overruns++;
+	}
+
+	pw_stream_queue_buffer(pc->stream, b);
+}
+
+bool pipewire_capture::begin()
+{
+	if (pw_th)
+		return true;
+
+	pw_th = new std::thread([this]() {
+			const char prog_name[] = PROG_NAME " input";
+
+			b    = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+			loop = pw_main_loop_new(nullptr);
+			if (!loop)
+				fprintf(stderr, "pw_main_loop_new failed\n");
+
+			stream_events.version = PW_VERSION_STREAM_EVENTS;
+			stream_events.process = on_process;
+
+			stream = pw_stream_new_simple(
+					pw_main_loop_get_loop(loop),
+					prog_name,
+					pw_properties_new(
+						PW_KEY_APP_NAME, PROG_NAME,
+						PW_KEY_NODE_NAME, prog_name,
+						PW_KEY_MEDIA_TYPE, "Audio",
+						PW_KEY_MEDIA_CATEGORY, "Capture",
+						PW_KEY_MEDIA_ROLE, "Production",
+						nullptr),
+					&stream_events,
+					this);
+			if (!stream)
+				fprintf(stderr, "pw_stream_new_simple failed\n");
+
+			memset(saiw.position, 0x00, sizeof saiw.position);
+
+			saiw.flags       = 0;
+			saiw.format      = SPA_AUDIO_FORMAT_F32;
+			saiw.channels    = n_channels;
+			saiw.rate        = sample_rate;
+			saiw.position[0] = SPA_AUDIO_CHANNEL_FL;
+			saiw.position[1] = SPA_AUDIO_CHANNEL_FR;
+
+			params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat, &saiw);
+
+			if (pw_stream_connect(stream,
+					PW_DIRECTION_INPUT,
+					PW_ID_ANY,
+					pw_stream_flags(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS),
+					params, 1))
+				fprintf(stderr, "pw_stream_connect failed\n");
+
+			if (pw_main_loop_run(loop))
+				fprintf(stderr, "pw_main_loop_run failed\n");
+
+			pw_stream_destroy   (stream);
+			pw_main_loop_destroy(loop  );
+
+			printf("pipewire capture thread terminating\n");
+	});
+
+	collector = new std::thread(&pipewire_capture::collect, this);
+
+	return true;
+}
+
+void pipewire_capture::arm(const int channel_in)
+{
+	if (begin() == false)
+		return;
+
+	capture_state expected = cs_idle;
+	channel = channel_in;
+	state.compare_exchange_strong(expected, cs_armed);
+}
+
+void pipewire_capture::disarm()
+{
+	capture_state expected = cs_armed;
+	if (state.compare_exchange_strong(expected, cs_idle) == false) {
+		expected = cs_recording;
+		state.compare_exchange_strong(expected, cs_stopping);
+	}
+}
+
+void pipewire_capture::on_pattern_start(const int channel_in)
+{
+	if (channel_in != channel)
+		return;
+
+	capture_state expected = cs_armed;
+	if (state.compare_exchange_strong(expected, cs_recording) == false) {
+		expected = cs_stopping;
+		if (state.compare_exchange_strong(expected, cs_finishing))
+			cv.notify_all();
+	}
+}
+
+double pipewire_capture::get_recorded_seconds()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	return recorded.size() / double(n_channels * sample_rate);
+}
+
+std::optional<std::pair<int, sound_sample *> > pipewire_capture::get_finished()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	auto rc = finished;
+	finished.reset();
+	return rc;
+}
+
+void pipewire_capture::collect()
+{
+	constexpr size_t n_chunk = 4096;
+	float           *chunk   = new float[n_chunk];
+
+	while(!stop_flag) {
+		{
+			std::unique_lock<std::mutex> lck(lock);
+			cv.wait_for(lck, std::chrono::milliseconds(10));
+		}
+
+		capture_state current_state = state;
+
+		for(;;) {
+			size_t n = ring.pop(chunk, n_chunk - n_chunk % n_channels);
+			if (n == 0)
+				break;
+			// left overs from a previous recording are dropped
+			if (current_state == cs_idle || current_state == cs_armed)
+				continue;
+
+			std::unique_lock<std::mutex> lck(lock);
+			recorded.insert(recorded.end(), chunk, chunk + n);
+		}
+
+		if (current_state == cs_recording || current_state == cs_stopping) {
+			std::unique_lock<std::mutex> lck(lock);
+			if (recorded.size() >= size_t(max_seconds * sample_rate) * n_channels) {
+				printf("Recording reached the maximum of %d seconds\n", max_seconds);
+				capture_state expected = current_state;
+				state.compare_exchange_strong(expected, cs_finishing);
+			}
+		}
+		else if (current_state == cs_finishing) {
+			std::vector<double> data;
+			{
+				std::unique_lock<std::mutex> lck(lock);
+				data.swap(recorded);
+			}
+
+			if (data.empty() == false) {
+				std::string name = "input-" + std::to_string(time(nullptr)) + ".wav";
+				sound_sample *s  = new sound_sample(sample_rate, n_outputs, name, share_sample(std::move(data), n_channels, sample_rate));
+				if (s->begin()) {
+					s->add_default_mapping(1.0, 1.0);
+
+					std::unique_lock<std::mutex> lck(lock);
+					if (finished.has_value())
+						delete finished.value().second;
+					finished = { channel, s };
+				}
+				else {
+					delete s;
+				}
+			}
+
+			state = cs_idle;
+		}
+	}
+
+	delete [] chunk;
+}
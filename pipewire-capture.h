@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+
+#include "ringbuffer.h"
+
+
+class sound_sample;
+
+// records from a pipewire source into a new sample for one of the channels
+// recording starts and stops at the first step of the pattern of that channel
+class pipewire_capture
+{
+public:
+	enum capture_state { cs_idle, cs_armed, cs_recording, cs_stopping, cs_finishing };
+
+private:
+	const int                  sample_rate;
+	const size_t               n_outputs;
+	const int                  n_channels  { 2 };
+	const int                  max_seconds { 60 };
+
+	std::thread               *pw_th       { nullptr };
+	pw_main_loop              *loop        { nullptr };
+	pw_stream                 *stream      { nullptr };
+	spa_pod_builder            b;
+	const spa_pod             *params[1]   { nullptr };
+	uint8_t                    buffer[1024] { 0 };
+	spa_audio_info_raw         saiw        { SPA_AUDIO_FORMAT_UNKNOWN };
+	pw_stream_events           stream_events { 0 };
+
+	ringbuffer<float>          ring;
+	std::atomic<capture_state> state       { cs_idle };
+	std::atomic_int            channel     { -1 };
+	std::atomic_uint64_t       n_overruns  { 0 };
+
+	// assembles the recorded audio into a sample, away from the audio thread
+	std::thread               *collector   { nullptr };
+	std::atomic_bool           stop_flag   { false };
+	std::mutex                 lock;
+	std::condition_variable    cv;
+	std::vector<double>        recorded;  // interleaved, becomes the sample as it is
+	std::optional<std::pair<int, sound_sample *> > finished;
+
+	static void on_process(void *userdata);
+	void collect();
+
+public:
+	pipewire_capture(const int sample_rate, const size_t n_outputs);
+	virtual ~pipewire_capture();
+
+	bool begin();
+
+	// arm/disarm are called by the gui, on_pattern_start by the player
+	void arm(const int channel);
+	void disarm();
+	void on_pattern_start(const int channel);
+
+	capture_state get_state()   const { return state;   }
+	int           get_channel() const { return channel; }
+	uint64_t      get_overruns() const { return n_overruns; }
+	double        get_recorded_seconds();
+
+	// a sample that is ready to be put in its channel (if any)
+	std::optional<std::pair<int, sound_sample *> > get_finished();
+};
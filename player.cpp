@@ -1,103 +1,368 @@
-#include <array>
+#include <algorithm>
 #include <atomic>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
+#include <optional>
+#include <vector>
 
 #include "frequencies.h"
 #include "gui.h"
 #include "midi.h"
-#include "pipewire-audio.h"
+#include "midi-clock.h"
+#include "pipewire-capture.h"
+#include "player.h"
+#include "scene.h"
+#include "sequencer.h"
+#include "snapshot.h"
+#include "song.h"
 #include "time.h"
 
 
-void player(const std::array<pattern, pattern_groups> *const pat_clickables, std::shared_mutex *const pat_clickables_lock,
-		const std::array<sample, pattern_groups> *const samples,
-		std::atomic_int  *const sleep_ms, sound_parameters *const sound_pars,
+struct player_state
+{
+	std::vector<ssize_t> prev_pat_index1;
+	std::vector<ssize_t> prev_pat_index2;
+	ssize_t              prev_capture_index { -1 };
+	int64_t              prev_bar           { -1 };
+
+	// midi clock out
+	bool                 clock_running      { false };
+	uint64_t             clock_next_pulse   { 0 };
+	double               clock_t_start      { 0. };
+	double               clock_sleep_ms     { 0. };
+
+	player_state(const size_t n_groups)
+	{
+		prev_pat_index1.resize(n_groups, -1);
+		prev_pat_index2.resize(n_groups, -1);
+	}
+
+	void restart()
+	{
+		std::fill(prev_pat_index1.begin(), prev_pat_index1.end(), -1);
+		std::fill(prev_pat_index2.begin(), prev_pat_index2.end(), -1);
+		prev_capture_index = -1;
+	}
+};
+
+static ssize_t get_pattern_index(const sequencer_data & sequence, const size_t group, const double now, const double sleep_ms, const bool polyrythmic)
+{
+	ssize_t current_dim = sequence.dim[group];
+
+	if (polyrythmic || sequence.max_steps == 0)
+		return uint64_t(now / sleep_ms) % current_dim;
+
+	return size_t(now / sleep_ms * current_dim / double(sequence.max_steps)) % current_dim;
+}
+
+// when a sound that is queued now will be heard: it is mixed into the next period
+// note: the caller must hold sounds_lock
+static uint64_t get_audio_start_ns(const sound_parameters *const sound_pars)
+{
+	uint64_t now_ns    = get_ns_mono();
+	uint64_t render_ns = sound_pars->render_ns;
+	uint64_t frames    = sound_pars->period_frames + sound_pars->latency_frames;
+	uint64_t at_ns     = render_ns + frames * 1000000000 / sound_pars->sample_rate;
+
+	// audio is not running (yet)
+	if (render_ns == 0 || at_ns < now_ns)
+		return now_ns + uint64_t(sound_pars->latency_frames) * 1000000000 / sound_pars->sample_rate;
+
+	return at_ns;
+}
+
+static void trigger(const std::vector<sample> & samples, const size_t group, const int note_delta, const double volume_left, const double volume_right,
+		sound_parameters *const sound_pars, midi_scheduler *const midi)
+{
+	std::optional<int> midi_note;
+	uint64_t           at_ns = 0;
+
+	{
+		std::lock_guard<std::shared_mutex> lck(sound_pars->sounds_lock);
+		if (samples[group].s) {
+			sound_parameters::queued_sound qs { };
+			qs.s     = samples[group].s;
+			qs.t     = 0;
+			qs.group = group;
+
+			int    base_note       = qs.s->get_base_midi_note();
+			double base_note_f     = midi_note_to_frequency(base_note);
+			int    adjusted_note   = base_note + note_delta;
+			int    adjusted_note_f = midi_note_to_frequency(adjusted_note);
+
+			double pitch           = base_note_f ? adjusted_note_f / base_note_f : 1.;
+			qs.pitch        = pitch;
+			qs.gains        = qs.s->get_gain_matrix();
+			for(size_t from=0; from<qs.gains.n_sources; from++)
+				qs.gains.scale(from, from ? volume_right : volume_left);
+
+			sound_pars->add_voice(qs);
+		}
+
+		midi_note = samples[group].midi_note;
+		if (midi_note.has_value())
+			at_ns = get_audio_start_ns(sound_pars);
+	}
+
+	// so that an external drum machine fires together with our own samples; the sequencer calls can
+	// take a while, so they are not done while the audio thread may be waiting for sounds_lock
+	if (midi_note.has_value() && midi)
+		midi->note(midi_note.value(), 127, at_ns);
+}
+
+// only the active groups are visited so that the cost is per group that can actually play something
+static void tick(const sequencer_data & sequence, const std::vector<sample> & samples, player_state *const state,
+		const double now, const double sleep_ms, const bool polyrythmic, const int swing_factor,
+		std::atomic_bool *const force_trigger, sound_parameters *const sound_pars,
+		midi_scheduler *const midi)
+{
+	for(uint32_t i: sequence.active) {
+		int     swing     = swing_factor ? (rand() % swing_factor) - swing_factor / 2 : 0;
+		ssize_t pat_index = get_pattern_index(sequence, i, now - swing, sleep_ms, polyrythmic);
+
+		if ((pat_index != state->prev_pat_index1[i] && pat_index != state->prev_pat_index2[i]) || force_trigger->exchange(false)) {
+			state->prev_pat_index2[i] = state->prev_pat_index1[i];
+			state->prev_pat_index1[i] = pat_index;
+
+			if (sequence.is_set(i, pat_index))
+				trigger(samples, i, sequence.note_delta_at(i, pat_index), sequence.volume_left_at(i, pat_index), sequence.volume_right_at(i, pat_index), sound_pars, midi);
+		}
+	}
+}
+
+// a requested scene starts at the first step of the next bar: the bar that is playing is finished first
+static std::shared_ptr<const scene_data> switch_scene(scene_switch *const scenes, const sequencer_data & sequence, player_state *const state,
+		const double now, std::atomic<double> *const sleep_ms, std::atomic<double> *const t_start)
+{
+	double  bar_ms = *sleep_ms * std::max(sequence.max_steps, size_t(1));
+	int64_t bar    = int64_t(now / bar_ms);
+	bool    is_new = bar != state->prev_bar && state->prev_bar != -1;
+	state->prev_bar = bar;
+
+	if (!is_new || !scenes->pending.load())
+		return { };
+
+	auto scene = scenes->pending.exchange(nullptr);
+	if (!scene)
+		return { };
+
+	*t_start += bar * bar_ms;  // the new scene begins where this bar began
+	if (scene->bpm > 0)
+		*sleep_ms = 60 * 1000 / scene->bpm;  // whole ms, as the gui sets it
+	state->restart();
+	state->prev_bar = -1;
+
+	scenes->playing.store(scene);
+
+	return scene;
+}
+
+// master: midi clock derived from the step clock; like the notes it is put on the queue a little ahead
+// and aligned with when the audio is heard
+static void send_midi_clock(midi_scheduler *const midi, player_state *const state, const sound_parameters *const sound_pars,
+		const double t_start, const double sleep_ms)
+{
+	constexpr const uint64_t lookahead_ns = 20000000;
+
+	uint64_t now_ns   = get_ns();
+	int64_t  to_mono  = int64_t(get_ns_mono()) - int64_t(now_ns);
+	int64_t  delay_ns = int64_t(sound_pars->period_frames + sound_pars->latency_frames) * 1000000000 / sound_pars->sample_rate;
+	double   pulse_ns = sleep_ms * 1000000. / midi_clock_ppqn;
+	uint64_t start_ns = uint64_t(t_start * 1000000);
+	uint64_t current  = now_ns > start_ns ? uint64_t((now_ns - start_ns) / pulse_ns) : 0;
+
+	// (re-)started, rewound or the tempo changed
+	if (!state->clock_running || t_start != state->clock_t_start || sleep_ms != state->clock_sleep_ms) {
+		if (current < midi_clock_ppqn) {  // in the first step: (re)start the slaves from the beginning
+			midi->system_realtime(SND_SEQ_EVENT_START, now_ns + to_mono + delay_ns);
+			state->clock_next_pulse = 0;
+		}
+		else {
+			if (!state->clock_running)
+				midi->system_realtime(SND_SEQ_EVENT_CONTINUE, now_ns + to_mono + delay_ns);
+			state->clock_next_pulse = current + 1;
+		}
+
+		state->clock_running  = true;
+		state->clock_t_start  = t_start;
+		state->clock_sleep_ms = sleep_ms;
+	}
+
+	for(;;) {
+		uint64_t pulse_at_ns = start_ns + uint64_t(state->clock_next_pulse * pulse_ns);
+		if (pulse_at_ns > now_ns + lookahead_ns)
+			break;
+
+		midi->system_realtime(SND_SEQ_EVENT_CLOCK, pulse_at_ns + to_mono + delay_ns);
+		state->clock_next_pulse++;
+	}
+}
+
+static void stop_midi_clock(midi_scheduler *const midi, player_state *const state)
+{
+	if (state->clock_running) {
+		midi->system_realtime(SND_SEQ_EVENT_STOP, get_ns_mono());
+		state->clock_running = false;
+	}
+}
+
+// song mode: play what is due in the compiled timeline
+static void tick_song(const song_timeline & timeline, const std::vector<sample> & samples, timeline_cursor *const cursor, const uint64_t t,
+		sound_parameters *const sound_pars, midi_scheduler *const midi)
+{
+	while(const timeline_event *e = timeline.next(cursor, t))
+		trigger(samples, e->group, e->note_delta, e->volume_left, e->volume_right, sound_pars, midi);
+}
+
+void player(const snapshot<sequencer_data> *const patterns,
+		const std::vector<sample> *const samples,
+		std::atomic<double> *const sleep_ms, sound_parameters *const sound_pars,
 		std::atomic_bool *const pause,    std::atomic_bool *const do_exit,
 		std::atomic_bool *const force_trigger,
 		std::atomic_bool *const polyrythmic,
 		std::atomic_int  *const swing_factor,
-		std::atomic_uint64_t *const t_start)
+		std::atomic<double> *const t_start,
+		pipewire_capture *const capture,
+		player_statistics *const stats,
+		const snapshot<song_timeline> *const song, std::atomic_bool *const song_mode,
+		scene_switch *const scenes, const std::atomic_int *const midi_sync)
 {
-	auto                                midi_port      = allocate_midi_output_port();
-	std::array<ssize_t, pattern_groups> prev_pat_index1;
-	std::array<ssize_t, pattern_groups> prev_pat_index2;
-
-	for(size_t i=0; i<pattern_groups; i++) {
-		prev_pat_index1[i] = size_t(-1);
-		prev_pat_index2[i] = size_t(-1);
-	}
-
-	std::array<int, pattern_groups> swing { };
+	midi_scheduler  midi_out;
+	midi_scheduler *midi      = midi_out.is_ok() ? &midi_out : nullptr;
+	player_state    state(samples->size());
+	timeline_cursor cursor { };
+	std::shared_ptr<const song_timeline> prev_timeline;
+	uint64_t        prev_song_t = 0;
 
 	while(!*do_exit) {
 		if (*pause) {
+			if (midi)
+				stop_midi_clock(midi, &state);
+
 			usleep(10000);
 			continue;
 		}
 
 		{
-			auto now = get_ms() - *t_start;
-			std::shared_lock<std::shared_mutex> pat_lck(*pat_clickables_lock);
-			size_t max_steps = 0;
-			if (!*polyrythmic) {
-				for(size_t i=0; i<pattern_groups; i++) {
-					if ((*samples)[i].s != nullptr)
-						max_steps = std::max(max_steps, (*pat_clickables)[i].dim);
-				}
+			// a scene the player switched to is used until the gui has published it as the current patterns;
+			// so this must be looked at before getting those
+			auto scene = scenes->playing.load();
+			double now = std::max(0., get_ms() - *t_start);  // a followed midi clock can put the start a little ahead
+			// the gui may publish a new version of the patterns meanwhile; this one stays valid until released
+			auto current = patterns->get();
+
+			if (!scene && !*song_mode) {
+				scene = switch_scene(scenes, *current, &state, now, sleep_ms, t_start);
+				if (scene)
+					now = std::max(0., get_ms() - *t_start);
 			}
 
-			for(size_t i=0; i<pattern_groups; i++) {
-				ssize_t pat_index   = 0;
-				ssize_t current_dim = (*pat_clickables)[i].dim;
+			const sequencer_data      & sequence      = scene ? scene->sequence : *current;
+			const std::vector<sample> & cur_samples   = scene ? scene->samples  : *samples;
 
-				{
-					int sw_fac = *swing_factor;
-					if (sw_fac)
-						swing[i] = (rand() % sw_fac) - sw_fac / 2;
-					else
-						swing[i] = 0;
-				}
+			uint64_t start_ns = get_ns_mono();
+			auto timeline = song->get();
+			if (*song_mode && timeline) {
+				uint64_t song_t = uint64_t(now * sample_rate / 1000);
+				// after a rewind or a pause the cursor is put at the current position (so that nothing is played
+				// in a burst). after an edit it continues in the new timeline right after what was played already.
+				if (!prev_timeline || song_t < prev_song_t || song_t - prev_song_t > uint64_t(sample_rate / 2))
+					timeline->seek(&cursor, song_t);
+				else if (timeline != prev_timeline)
+					timeline->seek(&cursor, prev_song_t + 1);
+
+				tick_song(*timeline, cur_samples, &cursor, song_t, sound_pars, midi);
+				prev_timeline = timeline;
+				prev_song_t   = song_t;
+			}
+			else {
+				tick(sequence, cur_samples, &state, now, *sleep_ms, *polyrythmic, *swing_factor, force_trigger, sound_pars, midi);
+			}
+			uint64_t took_ns  = get_ns_mono() - start_ns;
 
-				if (*polyrythmic)
-					pat_index = (now - swing[i]) / *sleep_ms % current_dim;
+			stats->tick_ns  = (stats->tick_ns * 63 + took_ns) / 64;
+			stats->n_active = sequence.active.size();
+
+			if (midi) {
+				if (*midi_sync == ms_master)
+					send_midi_clock(midi, &state, sound_pars, *t_start, *sleep_ms);
 				else
-					pat_index = size_t((now - swing[i]) / double(*sleep_ms) * current_dim / double(max_steps)) % current_dim;
-
-				if ((pat_index != prev_pat_index1[i] && pat_index != prev_pat_index2[i]) || force_trigger->exchange(false)) {
-					prev_pat_index2[i] = prev_pat_index1[i];
-					prev_pat_index1[i] = pat_index;
-
-					std::lock_guard<std::shared_mutex> lck(sound_pars->sounds_lock);
-					if ((*pat_clickables)[i].pattern[pat_index].selected) {
-						if ((*samples)[i].s) {
-							sound_parameters::queued_sound qs { };
-							qs.s     = (*samples)[i].s;
-							qs.t     = 0;
-
-							int    base_note       = qs.s->get_base_midi_note();
-							double base_note_f     = midi_note_to_frequency(base_note);
-							int    adjusted_note   = base_note + (*pat_clickables)[i].note_delta[pat_index];
-							int    adjusted_note_f = midi_note_to_frequency(adjusted_note);
-
-							double pitch           = base_note_f ? adjusted_note_f / base_note_f : 1.;
-							qs.pitch        = pitch;
-							qs.volume_left  = (*pat_clickables)[i].volume_left [pat_index];
-							qs.volume_right = (*pat_clickables)[i].volume_right[pat_index];
-
-							sound_pars->sounds.push_back(qs);
-						}
-
-						if ((*samples)[i].midi_note.has_value() && midi_port.first)
-							send_note(midi_port.first, midi_port.second, (*samples)[i].midi_note.value(), 127);
-					}
-				}
+					stop_midi_clock(midi, &state);
+
+				midi->set_note_length(uint64_t(*sleep_ms * 1000000 / 2));  // half a step
+
+				stats->midi_lead_ns        = midi->get_lead_ns();
+				stats->midi_lead_spread_ns = midi->get_lead_spread_ns();
+				stats->midi_late           = midi->get_n_late();
+			}
+
+			// a recording waits for the start of the pattern of its channel, which is often still empty
+			if (capture && (capture->get_state() == pipewire_capture::cs_armed || capture->get_state() == pipewire_capture::cs_stopping)) {
+				int     ch        = capture->get_channel();
+				ssize_t pat_index = get_pattern_index(sequence, ch, now, *sleep_ms, *polyrythmic);
+				if (pat_index == 0 && state.prev_capture_index != 0)
+					capture->on_pattern_start(ch);
+				state.prev_capture_index = pat_index;
 			}
 		}
 
-		usleep(1000000 / *sleep_ms);
+		usleep(useconds_t(1000000 / *sleep_ms));
+	}
+
+	if (midi)
+		stop_midi_clock(midi, &state);
+}
+
+void benchmark_player(const size_t max_groups, const size_t steps)
+{
+	sound_parameters sound_pars(sample_rate, 2);
+
+	std::vector<double> data(sample_rate / 10);
+	for(size_t i=0; i<data.size(); i++)
+		data[i] = sin(i * 2 * M_PI * 440. / sample_rate);
+	sound_sample *s = new sound_sample(sample_rate, 2, "benchmark", share_sample(std::move(data), 1, sample_rate));
+	s->begin();
+	s->add_default_mapping(1., 1.);
+
+	std::atomic_bool force_trigger { false };
+	constexpr const int sleep_ms = 1;
+	constexpr const int n_ticks  = 10000;
+
+	for(size_t n_groups=8; n_groups<=max_groups; n_groups *= 2) {
+		std::vector<sample> samples(n_groups);
+		for(auto & element: samples)
+			element.s = s;
+
+		// all groups active and then only 8 of them: the latter should not depend on n_groups
+		for(size_t n_active: { n_groups, size_t(8) }) {
+			sequencer_data sequence(n_groups, steps, steps);
+			for(size_t g=0; g<n_groups; g++) {
+				sequence.enabled[g] = true;
+				if (g < n_active) {
+					for(size_t i=0; i<steps; i += 2)
+						sequence.set(g, i, true);
+				}
+			}
+			sequence.update_active();
+
+			player_state state(n_groups);
+			uint64_t     total_ns = 0;
+			for(int t=0; t<n_ticks; t++) {
+				uint64_t start_ns = get_ns_mono();
+				tick(sequence, samples, &state, t * sleep_ms, sleep_ms, false, 0, &force_trigger, &sound_pars, nullptr);
+				total_ns += get_ns_mono() - start_ns;
+
+				sound_pars.clear_voices();
+			}
+
+			printf("%4zu groups, %4zu active, %zu steps: %8.0f ns per tick, %6.1f ns per active group\n", n_groups, n_active, steps,
+					total_ns / double(n_ticks), total_ns / double(n_ticks) / n_active);
+
+			if (n_active == 8)
+				break;
+		}
 	}
 
-	if (midi_port.first)
-		snd_seq_close(midi_port.first);
+	delete s;
 }
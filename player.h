@@ -1,15 +1,37 @@
 #include <atomic>
 #include <cstdint>
+#include <vector>
 
 #include "gui.h"
-#include "pipewire-audio.h"
+#include "pipewire-capture.h"
+#include "scene.h"
+#include "sequencer.h"
+#include "snapshot.h"
+#include "song.h"
 
 
-void player(const std::array<pattern, pattern_groups> *const pat_clickables, std::shared_mutex *const pat_clickables_lock,
-		const std::array<sample, pattern_groups> *const samples,
-		std::atomic_int  *const sleep_ms, sound_parameters *const sound_pars,
+struct player_statistics
+{
+	std::atomic_uint64_t tick_ns  { 0 };  // average duration of a sequencer tick
+	std::atomic_uint32_t n_active { 0 };  // pattern groups looked at in the last tick
+	// midi notes: how far ahead of when they are due they were put on the sequencer queue and how much that varies
+	std::atomic_int64_t  midi_lead_ns        { 0 };
+	std::atomic_uint64_t midi_lead_spread_ns { 0 };
+	std::atomic_uint32_t midi_late           { 0 };  // notes that were due before they were scheduled
+};
+
+void player(const snapshot<sequencer_data> *const patterns,
+		const std::vector<sample> *const samples,
+		std::atomic<double> *const sleep_ms, sound_parameters *const sound_pars,
 		std::atomic_bool *const pause,    std::atomic_bool *const do_exit,
 		std::atomic_bool *const force_trigger,
 		std::atomic_bool *const polyrythmic,
 		std::atomic_int  *const swing_factor,
-		std::atomic_uint64_t *const t_start);
+		std::atomic<double> *const t_start,
+		pipewire_capture *const capture,
+		player_statistics *const stats,
+		const snapshot<song_timeline> *const song, std::atomic_bool *const song_mode,
+		scene_switch *const scenes, const std::atomic_int *const midi_sync);
+
+// prints how long a sequencer tick takes for an increasing number of pattern groups
+void benchmark_player(const size_t max_groups, const size_t steps);
@@ -0,0 +1,118 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "realtime.h"
+
+
+static std::atomic_bool prefault_enabled { false };
+static std::atomic_bool memory_locked    { false };
+
+static std::string policy_to_name(const int policy)
+{
+	if (policy == SCHED_FIFO)
+		return "SCHED_FIFO";
+	if (policy == SCHED_RR)
+		return "SCHED_RR";
+	return "SCHED_OTHER";
+}
+
+std::string set_thread_realtime(const std::string & name, const int policy, const int priority)
+{
+	sched_param sp { };
+	sp.sched_priority = priority;
+
+	int rc = pthread_setschedparam(pthread_self(), policy, &sp);
+	if (rc)
+		return name + ": cannot set " + policy_to_name(policy) + " priority " + std::to_string(priority) + ": " + strerror(rc);
+
+	return name + ": " + policy_to_name(policy) + " priority " + std::to_string(priority);
+}
+
+std::string set_thread_cpu(const std::string & name, const int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	if (rc)
+		return name + ": cannot pin to cpu " + std::to_string(cpu) + ": " + strerror(rc);
+
+	return name + ": pinned to cpu " + std::to_string(cpu);
+}
+
+std::string lock_memory()
+{
+	// on fault: else every file that is mapped later (e.g. a long sample that is streamed) is read completely
+	// right away and stays in memory
+	if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == 0) {
+		memory_locked = true;
+		return "memory locked";
+	}
+
+	if (errno != EINVAL)
+		return std::string("cannot lock memory: ") + strerror(errno);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		return std::string("cannot lock memory: ") + strerror(errno);
+
+	memory_locked = true;
+	return "memory locked (this kernel cannot lock on fault: samples that are streamed (-L) are read into memory completely)";
+}
+
+void set_prefault(const bool on)
+{
+	prefault_enabled = on;
+}
+
+static void touch_pages(const void *const p, const size_t n)
+{
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+	const volatile uint8_t *bytes = reinterpret_cast<const volatile uint8_t *>(p);
+	uint8_t                 dummy = 0;
+	for(size_t i=0; i<n; i += page_size)
+		dummy += bytes[i];
+	dummy += bytes[n - 1];
+	(void)dummy;
+}
+
+void prefault(const void *const p, const size_t n)
+{
+	if (!prefault_enabled || n == 0)
+		return;
+
+	touch_pages(p, n);
+}
+
+void keep_resident(const void *const p, const size_t n)
+{
+	if (n == 0 || mlock(p, n) == 0)
+		return;
+
+	touch_pages(p, n);
+}
+
+void make_resident(const void *const p, const size_t n)
+{
+	if (prefault_enabled || memory_locked)
+		keep_resident(p, n);
+}
+
+void let_go(const void *const p, const size_t n)
+{
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+	// only whole pages, so that the ones it shares with what comes before stay locked
+	uintptr_t from = (reinterpret_cast<uintptr_t>(p) + page_size - 1) & ~(page_size - 1);
+	uintptr_t to   = reinterpret_cast<uintptr_t>(p) + n;
+	if (to > from)
+		munlock(reinterpret_cast<const void *>(from), to - from);
+}
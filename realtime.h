@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <sched.h>
+#include <string>
+
+
+struct realtime_settings
+{
+	int                policy        { SCHED_OTHER };  // SCHED_FIFO or SCHED_RR for realtime
+	int                priority      { 0           };
+	std::optional<int> audio_cpu;
+	std::optional<int> sequencer_cpu;
+};
+
+// these apply to the calling thread; they return a description of the outcome
+std::string set_thread_realtime(const std::string & name, const int policy, const int priority);
+std::string set_thread_cpu     (const std::string & name, const int cpu);
+
+std::string lock_memory();
+
+// touch every page so that the audio thread does not get page faults when it accesses it for the first time
+void set_prefault(const bool on);
+void prefault(const void *const p, const size_t n);
+// lock it in memory (or, when that is not allowed, at least fault it in), regardless of set_prefault()
+void keep_resident(const void *const p, const size_t n);
+// the same, but only when asked for (set_prefault() or lock_memory()); for file-backed memory, of which
+// pages that were only touched can be dropped again (a sample_pcm unlocks its mapping when it goes away)
+void make_resident(const void *const p, const size_t n);
+// undoes lock_memory() for it (e.g. for the part of a sample that is streamed), so that the kernel can drop those
+// pages again
+void let_go(const void *const p, const size_t n);
@@ -0,0 +1,96 @@
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "filter.h"
+#include "reclaimer.h"
+#include "sound.h"
+
+
+reclaimer::reclaimer(const sound_parameters *const sp) : sp(sp)
+{
+	th = new std::thread(&reclaimer::run, this);
+}
+
+reclaimer::~reclaimer()
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		stop_flag = true;
+		cv.notify_all();
+	}
+
+	th->join();
+	delete th;
+
+	collect(true);
+}
+
+void reclaimer::retire(sound_sample *const s)
+{
+	if (!s)
+		return;
+
+	std::unique_lock<std::mutex> lck(lock);
+	retired.push_back({ [s] { return s->n_voices == 0; }, [s] { delete s; } });
+	cv.notify_all();
+}
+
+void reclaimer::retire(filter_butterworth *const f)
+{
+	if (!f)
+		return;
+
+	// the period that is being mixed now may still use it, the one after that cannot
+	uint64_t period = sp->n_periods.load(std::memory_order_acquire) + 2;
+
+	std::unique_lock<std::mutex> lck(lock);
+	retired.push_back({ [this, period] { return sp->n_periods.load(std::memory_order_acquire) >= period; }, [f] { delete f; } });
+	cv.notify_all();
+}
+
+size_t reclaimer::get_n_pending()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	return retired.size();
+}
+
+void reclaimer::collect(const bool all)
+{
+	std::vector<retired_object> unused;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		for(size_t i=0; i<retired.size();) {
+			if (all || retired[i].is_unused()) {
+				unused.push_back(std::move(retired[i]));
+				retired.erase(retired.begin() + i);
+			}
+			else {
+				i++;
+			}
+		}
+	}
+
+	// freeing a sample can mean munmap'ing or freeing many megabytes: that is done without holding the lock
+	for(auto & object: unused)
+		object.free();
+
+	n_freed += unused.size();
+}
+
+void reclaimer::run()
+{
+	for(;;) {
+		{
+			std::unique_lock<std::mutex> lck(lock);
+			cv.wait_for(lck, std::chrono::milliseconds(50), [this] { return stop_flag; });
+			if (stop_flag)
+				break;
+		}
+
+		collect(false);
+	}
+}
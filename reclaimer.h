@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "filter.h"
+#include "sound.h"
+
+
+// frees engine objects that were replaced (samples, filters) on a thread of its own: never on the audio
+// thread and without the gui waiting for it. a sample goes when no voice plays it anymore (so that those
+// can finish on it), a filter when the audio thread has finished the period in which it may have used it.
+class reclaimer
+{
+private:
+	struct retired_object
+	{
+		std::function<bool()> is_unused;
+		std::function<void()> free;
+	};
+
+	const sound_parameters     *const sp;
+	std::thread                *th        { nullptr };
+	std::mutex                  lock;
+	std::condition_variable     cv;
+	bool                        stop_flag { false };
+	std::vector<retired_object> retired;
+	std::atomic_uint64_t        n_freed   { 0 };
+
+	void collect(const bool all);
+	void run();
+
+public:
+	reclaimer(const sound_parameters *const sp);
+	virtual ~reclaimer();  // frees what is left: the audio must have been stopped before
+
+	// it must no longer be reachable for the player and the audio thread (e.g. replaced while holding sounds_lock)
+	void retire(sound_sample *const s);
+	// idem, e.g. swapped out of sound_parameters::filter_lp
+	void retire(filter_butterworth *const f);
+
+	size_t   get_n_pending();
+	uint64_t get_n_freed() const { return n_freed; }
+};
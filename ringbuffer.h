@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+
+// lock-free queue for exactly one producer thread and one consumer thread
+template <typename T>
+class ringbuffer
+{
+private:
+	std::vector<T>                 buffer;
+	alignas(64) std::atomic_size_t head { 0 };  // only written by the producer
+	alignas(64) std::atomic_size_t tail { 0 };  // only written by the consumer
+
+public:
+	ringbuffer(const size_t size) : buffer(size + 1)
+	{
+	}
+
+	size_t get_size() const
+	{
+		size_t h = head.load(std::memory_order_acquire);
+		size_t t = tail.load(std::memory_order_acquire);
+		return h >= t ? h - t : buffer.size() - t + h;
+	}
+
+	size_t get_free() const
+	{
+		return buffer.size() - 1 - get_size();
+	}
+
+	bool push(const T & v)
+	{
+		size_t h      = head.load(std::memory_order_relaxed);
+		size_t next_h = (h + 1) % buffer.size();
+		if (next_h == tail.load(std::memory_order_acquire))
+			return false;
+		buffer[h] = v;
+		head.store(next_h, std::memory_order_release);
+		return true;
+	}
+
+	// all or nothing
+	bool push(const T *const data, const size_t n)
+	{
+		if (get_free() < n)
+			return false;
+		size_t h = head.load(std::memory_order_relaxed);
+		for(size_t i=0; i<n; i++) {
+			buffer[h] = data[i];
+			h = (h + 1) % buffer.size();
+		}
+		head.store(h, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T *const v)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+		*v = std::move(buffer[t]);
+		tail.store((t + 1) % buffer.size(), std::memory_order_release);
+		return true;
+	}
+
+	// returns the number of elements retrieved
+	size_t pop(T *const data, const size_t n)
+	{
+		size_t t     = tail.load(std::memory_order_relaxed);
+		size_t h     = head.load(std::memory_order_acquire);
+		size_t count = 0;
+		while(t != h && count < n) {
+			data[count++] = std::move(buffer[t]);
+			t = (t + 1) % buffer.size();
+		}
+		tail.store(t, std::memory_order_release);
+		return count;
+	}
+};
@@ -0,0 +1,143 @@
+#include <cstdio>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "io.h"
+#include "sample.h"
+#include "sample-loader.h"
+
+
+sample_loader::sample_loader(const size_t n_outputs) : n_outputs(n_outputs)
+{
+}
+
+sample_loader::~sample_loader()
+{
+}
+
+void sample_loader::queue(std::shared_ptr<job> j)
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		auto it = jobs.find(j->group);
+		if (it != jobs.end())
+			it->second->cancelled = true;
+		jobs[j->group] = j;
+	}
+
+	// making it resident (see sound_sample::begin()) reads it from disk: that is done here too
+	pool.queue([this, j] {
+			if (j->cancelled)  // a newer one was queued for the group, or a different song was loaded
+				return;
+
+			sound_sample *s = nullptr;
+			try {
+				j->entry.pcm = j->fetch(&j->progress);
+				if (j->entry.pcm)
+					s = create_sample(j->entry, n_outputs);
+			}
+			catch(const std::exception & e) {
+				printf("Cannot load \"%s\": %s\n", j->entry.name.c_str(), e.what());
+			}
+			j->entry.pcm.reset();  // the sound_sample has it
+
+			std::unique_lock<std::mutex> lck(lock);
+			j->s        = s;
+			j->finished = true;
+		});
+}
+
+void sample_loader::load(const size_t group, const std::string & file_name)
+{
+	auto j = std::make_shared<job>();
+	j->group           = group;
+	j->entry.name      = file_name;
+	j->entry.vol_left  = 1.;
+	j->entry.vol_right = 1.;
+	j->fetch           = [file_name](std::atomic<double> *const progress) { return load_sample(file_name, progress); };
+
+	queue(j);
+}
+
+void sample_loader::load(const size_t group, const pending_sample & pending)
+{
+	auto j = std::make_shared<job>();
+	j->group = group;
+	j->entry = pending.entry;
+	j->fetch = pending.fetch;
+
+	queue(j);
+}
+
+void sample_loader::cancel()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	// the ones that are busy finish, but nobody looks at them; the ones that have not started yet are skipped
+	for(auto & j: jobs)
+		j.second->cancelled = true;
+	jobs.clear();
+}
+
+void sample_loader::load_file(const std::string & file_name, const sequencer_data & data, const std::vector<file_parameter> & parameters)
+{
+	auto j = std::make_shared<file_job>(file_name, data);
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		if (file)
+			file->cancelled = true;
+		file = j;
+	}
+
+	// a file in the original format is parsed completely (the sample data is in the json)
+	pool.queue([this, j, parameters] {
+			if (j->cancelled)
+				return;
+
+			file_result & r = j->r;
+			r.ok = read_file_deferred(r.file_name, &r.data, &parameters, &r.song, &r.samples, &r.parameters);
+
+			std::unique_lock<std::mutex> lck(lock);
+			j->finished = true;
+		});
+}
+
+std::optional<sample_loader::file_result> sample_loader::get_file_result()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	if (!file || !file->finished)
+		return { };
+
+	file_result r = std::move(file->r);
+	file.reset();
+	return r;
+}
+
+std::optional<double> sample_loader::get_progress(const size_t group)
+{
+	std::unique_lock<std::mutex> lck(lock);
+	auto it = jobs.find(group);
+	if (it == jobs.end())
+		return { };
+
+	return it->second->progress.load();
+}
+
+std::optional<sample_loader::result> sample_loader::get_result()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	for(auto it = jobs.begin(); it != jobs.end(); it++) {
+		if (it->second->finished) {
+			job & j = *it->second;
+			result r { j.group, j.entry.name, j.entry.midi_note, j.s };
+			j.s = nullptr;
+			jobs.erase(it);
+			return r;
+		}
+	}
+
+	return { };
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "io.h"
+#include "sample.h"
+#include "sequencer.h"
+#include "song.h"
+#include "sound.h"
+#include "worker-pool.h"
+
+
+// decodes and analyzes samples for pattern groups on a few threads, so that the gui keeps running and the
+// audio thread never waits for it; several groups are loaded at the same time
+class sample_loader
+{
+private:
+	struct job
+	{
+		size_t                      group;
+		file_snapshot::sample_entry entry;
+		pcm_fetch                   fetch;
+		std::atomic<double>         progress  { 0.      };
+		std::atomic_bool            cancelled { false   };  // checked before it is decoded
+		sound_sample               *s         { nullptr };  // nullptr: failed
+		bool                        finished  { false   };
+
+		~job() { delete s; }  // when nobody took it (e.g. cancelled)
+	};
+
+public:
+	struct file_result
+	{
+		std::string                 file_name;
+		bool                        ok;
+		sequencer_data              data;
+		song_data                   song;
+		parameter_values            parameters;
+		std::vector<pending_sample> samples;  // to be given to load()
+	};
+
+private:
+	struct file_job
+	{
+		file_result      r;
+		std::atomic_bool cancelled { false };
+		bool             finished  { false };
+
+		file_job(const std::string & file_name, const sequencer_data & data) : r { file_name, false, data, { }, { }, { } } { }
+	};
+
+	const size_t                            n_outputs;
+	std::mutex                              lock;
+	std::map<size_t, std::shared_ptr<job> > jobs;  // the latest one per group
+	std::shared_ptr<file_job>               file;  // the latest song file
+	worker_pool                             pool;  // last, so that it stops before the rest goes away
+
+	void queue(std::shared_ptr<job> j);
+
+public:
+	sample_loader(const size_t n_outputs);
+	virtual ~sample_loader();
+
+	struct result
+	{
+		size_t             group;
+		std::string        file_name;
+		std::optional<int> midi_note;
+		sound_sample      *s;  // nullptr: could not be loaded; else the caller owns it
+	};
+
+	// a sample file, with the default mapping; replaces what is being loaded for that group
+	void load(const size_t group, const std::string & file_name);
+	// a sample from a .kaboem-file (see read_file_deferred()), configured as it was saved
+	void load(const size_t group, const pending_sample & pending);
+	// what is being loaded is no longer wanted (e.g. because a different song was loaded); that includes
+	// what is waiting in the pool
+	void cancel();
+
+	// reads a .kaboem-file (see read_file_deferred(), with 'data' as the template for its patterns); of 'parameters'
+	// only the names and types are used, see set_parameters(). replaces the one that is being read; does not cancel().
+	void load_file(const std::string & file_name, const sequencer_data & data, const std::vector<file_parameter> & parameters);
+	// the file, when it has been read
+	std::optional<file_result> get_file_result();
+
+	// 0...1, nothing when the group is not being loaded
+	std::optional<double> get_progress(const size_t group);
+	// one of the loads that have finished
+	std::optional<result> get_result();
+};
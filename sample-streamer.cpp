@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+#include "sample.h"
+#include "sample-streamer.h"
+
+
+static double stream_threshold = 0.;  // seconds
+
+void set_stream_threshold(const double seconds)
+{
+	stream_threshold = seconds;
+}
+
+bool is_streaming_enabled()
+{
+	return stream_threshold > 0.;
+}
+
+bool is_long_sample(const size_t n_frames, const unsigned int sample_rate)
+{
+	return stream_threshold > 0. && n_frames > stream_threshold * sample_rate;
+}
+
+size_t get_stream_head_frames(const sample_pcm & pcm)
+{
+	return sample_streamer::ring_bytes / 2 / (pcm.n_channels * sizeof(double));
+}
+
+bool should_stream(const sample_pcm & pcm)
+{
+	return pcm.mapping && is_long_sample(pcm.n_frames, pcm.sample_rate) && pcm.n_frames > get_stream_head_frames(pcm) * 2;
+}
+
+sample_streamer::sample_streamer()
+{
+	for(auto & s: streams)
+		s.ring = new double[ring_bytes / sizeof(double)];
+
+	th = new std::thread(&sample_streamer::run, this);
+}
+
+sample_streamer::~sample_streamer()
+{
+	stop_flag = true;
+	th->join();
+	delete th;
+
+	for(auto & s: streams)
+		delete [] s.ring;
+}
+
+int sample_streamer::start(const std::shared_ptr<const sample_pcm> & pcm)
+{
+	for(size_t i=0; i<n_streams; i++) {
+		stream & s = streams[i];
+		if (s.state.load(std::memory_order_acquire) != st_free)
+			continue;
+
+		// nobody else looks at a free one; the streamer thread only after it became active
+		s.pcm           = pcm;
+		s.n_ring_frames = get_stream_head_frames(*pcm) * 2;
+		s.read_pos.store(0, std::memory_order_relaxed);
+		s.fill_end.store(get_stream_head_frames(*pcm), std::memory_order_relaxed);
+		s.state.store(st_active, std::memory_order_release);
+
+		return i;
+	}
+
+	n_no_stream++;
+
+	return -1;
+}
+
+void sample_streamer::stop(const int nr)
+{
+	// the streamer thread frees it (and drops the pcm) when it is no longer filling it
+	if (nr >= 0)
+		streams[nr].state.store(st_released, std::memory_order_release);
+}
+
+const double *sample_streamer::get_frame(const int nr, const size_t frame)
+{
+	static const double silence[64] { };
+
+	if (nr < 0) {
+		n_underflows.fetch_add(1, std::memory_order_relaxed);
+		return silence;
+	}
+
+	stream & s = streams[nr];
+	s.read_pos.store(frame, std::memory_order_release);  // what is before it may be overwritten now
+
+	size_t end = s.fill_end.load(std::memory_order_acquire);
+	if (frame >= end || frame + s.n_ring_frames < end) {
+		n_underflows.fetch_add(1, std::memory_order_relaxed);
+		return silence;
+	}
+
+	return &s.ring[(frame % s.n_ring_frames) * s.pcm->n_channels];
+}
+
+size_t sample_streamer::get_n_active()
+{
+	size_t n = 0;
+	for(auto & s: streams)
+		n += s.state.load(std::memory_order_relaxed) == st_active;
+
+	return n;
+}
+
+// the page faults (disk reads) of the mapping happen here instead of on the audio thread
+void sample_streamer::fill(stream *const s)
+{
+	const sample_pcm & pcm          = *s->pcm;
+	const size_t       n_channels   = pcm.n_channels;
+	constexpr size_t   n_piece      = 8192;  // frames, so that the audio thread sees progress early
+
+	size_t read_pos = s->read_pos.load(std::memory_order_acquire);
+	size_t end      = s->fill_end.load(std::memory_order_relaxed);
+	size_t target   = std::min(pcm.n_frames, read_pos + s->n_ring_frames);
+
+	// skip what the voice has already passed (e.g. while it was muted)
+	if (end < read_pos) {
+		end = read_pos;
+		s->fill_end.store(end, std::memory_order_release);
+	}
+
+	if (end < target) {  // ask the kernel to read what comes after this already
+		static const size_t page_size = sysconf(_SC_PAGESIZE);
+		uintptr_t from = reinterpret_cast<uintptr_t>(pcm.get_frame(target)) & ~(page_size - 1);
+		uintptr_t to   = reinterpret_cast<uintptr_t>(pcm.get_frame(std::min(pcm.n_frames, target + s->n_ring_frames / 2)));
+		if (to > from)
+			madvise(reinterpret_cast<void *>(from), to - from, MADV_WILLNEED);
+	}
+
+	while(end < target && s->state.load(std::memory_order_relaxed) == st_active) {
+		size_t n = std::min({ target - end, n_piece, s->n_ring_frames - end % s->n_ring_frames });
+		memcpy(&s->ring[(end % s->n_ring_frames) * n_channels], pcm.get_frame(end), n * n_channels * sizeof(double));
+
+		end += n;
+		s->fill_end.store(end, std::memory_order_release);
+		n_bytes_read += n * n_channels * sizeof(double);
+	}
+}
+
+void sample_streamer::run()
+{
+	while(!stop_flag) {
+		for(auto & s: streams) {
+			int state = s.state.load(std::memory_order_acquire);
+			if (state == st_released) {
+				s.pcm.reset();
+				s.state.store(st_free, std::memory_order_release);
+			}
+			else if (state == st_active) {
+				fill(&s);
+			}
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+
+	for(auto & s: streams)
+		s.pcm.reset();
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "sample.h"
+
+
+// long samples can be played without having them in memory: when they are memory-mapped (from a .kaboem-file or
+// the decoded-sample cache) only their head is kept resident, so that they start instantly. the rest is read ahead
+// by a thread of its own into a ring buffer per voice. the audio thread never waits for it: data that is not there
+// in time is played as silence and counted as an underflow.
+class sample_streamer
+{
+public:
+	static constexpr const size_t n_streams   = 16;               // voices that can stream at the same time
+	static constexpr const size_t ring_bytes  = 2 * 1024 * 1024;  // per stream; the head is half of it
+
+private:
+	enum { st_free, st_active, st_released };
+
+	struct stream
+	{
+		std::atomic_int                   state     { st_free };
+		std::shared_ptr<const sample_pcm> pcm;                  // only changed while st_free
+		size_t                            n_ring_frames { 0 };
+		std::atomic<size_t>               read_pos  { 0 };      // frame the audio thread is at
+		std::atomic<size_t>               fill_end  { 0 };      // the frames before this one (but at most n_ring_frames) are in the ring
+		double                           *ring      { nullptr };
+	};
+
+	stream                 streams[n_streams];
+	std::thread           *th           { nullptr };
+	std::atomic_bool       stop_flag    { false };
+
+	std::atomic_uint64_t   n_underflows { 0 };  // frames played as silence
+	std::atomic_uint64_t   n_no_stream  { 0 };  // voices that found no free stream
+	std::atomic_uint64_t   n_bytes_read { 0 };
+
+	void fill(stream *const s);
+	void run();
+
+public:
+	sample_streamer();
+	virtual ~sample_streamer();
+
+	// audio and player thread (holding sounds_lock), lock-free; -1 when none is free
+	int  start(const std::shared_ptr<const sample_pcm> & pcm);
+	void stop(const int nr);
+	// frame 'frame' (at or after the head) of the sample of stream 'nr'
+	const double *get_frame(const int nr, const size_t frame);
+
+	size_t   get_n_active();
+	uint64_t get_n_underflows() const { return n_underflows; }
+	uint64_t get_n_no_stream()  const { return n_no_stream;  }
+	uint64_t get_n_bytes_read() const { return n_bytes_read; }
+};
+
+// samples longer than this are streamed (when they are memory-mapped); 0 (the default) switches it off
+void set_stream_threshold(const double seconds);
+bool is_streaming_enabled();
+bool is_long_sample(const size_t n_frames, const unsigned int sample_rate);
+bool should_stream(const sample_pcm & pcm);
+// frames at the start that are kept in memory
+size_t get_stream_head_frames(const sample_pcm & pcm);
@@ -1,62 +1,379 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
-#include <optional>
 #include <sndfile.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <vector>
 
 #include "error.h"
 #include "frequencies.h"
+#include "pcm-cache.h"
+#include "sample-streamer.h"
+#include "sample.h"
 
 
-double find_loudest_frequency(const std::vector<std::vector<double> > & samples, const unsigned sample_sample_rate)
+sample_pcm::sample_pcm(std::vector<double> && interleaved, const size_t n_channels, const unsigned int sample_rate) :
+	owned(std::move(interleaved)),
+	n_channels(n_channels),
+	sample_rate(sample_rate)
 {
-	size_t  n_ch      = samples.at(0).size();
-	size_t  n_samples = samples.size();
-	double *mono      = new double[n_samples]();
-	for(size_t i=0; i<n_samples; i++) {
-		for(size_t ch=0; ch<n_ch; ch++)
-			mono[i] += samples[i][ch];
-		mono[i] /= n_ch;
+	// a buffer that was grown while decoding (length not known up front) would keep its slack for as long as the sample lives
+	if (owned.capacity() > owned.size())
+		owned.shrink_to_fit();
+
+	frames   = owned.data();
+	n_frames = owned.size() / n_channels;
+}
+
+sample_pcm::sample_pcm(void *const mapping, const size_t mapping_size, const double *const frames, const size_t n_frames, const size_t n_channels, const unsigned int sample_rate) :
+	frames(frames),
+	n_frames(n_frames),
+	n_channels(n_channels),
+	sample_rate(sample_rate),
+	mapping(mapping),
+	mapping_size(mapping_size)
+{
+}
+
+sample_pcm::~sample_pcm()
+{
+	// it may have been locked in memory (see make_resident()); that lasts until here, so while a sound or the
+	// cache (the budget) keeps it
+	if (mapping) {
+		munlock(mapping, mapping_size);
+		munmap(mapping, mapping_size);
+	}
+}
+
+// the mono mix (for more than one channel) and the fft output
+static size_t get_analysis_bytes(const size_t n_frames, const size_t n_channels)
+{
+	return (n_channels > 1 ? n_frames * sizeof(double) : 0) + (n_frames / 2 + 1) * (sizeof(double) * 2 + sizeof(double));
+}
+
+double find_loudest_frequency(const double *const frames, const size_t n_frames, const size_t n_channels, const unsigned sample_sample_rate)
+{
+	if (n_channels == 1)
+		return find_loudest_freq(frames, n_frames, sample_sample_rate);
+
+	double *mono = new double[n_frames]();
+	for(size_t i=0; i<n_frames; i++) {
+		for(size_t ch=0; ch<n_channels; ch++)
+			mono[i] += frames[i * n_channels + ch];
+		mono[i] /= n_channels;
 	}
 
-	double loudest_frequency = find_loudest_freq(mono, n_samples, sample_sample_rate);
+	double loudest_frequency = find_loudest_freq(mono, n_frames, sample_sample_rate);
 	delete [] mono;
 	return loudest_frequency;
 }
 
-std::optional<std::tuple<std::vector<std::vector<double> > *, unsigned int, double> > load_sample(const std::string & filename)
+static std::mutex                                                       registry_lock;
+static std::map<std::string, std::weak_ptr<const sample_pcm> >          registry_files;  // see get_file_key()
+static std::multimap<uint64_t, std::weak_ptr<const sample_pcm> >        registry_data;
+
+// samples that are no longer used stay in memory (least recently used ones go first) while they fit in the
+// budget, so that loading them again is free
+typedef std::list<std::shared_ptr<const sample_pcm> > lru_list;
+static lru_list                                                         cache_lru;  // most recently used first
+static std::map<const sample_pcm *, lru_list::iterator>                 cache_index;
+static size_t                                                           cache_bytes   { 0 };
+static size_t                                                           cache_budget  { size_t(256) * 1024 * 1024 };
+static uint64_t                                                         cache_hits    { 0 };
+static uint64_t                                                         cache_misses  { 0 };
+static size_t                                                           last_load_pcm_bytes       { 0 };
+static size_t                                                           last_load_allocated_bytes { 0 };
+
+uint64_t hash_sample_add(const uint64_t hash, const double *const frames, const size_t n)
+{
+	uint64_t       out = hash;
+	const uint8_t *p   = reinterpret_cast<const uint8_t *>(frames);
+
+	for(size_t i=0; i<n * sizeof(double); i++) {
+		out ^= p[i];
+		out *= 0x100000001b3ull;
+	}
+
+	return out;
+}
+
+uint64_t hash_sample(const double *const frames, const size_t n, const unsigned int sample_rate)
+{
+	return hash_sample_add(0xcbf29ce484222325ull ^ sample_rate, frames, n);  // FNV-1a
+}
+
+static bool is_same(const sample_pcm & a, const sample_pcm & b)
+{
+	return a.sample_rate == b.sample_rate && a.n_channels == b.n_channels && a.n_frames == b.n_frames &&
+		memcmp(a.frames, b.frames, a.get_size_in_bytes()) == 0;
+}
+
+// the caller must hold registry_lock
+static std::shared_ptr<const sample_pcm> find_shared(const sample_pcm & pcm)
+{
+	auto range = registry_data.equal_range(pcm.hash);
+	for(auto it = range.first; it != range.second; it++) {
+		auto other = it->second.lock();
+		if (other && is_same(*other, pcm))
+			return other;
+	}
+
+	return { };
+}
+
+// the caller must hold registry_lock
+static void evict_over_budget()
+{
+	while(cache_bytes > cache_budget && cache_lru.empty() == false) {
+		cache_bytes -= cache_lru.back()->get_size_in_bytes();
+		cache_index.erase(cache_lru.back().get());
+		cache_lru.pop_back();  // only freed when no sound uses it anymore
+	}
+}
+
+// the caller must hold registry_lock
+static void touch(const std::shared_ptr<const sample_pcm> & pcm, const bool hit)
+{
+	if (hit)
+		cache_hits++;
+	else
+		cache_misses++;
+
+	auto it = cache_index.find(pcm.get());
+	if (it != cache_index.end())
+		cache_lru.splice(cache_lru.begin(), cache_lru, it->second);
+	else {
+		cache_lru.push_front(pcm);
+		cache_index[pcm.get()] = cache_lru.begin();
+		cache_bytes += pcm->get_size_in_bytes();
+		evict_over_budget();
+	}
+}
+
+void set_sample_cache_budget(const size_t bytes)
+{
+	std::lock_guard<std::mutex> lck(registry_lock);
+	cache_budget = bytes;
+	evict_over_budget();
+}
+
+sample_cache_statistics get_sample_cache_statistics()
+{
+	std::lock_guard<std::mutex> lck(registry_lock);
+	return { cache_hits, cache_misses, cache_lru.size(), cache_bytes, cache_budget, last_load_pcm_bytes, last_load_allocated_bytes };
+}
+
+// the caller must hold registry_lock
+static void forget_unused()
 {
+	std::erase_if(registry_files, [](const auto & element) { return element.second.expired(); });
+	std::erase_if(registry_data,  [](const auto & element) { return element.second.expired(); });
+}
+
+std::shared_ptr<const sample_pcm> share_sample(std::shared_ptr<sample_pcm> && pcm)
+{
+	std::lock_guard<std::mutex> lck(registry_lock);
+	auto other = find_shared(*pcm);
+	if (other) {
+		touch(other, true);
+		return other;
+	}
+	forget_unused();
+	registry_data.insert({ pcm->hash, pcm });
+	touch(pcm, false);
+
+	return pcm;
+}
+
+std::shared_ptr<const sample_pcm> share_sample(std::vector<double> && interleaved, const size_t n_channels, const unsigned int sample_rate)
+{
+	auto pcm  = std::make_shared<sample_pcm>(std::move(interleaved), n_channels, sample_rate);
+	pcm->hash = hash_sample(pcm->frames, pcm->n_frames * n_channels, sample_rate);
+
+	{
+		std::lock_guard<std::mutex> lck(registry_lock);
+		auto other = find_shared(*pcm);
+		if (other) {
+			touch(other, true);
+			return other;
+		}
+	}
+
+	// analyzing it takes a while; don't block other loaders meanwhile
+	pcm->loudest_frequency = find_loudest_frequency(pcm->frames, pcm->n_frames, n_channels, sample_rate);
+
+	return share_sample(std::move(pcm));  // someone else may have been faster
+}
+
+// the loudest frequency of a long sample is looked for in its start only: the fft of all of it would need about
+// as much memory as the sample itself
+constexpr const double analysis_seconds = 30.;
+
+// decodes 'sh' into an entry of the decoded-sample cache, a chunk at a time, and then maps that
+static std::shared_ptr<const sample_pcm> decode_to_pcm_cache(const std::string & filename, SNDFILE *const sh, const SF_INFO & si,
+		std::atomic<double> *const progress, size_t *const allocated_bytes)
+{
+	constexpr sf_count_t chunk_size      = 65536;  // frames
+	const sf_count_t     analysis_frames = std::min(si.frames, sf_count_t(analysis_seconds * si.samplerate));
+
+	pcm_cache_writer    writer(filename, si.channels, si.samplerate);
+	std::vector<double> chunk(chunk_size * si.channels);
+	std::vector<double> head;
+	head.reserve(analysis_frames * si.channels);
+
+	uint64_t   hash    = hash_sample(nullptr, 0, si.samplerate);
+	sf_count_t n_total = 0;
+	while(writer.is_ok()) {
+		sf_count_t n = sf_readf_double(sh, chunk.data(), chunk_size);
+		if (n <= 0)
+			break;
+
+		hash = hash_sample_add(hash, chunk.data(), n * si.channels);
+
+		sf_count_t n_head = std::min(n, analysis_frames - std::min(n_total, analysis_frames));
+		head.insert(head.end(), chunk.data(), chunk.data() + n_head * si.channels);
+
+		if (writer.add(chunk.data(), n) == false)
+			return { };
+
+		n_total += n;
+		if (progress)
+			*progress = n_total / double(si.frames);
+	}
+
+	if (n_total == 0 || writer.is_ok() == false)
+		return { };
+
+	*allocated_bytes = (chunk.capacity() + head.capacity()) * sizeof(double) + get_analysis_bytes(head.size() / si.channels, si.channels);
+
+	double loudest_frequency = find_loudest_frequency(head.data(), head.size() / si.channels, si.channels, si.samplerate);
+	if (writer.finish(hash, loudest_frequency) == false)
+		return { };
+
+	auto mapped = find_in_pcm_cache(filename);
+	if (!mapped)
+		return { };
+
+	return share_sample(std::move(mapped));
+}
+
+// the name with the size and modification time of the file (as the decoded-sample cache uses), so that a file
+// that was edited or replaced on disk is loaded again instead of coming from memory
+static std::string get_file_key(const std::string & filename)
+{
+	struct stat st { };
+	if (stat(filename.c_str(), &st) == -1)
+		return filename;
+
+	return filename + "|" + std::to_string(st.st_size) + "|" + std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec);
+}
+
+std::shared_ptr<const sample_pcm> load_sample(const std::string & filename, std::atomic<double> *const progress)
+{
+	const std::string key = get_file_key(filename);
+
+	{
+		std::lock_guard<std::mutex> lck(registry_lock);
+		auto it = registry_files.find(key);
+		if (it != registry_files.end()) {
+			auto pcm = it->second.lock();
+			if (pcm) {
+				touch(pcm, true);
+				return pcm;
+			}
+		}
+	}
+
+	// decoded and analyzed before (also in an earlier run)
+	auto cached = find_in_pcm_cache(filename);
+	if (cached) {
+		auto pcm = share_sample(std::move(cached));
+
+		std::lock_guard<std::mutex> lck(registry_lock);
+		registry_files[key]       = pcm;
+		last_load_pcm_bytes       = pcm->get_size_in_bytes();
+		last_load_allocated_bytes = 0;  // mapped
+		return pcm;
+	}
+
         SF_INFO si = { 0 };
         SNDFILE *sh = sf_open(filename.c_str(), SFM_READ, &si);
 	if (!sh)
 		return { };
 
-	auto *samples = new std::vector<std::vector<double> >();
+	// one that is going to be streamed goes to the decoded-sample cache directly
+	if (si.frames > 0 && is_long_sample(si.frames, si.samplerate) && is_pcm_cache_available()) {
+		size_t allocated_bytes = 0;
+		auto   pcm             = decode_to_pcm_cache(filename, sh, si, progress, &allocated_bytes);
+		if (pcm) {
+			sf_close(sh);
+			printf("Decoded \"%s\" into the sample cache using %.1f MB of memory for %.1f MB of audio\n", filename.c_str(), allocated_bytes / 1048576., pcm->get_size_in_bytes() / 1048576.);
 
-	constexpr int load_buffer_size = 4096;
-	double *buffer = new double[load_buffer_size * si.channels];
+			std::lock_guard<std::mutex> lck(registry_lock);
+			registry_files[key]       = pcm;
+			last_load_pcm_bytes       = pcm->get_size_in_bytes();
+			last_load_allocated_bytes = allocated_bytes;
+			return pcm;
+		}
 
-	for(;;) {
-		sf_count_t cur_n = sf_readf_double(sh, buffer, load_buffer_size);
-		if (cur_n == 0)
-			break;
+		printf("Cannot decode \"%s\" into the sample cache, it is decoded in memory instead\n", filename.c_str());
+		if (sf_seek(sh, 0, SEEK_SET) == -1) {
+			sf_close(sh);
+			return { };
+		}
+	}
+
+	// decoded straight into the buffer that becomes the sample; it is only grown when the length was not known
+	std::vector<double> samples;
+	samples.reserve(std::max(sf_count_t(0), si.frames) * si.channels);
 
-		for(sf_count_t i=0; i<cur_n; i++) {
-			int offset = i * si.channels;
+	constexpr sf_count_t load_chunk_size = 65536;  // frames; how often the progress is updated
 
-			std::vector<double> row;
-			for(int j=offset; j<offset + si.channels; j++)
-				row.push_back(buffer[j]);
-			samples->push_back(row);
+	for(;;) {
+		size_t     have  = samples.size();
+		sf_count_t n     = (samples.capacity() - have) / si.channels;
+		if (n == 0) {
+			if (si.frames > 0 && sf_count_t(have / si.channels) >= si.frames)
+				break;
+			n = load_chunk_size;  // longer than it said, or the length is not known
 		}
+		n = std::min(n, load_chunk_size);
+		samples.resize(have + n * si.channels);
+
+		sf_count_t cur_n = sf_readf_double(sh, samples.data() + have, n);
+		samples.resize(have + std::max(sf_count_t(0), cur_n) * si.channels);
+		if (cur_n <= 0)
+			break;
+
+		if (progress && si.frames > 0)
+			*progress = samples.size() / double(si.frames * si.channels);
 	}
 
 	sf_close(sh);
-	delete [] buffer;
 
-	double loudest_frequency = find_loudest_frequency(*samples, si.samplerate);
-	printf("loudest_frequency of \"%s\": %.1f\n", filename.c_str(), loudest_frequency);
+	if (samples.empty())
+		return { };
+
+	size_t pcm_bytes       = samples.size() * sizeof(double);
+	size_t allocated_bytes = samples.capacity() * sizeof(double) + get_analysis_bytes(samples.size() / si.channels, si.channels);
+
+	// also found when the same data comes from a .kaboem file
+	auto pcm = share_sample(std::move(samples), si.channels, si.samplerate);
+	add_to_pcm_cache(filename, *pcm);
+
+	printf("loudest_frequency of \"%s\": %.1f\n", filename.c_str(), pcm->loudest_frequency);
+	printf("Loading \"%s\" allocated %.1f MB for %.1f MB of audio\n", filename.c_str(), allocated_bytes / 1048576., pcm_bytes / 1048576.);
+
+	std::lock_guard<std::mutex> lck(registry_lock);
+	registry_files[key]       = pcm;
+	last_load_pcm_bytes       = pcm_bytes;
+	last_load_allocated_bytes = allocated_bytes;
 
-	return { { samples, si.samplerate, loudest_frequency } };
+	return pcm;
 }
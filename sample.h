@@ -1,8 +1,64 @@
-#include <optional>
+#pragma once
+
+#include <cstddef>
+#include <atomic>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
 
-// data, sample rate, (loudest-) frequency
-std::optional<std::tuple<std::vector<std::vector<double> > *, unsigned int, double> > load_sample(const std::string & filename);
-double find_loudest_frequency(const std::vector<std::vector<double> > & samples, const unsigned sample_sample_rate);
+// decoded audio of a sample; never changed after it has been shared so it can be used by several sounds
+// the frames are interleaved doubles, either owned or pointing into a memory-mapped .kaboem-file
+struct sample_pcm
+{
+	std::vector<double> owned;
+	const double       *frames            { nullptr };
+	size_t              n_frames          { 0  };
+	size_t              n_channels        { 0  };
+	unsigned int        sample_rate       { 0  };
+	double              loudest_frequency { 0. };
+	uint64_t            hash              { 0  };
+
+	void               *mapping           { nullptr };  // munmap'ed when this object goes away
+	size_t              mapping_size      { 0  };
+
+	sample_pcm(std::vector<double> && interleaved, const size_t n_channels, const unsigned int sample_rate);
+	// takes over 'mapping'; 'frames' points into it
+	sample_pcm(void *const mapping, const size_t mapping_size, const double *const frames, const size_t n_frames, const size_t n_channels, const unsigned int sample_rate);
+	sample_pcm(const sample_pcm &) = delete;
+	sample_pcm & operator=(const sample_pcm &) = delete;
+	virtual ~sample_pcm();
+
+	const double *get_frame(const size_t nr) const { return &frames[nr * n_channels]; }
+	size_t        get_size_in_bytes()        const { return n_frames * n_channels * sizeof(double); }
+};
+
+// both return the same object for the same file or the same data as long as something still uses it (or it
+// is still in the cache); so that e.g. preloaded scenes with the same samples do not use that memory twice
+// 'progress' (0...1), when given, is updated while decoding
+std::shared_ptr<const sample_pcm> load_sample(const std::string & filename, std::atomic<double> *const progress = nullptr);
+std::shared_ptr<const sample_pcm> share_sample(std::vector<double> && interleaved, const size_t n_channels, const unsigned int sample_rate);
+// for a pcm that was read with its hash and loudest frequency (e.g. from a .kaboem-file): these are not
+// calculated again, so that the (mapped) data is not touched
+std::shared_ptr<const sample_pcm> share_sample(std::shared_ptr<sample_pcm> && pcm);
+struct sample_cache_statistics
+{
+	uint64_t hits;       // loads that found the same file or the same data in memory
+	uint64_t misses;
+	size_t   n_samples;  // kept in memory, used or not
+	size_t   n_bytes;
+	size_t   budget;
+	// the most recent file that was decoded: its size and what was allocated for it (decoding and analysis)
+	size_t   last_load_pcm_bytes;
+	size_t   last_load_allocated_bytes;
+};
+
+// unused samples are kept until they no longer fit in 'bytes' (default 256 MB)
+void set_sample_cache_budget(const size_t bytes);
+sample_cache_statistics get_sample_cache_statistics();
+
+uint64_t hash_sample(const double *const frames, const size_t n, const unsigned int sample_rate);
+// continues a hash_sample() over the next 'n' values (e.g. while decoding)
+uint64_t hash_sample_add(const uint64_t hash, const double *const frames, const size_t n);
+double find_loudest_frequency(const double *const frames, const size_t n_frames, const size_t n_channels, const unsigned sample_sample_rate);
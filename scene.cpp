@@ -0,0 +1,60 @@
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "io.h"
+#include "scene.h"
+
+
+scene_data::scene_data(const size_t n_groups, const size_t max_steps) :
+	sequence(n_groups, max_steps, 16),
+	samples(n_groups)
+{
+}
+
+scene_data::~scene_data()
+{
+	if (owns_samples) {
+		for(auto & s: samples)
+			delete s.s;
+	}
+}
+
+scene_loader::scene_loader(const std::string & file_name, const size_t n_groups, const size_t max_steps, const size_t n_outputs) :
+	file_name(file_name),
+	scene(std::make_shared<scene_data>(n_groups, max_steps))
+{
+	scene->file_name = file_name;
+
+	th = new std::thread(&scene_loader::load, this, n_outputs);
+}
+
+scene_loader::~scene_loader()
+{
+	th->join();
+	delete th;
+}
+
+void scene_loader::load(const size_t n_outputs)
+{
+	const std::vector<file_parameter> parameters {
+		{ "bpm", file_parameter::T_INT, &scene->bpm, nullptr, nullptr, nullptr, nullptr, nullptr }
+	};
+
+	if (read_file(file_name, &scene->sequence, &scene->samples, &parameters, n_outputs, &scene->song)) {
+		for(size_t i=0; i<scene->samples.size(); i++)
+			scene->sequence.enabled[i] = scene->samples[i].s != nullptr;
+		scene->sequence.update_active();
+
+		printf("Scene %s preloaded\n", file_name.c_str());
+	}
+	else {
+		printf("Cannot preload scene %s\n", file_name.c_str());
+		scene.reset();
+	}
+
+	finished = true;
+}
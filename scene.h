@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gui.h"
+#include "sequencer.h"
+#include "song.h"
+
+
+constexpr const size_t n_scenes = 8;  // F1...F8
+
+// a .kaboem file that is loaded in the background so that switching to it is instant
+struct scene_data
+{
+	std::string         file_name;
+	sequencer_data      sequence;
+	song_data           song;
+	std::vector<sample> samples;
+	int                 bpm          { 135 };
+	bool                owns_samples { true };  // false after the gui has taken them over
+
+	scene_data(const size_t n_groups, const size_t max_steps);
+	virtual ~scene_data();
+};
+
+class scene_loader
+{
+private:
+	const std::string           file_name;
+	std::thread                *th       { nullptr };
+	std::atomic_bool            finished { false };
+	std::shared_ptr<scene_data> scene;  // nullptr when it could not be read
+
+	void load(const size_t n_outputs);
+
+public:
+	scene_loader(const std::string & file_name, const size_t n_groups, const size_t max_steps, const size_t n_outputs);
+	virtual ~scene_loader();
+
+	bool        is_finished() const { return finished; }
+	std::string get_file_name() const { return file_name; }
+	// only after is_finished() returned true
+	std::shared_ptr<scene_data> get() { return scene; }
+};
+
+// the gui requests a switch, the player does it at the start of the next bar and then plays the
+// scene until the gui has taken it over (and published it as the current patterns)
+struct scene_switch
+{
+	std::atomic<std::shared_ptr<const scene_data> > pending;
+	std::atomic<std::shared_ptr<const scene_data> > playing;
+};
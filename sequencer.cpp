@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "sequencer.h"
+
+
+sequencer_data::sequencer_data(const size_t n_groups, const size_t max_dim, const size_t initial_dim) :
+	n_groups(n_groups),
+	max_dim(max_dim),
+	n_words((max_dim + 63) / 64)
+{
+	steps       .resize(n_groups * n_words);
+	dim         .resize(n_groups, std::min(max_dim, initial_dim));
+	note_delta  .resize(n_groups * max_dim);
+	volume_left .resize(n_groups * max_dim);
+	volume_right.resize(n_groups * max_dim);
+	enabled     .resize(n_groups);
+	active      .reserve(n_groups);
+
+	for(size_t group=0; group<n_groups; group++)
+		clear(group);
+}
+
+void sequencer_data::set(const size_t group, const size_t step, const bool on)
+{
+	uint64_t & word = steps[group * n_words + step / 64];
+	uint64_t   bit  = uint64_t(1) << (step & 63);
+	if (on)
+		word |= bit;
+	else
+		word &= ~bit;
+}
+
+bool sequencer_data::is_empty(const size_t group) const
+{
+	for(size_t i=0; i<n_words; i++) {
+		if (steps[group * n_words + i])
+			return false;
+	}
+	return true;
+}
+
+void sequencer_data::clear(const size_t group)
+{
+	std::fill(steps       .begin() + group * n_words, steps       .begin() + (group + 1) * n_words, 0);
+	std::fill(note_delta  .begin() + group * max_dim, note_delta  .begin() + (group + 1) * max_dim, 0);
+	std::fill(volume_left .begin() + group * max_dim, volume_left .begin() + (group + 1) * max_dim, 1.f);
+	std::fill(volume_right.begin() + group * max_dim, volume_right.begin() + (group + 1) * max_dim, 1.f);
+}
+
+void sequencer_data::update_active()
+{
+	active.clear();
+	max_steps = 0;
+
+	for(size_t group=0; group<n_groups; group++) {
+		if (!enabled[group])
+			continue;
+
+		max_steps = std::max(max_steps, size_t(dim[group]));
+
+		if (!is_empty(group))
+			active.push_back(group);
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+constexpr const size_t default_pattern_groups  = 8;
+constexpr const size_t default_max_pattern_dim = 32;
+
+// what the sequencer needs to know of the patterns: no sdl, no strings. the number of groups and
+// the maximum number of steps are set at runtime. all data is stored per field in one block per
+// field (group after group) so that the trigger check only reads the step bits of a group.
+struct sequencer_data
+{
+	size_t                n_groups  { 0 };
+	size_t                max_dim   { 0 };
+	size_t                n_words   { 0 };  // 64 bit words with step bits per group
+	std::vector<uint64_t> steps;
+	std::vector<uint16_t> dim;
+	std::vector<int8_t>   note_delta;
+	std::vector<float>    volume_left;
+	std::vector<float>    volume_right;
+
+	// set by the owner: group has something to play (a sample)
+	std::vector<uint8_t>  enabled;
+	// filled in by update_active(): the enabled groups with at least one step set. the
+	// player only walks this list so that empty groups cost nothing.
+	std::vector<uint32_t> active;
+	// longest pattern of the enabled groups, used when not polyrythmic
+	size_t                max_steps { 0 };
+
+	sequencer_data(const size_t n_groups, const size_t max_dim, const size_t initial_dim);
+
+	bool is_set(const size_t group, const size_t step) const { return steps[group * n_words + step / 64] & (uint64_t(1) << (step & 63)); }
+	void set   (const size_t group, const size_t step, const bool on);
+	void flip  (const size_t group, const size_t step) { steps[group * n_words + step / 64] ^= uint64_t(1) << (step & 63); }
+	bool is_empty(const size_t group) const;
+
+	int8_t & note_delta_at  (const size_t group, const size_t step)       { return note_delta  [group * max_dim + step]; }
+	int8_t   note_delta_at  (const size_t group, const size_t step) const { return note_delta  [group * max_dim + step]; }
+	float  & volume_left_at (const size_t group, const size_t step)       { return volume_left [group * max_dim + step]; }
+	float    volume_left_at (const size_t group, const size_t step) const { return volume_left [group * max_dim + step]; }
+	float  & volume_right_at(const size_t group, const size_t step)       { return volume_right[group * max_dim + step]; }
+	float    volume_right_at(const size_t group, const size_t step) const { return volume_right[group * max_dim + step]; }
+
+	// everything off, no pitch change, full volume; the step count is kept
+	void clear(const size_t group);
+
+	void update_active();
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+
+// read-copy-update: one thread (the owner) publishes immutable copies of its data, other threads
+// read the latest copy without locking. replaced copies are only freed by the owner (in collect())
+// when no reader uses them anymore, so a reader never ends up freeing memory.
+template <typename T>
+class snapshot
+{
+private:
+	std::atomic<std::shared_ptr<const T> > current;
+	std::vector<std::shared_ptr<const T> > retired;  // only accessed by the owner
+
+public:
+	snapshot()
+	{
+	}
+
+	// readers
+	std::shared_ptr<const T> get() const
+	{
+		return current.load(std::memory_order_acquire);
+	}
+
+	// owner
+	void publish(const T & data)
+	{
+		auto previous = current.exchange(std::make_shared<const T>(data), std::memory_order_acq_rel);
+		if (previous)
+			retired.push_back(std::move(previous));
+
+		collect();
+	}
+
+	void collect()
+	{
+		for(size_t i=0; i<retired.size();) {
+			if (retired[i].use_count() == 1)
+				retired.erase(retired.begin() + i);
+			else
+				i++;
+		}
+	}
+};
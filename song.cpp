@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "sequencer.h"
+#include "song.h"
+
+
+song_timeline::song_timeline()
+{
+}
+
+song_timeline::~song_timeline()
+{
+}
+
+bool song_timeline::set_timing(const int sample_rate_in, const int step_ms_in, const bool polyrythmic_in, const int swing_ms_in)
+{
+	if (sample_rate == sample_rate_in && step_ms == step_ms_in && polyrythmic == polyrythmic_in && swing_ms == swing_ms_in)
+		return false;
+
+	sample_rate = sample_rate_in;
+	step_ms     = step_ms_in;
+	polyrythmic = polyrythmic_in;
+	swing_ms    = swing_ms_in;
+
+	return true;
+}
+
+// same timing as the live player: without polyrythmic all groups span the longest pattern
+void song_timeline::compile_segment(timeline_segment *const segment, const sequencer_data & pattern, const std::vector<uint8_t> & enabled) const
+{
+	size_t max_steps = 0;
+	for(size_t g=0; g<pattern.n_groups; g++) {
+		if (enabled[g])
+			max_steps = std::max(max_steps, size_t(pattern.dim[g]));
+	}
+	if (max_steps == 0) {  // nothing to play, still let it take time
+		for(size_t g=0; g<pattern.n_groups; g++)
+			max_steps = std::max(max_steps, size_t(pattern.dim[g]));
+	}
+
+	double step_samples = step_ms * sample_rate / 1000.;
+	segment->length     = uint64_t(max_steps * step_samples);
+
+	auto events = std::make_shared<std::vector<timeline_event> >();
+
+	for(size_t g=0; g<pattern.n_groups; g++) {
+		if (!enabled[g] || pattern.is_empty(g))
+			continue;
+
+		size_t dim     = pattern.dim[g];
+		size_t n_steps = polyrythmic ? max_steps : dim;
+		double spacing = polyrythmic ? step_samples : segment->length / double(dim);
+
+		for(size_t k=0; k<n_steps; k++) {
+			size_t step = k % dim;
+			if (!pattern.is_set(g, step))
+				continue;
+
+			int64_t t = int64_t(k * spacing);
+			if (swing_ms)
+				t += int64_t(rand() % swing_ms - swing_ms / 2) * sample_rate / 1000;
+			t = std::clamp(t, int64_t(0), int64_t(segment->length) - 1);
+
+			timeline_event e { };
+			e.t            = t;
+			e.group        = g;
+			e.note_delta   = pattern.note_delta_at  (g, step);
+			e.volume_left  = pattern.volume_left_at (g, step);
+			e.volume_right = pattern.volume_right_at(g, step);
+			events->push_back(e);
+		}
+	}
+
+	std::stable_sort(events->begin(), events->end(), [](const timeline_event & a, const timeline_event & b) { return a.t < b.t; });
+
+	segment->events = events;
+}
+
+void song_timeline::update_offsets()
+{
+	length = 0;
+	for(auto & segment: segments) {
+		segment.start = length;
+		length       += segment.length;
+	}
+}
+
+void song_timeline::compile(const song_data & song, const std::vector<uint8_t> & enabled)
+{
+	segments.resize(song.arrangement.size());
+
+	for(size_t i=0; i<segments.size(); i++) {
+		segments[i].pattern = song.arrangement[i];
+		compile_segment(&segments[i], song.patterns.at(song.arrangement[i]), enabled);
+	}
+
+	update_offsets();
+}
+
+void song_timeline::recompile_pattern(const song_data & song, const size_t pattern, const std::vector<uint8_t> & enabled)
+{
+	// the arrangement itself changed (appended or shortened): only compile the new segments
+	size_t n_old = std::min(segments.size(), song.arrangement.size());
+	segments.resize(song.arrangement.size());
+
+	std::shared_ptr<const std::vector<timeline_event> > compiled;
+	uint64_t                                            compiled_length = 0;
+
+	for(size_t i=0; i<segments.size(); i++) {
+		bool is_new = i >= n_old || segments[i].pattern != song.arrangement[i];
+		if (is_new == false && song.arrangement[i] != pattern)
+			continue;
+
+		segments[i].pattern = song.arrangement[i];
+
+		// the same pattern compiles to the same events (apart from swing): do it once
+		if (song.arrangement[i] == pattern && compiled) {
+			segments[i].events = compiled;
+			segments[i].length = compiled_length;
+			continue;
+		}
+
+		compile_segment(&segments[i], song.patterns.at(song.arrangement[i]), enabled);
+
+		if (song.arrangement[i] == pattern) {
+			compiled        = segments[i].events;
+			compiled_length = segments[i].length;
+		}
+	}
+
+	update_offsets();
+}
+
+size_t song_timeline::find_segment(const uint64_t t) const
+{
+	if (segments.empty())
+		return 0;
+
+	uint64_t pos = length ? t % length : 0;
+	auto     it  = std::upper_bound(segments.begin(), segments.end(), pos, [](const uint64_t v, const timeline_segment & s) { return v < s.start; });
+
+	return std::distance(segments.begin(), it) - 1;
+}
+
+void song_timeline::seek(timeline_cursor *const cursor, const uint64_t t) const
+{
+	*cursor = { };
+	if (length == 0)
+		return;
+
+	cursor->loop_start = t - t % length;
+	cursor->segment    = find_segment(t);
+
+	const timeline_segment & segment = segments[cursor->segment];
+	uint64_t                 pos     = t - cursor->loop_start - segment.start;
+	auto                     it      = std::lower_bound(segment.events->begin(), segment.events->end(), pos, [](const timeline_event & e, const uint64_t v) { return e.t < v; });
+	cursor->event                    = std::distance(segment.events->begin(), it);
+}
+
+const timeline_event *song_timeline::next(timeline_cursor *const cursor, const uint64_t t) const
+{
+	if (length == 0 || cursor->segment >= segments.size())
+		return nullptr;
+
+	for(;;) {
+		const timeline_segment & segment = segments[cursor->segment];
+
+		if (cursor->event < segment.events->size()) {
+			const timeline_event & e = (*segment.events)[cursor->event];
+			if (cursor->loop_start + segment.start + e.t > t)
+				return nullptr;
+
+			cursor->event++;
+			return &e;
+		}
+
+		// at the end of this segment: only move on when the next one has started
+		size_t   next_segment = cursor->segment + 1;
+		uint64_t next_loop    = cursor->loop_start;
+		if (next_segment == segments.size()) {
+			next_segment = 0;
+			next_loop   += length;
+		}
+
+		if (next_loop + segments[next_segment].start > t)
+			return nullptr;
+
+		cursor->segment    = next_segment;
+		cursor->event      = 0;
+		cursor->loop_start = next_loop;
+	}
+}
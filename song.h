@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "sequencer.h"
+
+
+// pattern sets that are played one after the other
+struct song_data
+{
+	std::vector<sequencer_data> patterns;
+	std::vector<size_t>         arrangement;  // indexes in 'patterns'
+	size_t                      current { 0 };  // pattern that is being edited
+};
+
+struct timeline_event
+{
+	uint64_t t;  // in samples, relative to the start of the segment
+	uint32_t group;
+	int8_t   note_delta;
+	float    volume_left;
+	float    volume_right;
+};
+
+// one entry of the arrangement
+struct timeline_segment
+{
+	size_t   pattern { 0 };
+	uint64_t start   { 0 };  // in samples, from the start of the song
+	uint64_t length  { 0 };
+	// shared between copies of the timeline; replaced (not changed) when the segment is recompiled
+	std::shared_ptr<const std::vector<timeline_event> > events;
+};
+
+// where the player is in a song_timeline
+struct timeline_cursor
+{
+	size_t   segment    { 0 };
+	size_t   event      { 0 };
+	uint64_t loop_start { 0 };  // sample time at which the current pass through the song started
+};
+
+// the arrangement compiled into sorted, sample-timestamped trigger events. the player walks it
+// with a cursor. edits only recompile the segments that play the edited pattern.
+class song_timeline
+{
+private:
+	std::vector<timeline_segment> segments;
+	uint64_t                      length      { 0 };
+	int                           sample_rate { 0 };
+	int                           step_ms     { 0 };
+	bool                          polyrythmic { false };
+	int                           swing_ms    { 0 };
+
+	void compile_segment(timeline_segment *const segment, const sequencer_data & pattern, const std::vector<uint8_t> & enabled) const;
+	void update_offsets();
+
+public:
+	song_timeline();
+	virtual ~song_timeline();
+
+	// returns true when something changed: then everything needs to be recompiled
+	bool set_timing(const int sample_rate, const int step_ms, const bool polyrythmic, const int swing_ms);
+
+	// 'enabled': the pattern groups that have a sample
+	void compile(const song_data & song, const std::vector<uint8_t> & enabled);
+	void recompile_pattern(const song_data & song, const size_t pattern, const std::vector<uint8_t> & enabled);
+
+	uint64_t get_length()     const { return length;          }
+	size_t   get_n_segments() const { return segments.size(); }
+	const timeline_segment & get_segment(const size_t nr) const { return segments.at(nr); }
+
+	// segment that plays at sample time 't'
+	size_t find_segment(const uint64_t t) const;
+	// put the cursor at the first event at or after sample time 't'
+	void seek(timeline_cursor *const cursor, const uint64_t t) const;
+	// returns the next event that is due at sample time 't' (or nullptr) and moves the cursor past it
+	const timeline_event *next(timeline_cursor *const cursor, const uint64_t t) const;
+};
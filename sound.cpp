@@ -2,7 +2,7 @@
 #include <cmath>
 
 #include "frequencies.h"
-#include "pipewire-audio.h"
+#include "realtime.h"
 #include "sample.h"
 #include "sound.h"
 #include "time.h"
@@ -13,124 +13,169 @@ double f_to_delta_t(const double frequency, const int sample_rate)
 	return 2 * M_PI * frequency / sample_rate;
 }
 
-void on_process_audio(void *userdata)
+// mix all queued sounds into 'mix' (interleaved, n_channels wide)
+// when 'stems' is set, each sound is also added to the stereo pair of its pattern group
+static void mix_sounds(sound_parameters *const sp, double *const mix, const int period_size, float *const *const stems)
 {
-	uint64_t          t  = get_us();
-	sound_parameters *sp = reinterpret_cast<sound_parameters *>(userdata);
-	pw_buffer        *b  = pw_stream_dequeue_buffer(sp->pw.stream);
-	if (b == nullptr) {
-		pw_log_warn("out of buffers: %m");
-		return;
-	}
-	spa_buffer *buf      = b->buffer;
-
-	int     stride       = sizeof(double) * sp->n_channels;
-	// 75: audio-CD had chunks of 1/75th of a second. this gives a latency of around 13.1 ms
-	int     period_size  = std::min(buf->datas[0].maxsize / stride, uint32_t(sp->sample_rate / 75));
-	double  latency      = period_size * 1000000.0 / sp->sample_rate;
-
-	double *dest         = reinterpret_cast<double *>(buf->datas[0].data);
-	if (!dest) {
-		printf("no buffer\n");
-		return;
-	}
-
-	double *temp_buffer  = new double[sp->n_channels * period_size]();
-
-	std::shared_lock<std::shared_mutex> lck(sp->sounds_lock);
-
-	for(int t=0; t<period_size; t++) {
-		double *current_sample_base = &temp_buffer[t * sp->n_channels];
+	for(size_t s_idx=0; s_idx<sp->sounds.size();) {
+		auto & item     = sp->sounds[s_idx];
+		bool   finished = false;
+
+		if (item.s) {
+			bool   muted  = item.s->get_mute();
+			float *stem_l = nullptr;
+			float *stem_r = nullptr;
+			if (stems && item.group >= 0 && item.group < sp->n_stems) {
+				stem_l = stems[item.group * 2 + 0];
+				stem_r = stems[item.group * 2 + 1];
+			}
 
-		for(size_t s_idx=0; s_idx<sp->sounds.size();) {
-			auto & item = sp->sounds[s_idx];
-			if (item.s) {
+			for(int t=0; t<period_size; t++) {
 				if (item.s->set_time(item.t * item.pitch)) {
-					sp->sounds.erase(sp->sounds.begin() + s_idx);
-					continue;
+					finished = true;
+					break;
 				}
 
-				if (item.s->get_mute() == false) {
-					size_t n_source_channels = item.s->get_n_channels();
+				if (!muted && (stem_l || stem_r)) {
+					double out[max_output_channels] { };
+					item.gains.apply(item.s->get_frame(sp->streamer, item.stream), out);
 
-					for(size_t ch=0; ch<n_source_channels; ch++) {
-						auto   rc    = item.s->get_sample(ch);
-						double value = rc.first * (ch ? item.volume_right : item.volume_left);
+					double *current_sample_base = &mix[t * sp->n_channels];
+					for(int c=0; c<sp->n_channels; c++)
+						current_sample_base[c] += out[c];
 
-						for(auto mapping : rc.second)
-							current_sample_base[mapping.first] += value * mapping.second;
-					}
+					if (stem_l)
+						stem_l[t] += out[0];
+					if (stem_r)
+						stem_r[t] += out[sp->n_channels >= 2 ? 1 : 0];
 				}
+				else if (!muted) {
+					item.gains.apply(item.s->get_frame(sp->streamer, item.stream), &mix[t * sp->n_channels]);
+				}
+
+				item.t++;
 			}
+		}
+		else {
+			item.t += period_size;
+		}
 
-			item.t++;
+		if (finished)
+			sp->remove_voice(s_idx);
+		else
 			s_idx++;
+	}
+}
+
+// live triggers that came in since the previous period start now
+static void start_live_triggers(sound_parameters *const sp, const uint64_t now_ns)
+{
+	uint64_t buffered_ns = uint64_t(sp->latency_frames) * 1000000000 / sp->sample_rate;
+
+	for(auto & queue: sp->live_queues) {
+		sound_parameters::live_trigger lt { };
+		while(queue->pop(&lt)) {
+			sound *s = sp->get_group_sample ? sp->get_group_sample(lt.group) : nullptr;
+			if (!s)
+				continue;
+
+			sound_parameters::queued_sound qs { };
+			qs.s     = s;
+			qs.t     = 0;
+			qs.pitch = 1.;
+			qs.group = lt.group;
+			qs.gains = s->get_gain_matrix();
+			for(size_t from=0; from<qs.gains.n_sources; from++)
+				qs.gains.scale(from, lt.velocity);
+
+			double base_note_f = midi_note_to_frequency(s->get_base_midi_note());
+			if (lt.note >= 0 && base_note_f > 0.)
+				qs.pitch = midi_note_to_frequency(lt.note) / base_note_f;
+
+			sp->add_voice(qs);
+
+			// it is heard after what the backend has buffered
+			sp->live_latency.add(now_ns + buffered_ns - lt.arrival_ns);
 		}
 	}
+}
 
+// global volume, agc, filters and saturation: 'in' to 'out' (both interleaved, may be the same buffer)
+static void process_master(sound_parameters *const sp, const double *const in, double *const out, const int period_size)
+{
 	sp->n_loud_checked += period_size;
 
+	sp->master.begin_period(period_size, sp->sample_rate);
+
+	// the same ones for the whole period; they are not freed before the next one
+	filter_butterworth *filter_lp = sp->filter_lp.load(std::memory_order_acquire);
+	filter_butterworth *filter_hp = sp->filter_hp.load(std::memory_order_acquire);
+
 	if (sp->agc_enabled) {
 		double *c_temp = new double[sp->n_channels];
 		for(int t=0; t<period_size; t++) {
-			double *current_sample_base_in  = &temp_buffer[t * sp->n_channels];
-			double *current_sample_base_out = &dest[t * sp->n_channels];
+			const double *current_sample_base_in  = &in [t * sp->n_channels];
+			double       *current_sample_base_out = &out[t * sp->n_channels];
+
+			double volume     = sp->master.next(parameter_store::p_volume);
+			double saturation = sp->master.next(parameter_store::p_saturation);
 
 			double gain = DBL_MAX;
 			for(int c=0; c<sp->n_channels; c++) {
-				c_temp[c] = current_sample_base_in[c] * sp->global_volume;
+				c_temp[c] = current_sample_base_in[c] * volume;
 				gain      = std::min(gain, sp->agc_instances[c]->calculate_gain(c_temp[c]));
 			}
 
 			for(int c=0; c<sp->n_channels; c++) {
 				double temp = std::clamp(c_temp[c] * gain, -1., 1.);
 
-				if (sp->filter_lp)
-					temp = sp->filter_lp->apply(temp);
-				if (sp->filter_hp)
-					temp = sp->filter_hp->apply(temp);
+				if (filter_lp)
+					temp = filter_lp->apply(temp);
+				if (filter_hp)
+					temp = filter_hp->apply(temp);
 
 				double sign = temp < 0 ? -1 : 1;
-				current_sample_base_out[c] = pow(fabs(temp), sp->sound_saturation) * sign;
+				current_sample_base_out[c] = pow(fabs(temp), saturation) * sign;
 			}
 		}
 		delete [] c_temp;
 	}
 	else {
 		for(int t=0; t<period_size; t++) {
-			double *current_sample_base_in  = &temp_buffer[t * sp->n_channels];
-			double *current_sample_base_out = &dest[t * sp->n_channels];
+			const double *current_sample_base_in  = &in [t * sp->n_channels];
+			double       *current_sample_base_out = &out[t * sp->n_channels];
+
+			double volume     = sp->master.next(parameter_store::p_volume);
+			double saturation = sp->master.next(parameter_store::p_saturation);
 
 			double too_loud = 0;
 			for(int c=0; c<sp->n_channels; c++) {
-				double temp = current_sample_base_in[c] * sp->global_volume;
+				double temp = current_sample_base_in[c] * volume;
 
 				if (temp < -1.)
 					temp = -1., too_loud = std::max(too_loud, fabs(temp));
 				else if (temp > 1.)
 					temp = 1.,  too_loud = std::max(too_loud, temp);
 
-				if (sp->filter_lp)
-					temp = sp->filter_lp->apply(temp);
-				if (sp->filter_hp)
-					temp = sp->filter_hp->apply(temp);
+				if (filter_lp)
+					temp = filter_lp->apply(temp);
+				if (filter_hp)
+					temp = filter_hp->apply(temp);
 
 				double sign = temp < 0 ? -1 : 1;
-				current_sample_base_out[c] = pow(fabs(temp), sp->sound_saturation) * sign;
+				current_sample_base_out[c] = pow(fabs(temp), saturation) * sign;
 			}
 
 			sp->too_loud_total += too_loud;
 			sp->too_loud_count++;
 		}
 	}
+}
 
-	delete [] temp_buffer;
-
-	buf->datas[0].chunk->offset = 0;
-	buf->datas[0].chunk->stride = stride;
-	buf->datas[0].chunk->size   = period_size * stride;
-	if (pw_stream_queue_buffer(sp->pw.stream, b))
-		printf("pw_stream_queue_buffer failed\n");
+// recording, scope and busyness/clipping statistics of the final output
+static void process_statistics(sound_parameters *const sp, const double *const dest, const int period_size, const uint64_t t)
+{
+	double latency = period_size * 1000000.0 / sp->sample_rate;
 
 	if (sp->record_handle) 
 		sf_writef_double(sp->record_handle, dest, period_size);
@@ -166,43 +211,87 @@ void on_process_audio(void *userdata)
 	}
 }
 
-sound_sample::sound_sample(const int sample_rate, const std::string & file_name) :
-	sound(sample_rate, sample_rate / 2),
+void render_audio(sound_parameters *const sp, double *const dest, const int period_size, float *const *const stems)
+{
+	uint64_t t           = get_us();
+
+	double  *temp_buffer = new double[sp->n_channels * period_size]();
+
+	std::shared_lock<std::shared_mutex> lck(sp->sounds_lock);
+
+	// inside the lock: sounds queued after this start in the next period
+	uint64_t now_ns   = get_ns_mono();
+	sp->render_ns     = now_ns;
+	sp->period_frames = period_size;
+
+	// the audio thread is the only one that changes 'sounds' while holding the lock shared
+	start_live_triggers(sp, now_ns);
+
+	mix_sounds(sp, temp_buffer, period_size, stems);
+
+	process_master(sp, temp_buffer, dest, period_size);
+
+	delete [] temp_buffer;
+
+	process_statistics(sp, dest, period_size, t);
+
+	sp->n_periods.fetch_add(1, std::memory_order_release);
+}
+
+sound_sample::sound_sample(const int sample_rate, const size_t n_outputs, const std::string & file_name) :
+	sound(sample_rate, sample_rate / 2, n_outputs),
 	file_name(file_name)
 {
 }
 
-sound_sample::sound_sample(const int sample_rate, const std::string & file_name, const std::vector<std::vector<double> > & sample_data, const unsigned sample_sample_rate) :
-	sound(sample_rate, sample_rate / 2),
+sound_sample::sound_sample(const int sample_rate, const size_t n_outputs, const std::string & file_name, std::shared_ptr<const sample_pcm> pcm) :
+	sound(sample_rate, sample_rate / 2, n_outputs),
 	file_name(file_name),
-	samples(sample_data),
-	sample_sample_rate(sample_sample_rate)
+	pcm(pcm)
 {
 }
 
 bool sound_sample::begin()
 {
-	if (samples.empty() == true) {
-		auto            rc = load_sample(file_name);
-		if (rc.has_value() == false) {
-			printf("Cannot access sample \"%s\" in cache\n", file_name.c_str());
+	if (!pcm) {
+		pcm = load_sample(file_name);
+		if (!pcm) {
+			printf("Cannot load sample \"%s\"\n", file_name.c_str());
 			return false;
 		}
-		samples            = *std::get<0>(rc.value());
-		sample_sample_rate =  std::get<1>(rc.value());
-		base_frequency     =  ceil(std::get<2>(rc.value()));
+		base_frequency     = ceil(pcm->loudest_frequency);
 	}
 	else {
-		base_frequency     = find_loudest_frequency(samples, sample_sample_rate);
+		base_frequency     = pcm->loudest_frequency;
+	}
+
+	streamed = should_stream(*pcm);
+	if (!streamed && !pcm->mapping && is_long_sample(pcm->n_frames, pcm->sample_rate))
+		printf("Sample \"%s\" is not streamed but kept in memory: only memory-mapped samples can be (not with -N, without $HOME or from a flac-compressed file)\n", file_name.c_str());
+
+	if (streamed) {
+		// only the start is needed right away; the rest is read while it plays
+		head_frames = get_stream_head_frames(*pcm);
+		keep_resident(pcm->frames, head_frames * pcm->n_channels * sizeof(double));
+		if (head_frames < pcm->n_frames)  // with -m the whole mapping would be locked as it is played
+			let_go(pcm->get_frame(head_frames), (pcm->n_frames - head_frames) * pcm->n_channels * sizeof(double));
+	}
+	else if (pcm->mapping) {
+		// file-backed (a .kaboem-file, the journal or ~/.cache/kaboem): with -P or -m it is locked, else the audio
+		// thread reads it from disk the first time it plays (and again whenever the kernel dropped the pages)
+		make_resident(pcm->frames, pcm->get_size_in_bytes());
+	}
+	else {
+		prefault(pcm->frames, pcm->get_size_in_bytes());
 	}
 
 	base_midi_note     = frequency_to_midi_note(base_frequency);
 	name               = midi_note_to_name(base_midi_note);
-	delta_t            = sample_sample_rate / double(sample_rate);
+	delta_t            = pcm->sample_rate / double(sample_rate);
 
-	input_output_matrix.resize(samples.at(0).size());
+	routing.n_sources  = std::min(pcm->n_channels, max_source_channels);
 
-	printf("Sample %s has %zu channel(s), is sampled at %u Hz and sounds like a %s (%.2f Hz)\n", file_name.c_str(), input_output_matrix.size(), sample_sample_rate, name.c_str(), base_frequency);
+	printf("Sample %s has %zu channel(s), is sampled at %u Hz and sounds like a %s (%.2f Hz)\n", file_name.c_str(), pcm->n_channels, pcm->sample_rate, name.c_str(), base_frequency);
 
 	return true;
 }
@@ -212,13 +301,27 @@ std::string sound_sample::get_name() const
 	return name;
 }
 
-std::pair<double, std::map<int, double> > sound_sample::get_sample(const size_t channel_nr)
+size_t sound_sample::get_offset() const
 {
+	const size_t n_frames = pcm->n_frames;
+
 	double use_t = t;
 	if (use_t < 0)
-		use_t += ceil(fabs(use_t) / samples.size()) * samples.size();
+		use_t += ceil(fabs(use_t) / n_frames) * n_frames;
 
-	size_t offset = fmod(use_t, samples.size());
+	return fmod(use_t, n_frames);
+}
+
+const double * sound_sample::get_frame()
+{
+	return pcm->get_frame(get_offset());
+}
+
+const double * sound_sample::get_frame(sample_streamer *const streamer, const int stream)
+{
+	size_t offset = get_offset();
+	if (!streamed || offset < head_frames || !streamer)
+		return pcm->get_frame(offset);
 
-	return { samples.at(offset).at(channel_nr), input_output_matrix[channel_nr] };
+	return streamer->get_frame(stream, offset);
 }
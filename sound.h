@@ -1,11 +1,13 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstring>
-#include <map>
+#include <functional>
 #include <math.h>
+#include <memory>
 #include <optional>
 #include <set>
 #include <shared_mutex>
@@ -15,26 +17,79 @@
 
 #include "agc.h"
 #include "filter.h"
-#include "pipewire-audio.h"
+#include "latency.h"
+#include "parameters.h"
+#include "ringbuffer.h"
+#include "sample.h"
+#include "sample-streamer.h"
 
 
 double f_to_delta_t(const double frequency, const int sample_rate);
 
-class sound_control
+constexpr const size_t max_source_channels = 8;
+constexpr const size_t max_output_channels = 8;  // up to 7.1
+
+// routing of the channels of a sound to the output channels: source channels x output channels
+struct gain_matrix
 {
-public:
-	// name
-	enum { cm_continuous_controller } cm_mode;
-	uint8_t cm_index;  // midi index (for 0xb0: data-1)
-	int index;  // internal index
-	std::string name;
-	// how to transform a value
-	double divide_by;
-	double add;
-	// last transformed value
-	double current_setting;
+	size_t   n_sources { 0 };
+	size_t   n_outputs { 0 };
+	uint64_t routed    { 0 };  // bit (from * max_output_channels + to) is set when from is mapped on to
+	double   gains[max_source_channels * max_output_channels] { };
+
+	double get(const size_t from, const size_t to) const
+	{
+		return gains[from * max_output_channels + to];
+	}
+
+	void set(const size_t from, const size_t to, const double volume)
+	{
+		gains [from * max_output_channels + to] = volume;
+		routed |= uint64_t(1) << (from * max_output_channels + to);
+	}
+
+	void clear(const size_t from, const size_t to)
+	{
+		gains [from * max_output_channels + to] = 0.;
+		routed &= ~(uint64_t(1) << (from * max_output_channels + to));
+	}
+
+	bool is_routed(const size_t from, const size_t to) const
+	{
+		return routed & (uint64_t(1) << (from * max_output_channels + to));
+	}
+
+	// scale all gains of one source channel (e.g. for the per-step volume of a pattern)
+	void scale(const size_t from, const double factor)
+	{
+		for(size_t to=0; to<n_outputs; to++)
+			gains[from * max_output_channels + to] *= factor;
+	}
+
+	// out[to] += sum(frame[from] * gain[from][to])
+	void apply(const double *const frame, double *const out) const
+	{
+		for(size_t from=0; from<n_sources; from++) {
+			const double  value = frame[from];
+			const double *row   = &gains[from * max_output_channels];
+			for(size_t to=0; to<n_outputs; to++)
+				out[to] += value * row[to];
+		}
+	}
 };
 
+// the side of an output channel in the layout of the audio backends (as WAVE_FORMAT_EXTENSIBLE: FL FR, quad
+// FL FR RL RR, 5.1 FL FR FC LFE RL RR, 7.1 adds SL SR): 0 left, 1 right, -1 neither (FC, LFE)
+inline int output_side(const size_t n_outputs, const size_t to)
+{
+	if (n_outputs == 6 || n_outputs == 8) {
+		if (to == 2 || to == 3)
+			return -1;
+	}
+
+	return to & 1;
+}
+
 class sound
 {
 protected:
@@ -50,16 +105,18 @@ protected:
 
 	bool   muted       { false };
 
-	// input channel, { output channel, volume }
-	std::vector<std::map<int, double> > input_output_matrix;
+	gain_matrix routing;
 
 	std::vector<sound_control> controls;
 
 public:
-	sound(const int sample_rate, const double frequency) :
+	std::atomic_int n_voices { 0 };  // queued sounds that play it; it is not freed before that is 0
+
+	sound(const int sample_rate, const double frequency, const size_t n_outputs) :
 		sample_rate(sample_rate),
 		frequency(frequency)
 	{
+		routing.n_outputs = std::min(n_outputs, max_output_channels);
 	}
 
 	virtual std::vector<sound_control> get_controls()
@@ -76,16 +133,34 @@ public:
 
 	void add_mapping(const int from, const int to, const double volume)
 	{
-		// note that 'from' is ignored here as this object has only 1 generator
-		input_output_matrix[from].insert({ to, volume });
+		if (size_t(from) < routing.n_sources && size_t(to) < routing.n_outputs)
+			routing.set(from, to, volume);
 	}
 
+	// left and right go to the outputs on that side (e.g. a stereo sample on a quad setup: L -> FL & RL,
+	// R -> FR & RR); FC and LFE only get something from a sample with the same channel layout as the output
+	void add_default_mapping(const double volume_left, const double volume_right)
+	{
+		for(size_t to=0; to<routing.n_outputs; to++) {
+			const int side = output_side(routing.n_outputs, to);
+
+			if (routing.n_sources >= routing.n_outputs)
+				add_mapping(to, to, side == 0 ? volume_left : side == 1 ? volume_right : (volume_left + volume_right) / 2);
+			else if (side >= 0)
+				add_mapping(side % routing.n_sources, to, side ? volume_right : volume_left);
+		}
+	}
+
+	// 'to' selects a side: 0 is left (FL, RL, SL), 1 is right (FR, RR, SR)
 	double get_mapping_target_volume(const int to)
 	{
-		for(auto & mapping: input_output_matrix) {
-			auto it = mapping.find(to);
-			if (it != mapping.end())
-				return it->second;
+		for(size_t o=0; o<routing.n_outputs; o++) {
+			if (output_side(routing.n_outputs, o) != to)
+				continue;
+			for(size_t from=0; from<routing.n_sources; from++) {
+				if (routing.is_routed(from, o))
+					return routing.get(from, o);
+			}
 		}
 
 		return 0.1;
@@ -93,7 +168,8 @@ public:
 
 	void remove_mapping(const int from, const int to)
 	{
-		input_output_matrix[from].erase(to);
+		if (size_t(from) < routing.n_sources && size_t(to) < routing.n_outputs)
+			routing.clear(from, to);
 	}
 
 	void set_pitch_bend(const double pb)
@@ -108,25 +184,28 @@ public:
 
 	void set_volume(const int from, const int to, const double v)
 	{
-		input_output_matrix[from][to] = v;
+		add_mapping(from, to, v);
 	}
 
 	void set_mapping_target_volume(const int to, const double volume)
 	{
-		for(auto & mapping: input_output_matrix) {
-			auto it = mapping.find(to);
-			if (it != mapping.end()) {
-				it->second = volume;
-				break;
+		for(size_t o=0; o<routing.n_outputs; o++) {
+			if (output_side(routing.n_outputs, o) != to)
+				continue;
+			for(size_t from=0; from<routing.n_sources; from++) {
+				if (routing.is_routed(from, o))
+					routing.set(from, o, volume);
 			}
 		}
 	}
 
 	void set_volume(const double v)
 	{
-		for(size_t from=0; from<input_output_matrix.size(); from++) {
-			for(auto & to: input_output_matrix.at(from))
-				to.second = v;
+		for(size_t from=0; from<routing.n_sources; from++) {
+			for(size_t to=0; to<routing.n_outputs; to++) {
+				if (routing.is_routed(from, to))
+					routing.set(from, to, v);
+			}
 		}
 	}
 
@@ -135,10 +214,12 @@ public:
 		double v = 0;
 		int n = 0;
 
-		for(size_t from=0; from<input_output_matrix.size(); from++) {
-			for(auto & to: input_output_matrix.at(from)) {
-				v += to.second;
-				n++;
+		for(size_t from=0; from<routing.n_sources; from++) {
+			for(size_t to=0; to<routing.n_outputs; to++) {
+				if (routing.is_routed(from, to)) {
+					v += routing.get(from, to);
+					n++;
+				}
 			}
 		}
 
@@ -147,13 +228,28 @@ public:
 
 	double get_volume(const int from, const int to)
 	{
-		return input_output_matrix[from][to];
+		return routing.get(from, to);
+	}
+
+	const gain_matrix & get_gain_matrix() const
+	{
+		return routing;
 	}
 
 	virtual size_t get_n_channels() = 0;
 
-	// sample, output-channels
-	virtual std::pair<double, std::map<int, double> > get_sample(const size_t channel_nr) = 0;
+	// one sample for each source channel at the current time
+	virtual const double * get_frame() = 0;
+	// for a voice that may read from a stream (see sample_streamer)
+	virtual const double * get_frame(sample_streamer *const streamer, const int stream)
+	{
+		return get_frame();
+	}
+	// the data to stream for voices of this sound, nullptr when it is in memory
+	virtual const std::shared_ptr<const sample_pcm> * get_streamed_pcm() const
+	{
+		return nullptr;
+	}
 
 	virtual bool set_time(const uint64_t t_in)
 	{
@@ -180,37 +276,43 @@ class sound_sample : public sound
 {
 private:
 	std::string                       file_name;
-	std::vector<std::vector<double> > samples;
-	unsigned                          sample_sample_rate { 0  };
+	std::shared_ptr<const sample_pcm> pcm;  // can be shared with other sound_samples
 	double                            base_frequency     { 0. };
 	int                               base_midi_note     { 0  };
 	std::string                       name;
+	bool                              streamed           { false };
+	size_t                            head_frames        { 0  };  // in memory when streamed
+
+	size_t get_offset() const;
 
 public:
-	sound_sample(const int sample_rate, const std::string & file_name);
-	sound_sample(const int sample_rate, const std::string & file_name, const std::vector<std::vector<double> > & sample_data, const unsigned sample_sample_rate);
+	sound_sample(const int sample_rate, const size_t n_outputs, const std::string & file_name);
+	sound_sample(const int sample_rate, const size_t n_outputs, const std::string & file_name, std::shared_ptr<const sample_pcm> pcm);
 	virtual ~sound_sample() { }
 
 	bool begin();
 
 	size_t get_n_channels() override
 	{
-		return samples.at(0).size();
+		return pcm->n_channels;
 	}
 
-	const std::vector<std::vector<double> > & get_raw() const { return samples; }
-	unsigned get_sample_rate() const { return sample_sample_rate; }
+	const std::shared_ptr<const sample_pcm> & get_pcm() const { return pcm; }
+	unsigned get_sample_rate() const { return pcm->sample_rate; }
 
-	std::pair<double, std::map<int, double> > get_sample(const size_t channel_nr) override;
+	const double * get_frame() override;
+	const double * get_frame(sample_streamer *const streamer, const int stream) override;
+	const std::shared_ptr<const sample_pcm> * get_streamed_pcm() const override { return streamed ? &pcm : nullptr; }
 
 	std::string get_name() const override;
+	std::string get_file_name() const { return file_name; }
 	double      get_base_frequency() const override { return base_frequency; }
 	int         get_base_midi_note() const override { return base_midi_note; }
 
 	bool set_time(const uint64_t t_in) override
 	{
 		sound::set_time(t_in);
-		return t >= samples.size();
+		return t >= pcm->n_frames;
 	}
 };
 
@@ -222,34 +324,80 @@ public:
 		n_channels(n_channels) {
 		for(int i=0; i<n_channels; i++)
 			agc_instances.push_back(new agc(-10.0, 4.0, 10.0, 100.0, sample_rate));
+		for(int i=0; i<n_live_sources; i++)
+			live_queues.push_back(new ringbuffer<live_trigger>(64));
+		sounds.reserve(max_voices);
 	}
 
 	virtual ~sound_parameters() {
 		for(auto & a: agc_instances)
 			delete a;
+		for(auto & q: live_queues)
+			delete q;
 	}
 
 	int                  sample_rate     { 0       };
 	int                  n_channels      { 0       };
+	int                  n_stems         { 0       };  // > 0: (pipewire) ports per pattern group instead of one stream
+	// 75: audio-CD had chunks of 1/75th of a second. this gives a latency of around 13.1 ms
+	int                  period_size     { sample_rate / 75 };
 	std::vector<agc *>   agc_instances;
 	bool                 agc_enabled     { false   };
 
-	pipewire_data_audio  pw;
-
 	std::shared_mutex    sounds_lock;
 	struct queued_sound {
-		sound *s;
-		double t;
-		double pitch;
-		double volume_left;
-		double volume_right;
+		sound      *s;
+		double      t;
+		double      pitch;
+		gain_matrix gains;  // routing of the sound with the volume of the step applied
+		int         group { -1 };  // pattern group that triggered it (for the stem outputs)
+		int         stream { -1 };  // of the sample_streamer, for a long sample
 	};
+	// add_voice() is also invoked by the audio thread, so 'sounds' never grows beyond what is reserved and
+	// nothing in it is moved around: a voice that is removed is replaced by the last one (so the order is not kept)
+	static constexpr const size_t max_voices = 256;
 	std::vector<queued_sound> sounds;
+	size_t                    steal_next { 0 };  // when all voices are in use, a new one replaces this one (round robin)
+	// these keep the n_voices of the sounds right; the caller must hold sounds_lock (shared only on the audio thread)
+	// and start and stop the streams of long samples
+	void add_voice(queued_sound qs)
+	{
+		if (sounds.size() >= max_voices)
+			remove_voice(steal_next++ % max_voices);
+
+		auto streamed_pcm = qs.s->get_streamed_pcm();
+		if (streamed_pcm && streamer)
+			qs.stream = streamer->start(*streamed_pcm);
+
+		qs.s->n_voices++;
+		sounds.push_back(qs);
+	}
+	void remove_voice(const size_t nr)
+	{
+		if (sounds[nr].stream >= 0)
+			streamer->stop(sounds[nr].stream);
+		sounds[nr].s->n_voices--;
+		if (nr + 1 < sounds.size())
+			sounds[nr] = sounds.back();
+		sounds.pop_back();
+	}
+	void clear_voices()
+	{
+		for(auto & qs: sounds) {
+			if (qs.stream >= 0)
+				streamer->stop(qs.stream);
+			qs.s->n_voices--;
+		}
+		sounds.clear();
+	}
+	sample_streamer     *streamer         { nullptr };
+
 	SNDFILE             *record_handle    { nullptr };
-	filter_butterworth  *filter_lp        { nullptr };
-	filter_butterworth  *filter_hp        { nullptr };
-	double               global_volume    { 1.      };
-	double               sound_saturation { 1.      };
+	// replaced (not changed) while the audio thread runs; the old one goes to the reclaimer
+	std::atomic<filter_butterworth *> filter_lp { nullptr };
+	std::atomic<filter_butterworth *> filter_hp { nullptr };
+	std::atomic_uint64_t n_periods        { 0       };  // mixed by the audio thread so far
+	parameter_store      master;  // volume and saturation
 
 	std::vector<double>  scope;
 	int                  scope_t          { 0       };
@@ -262,4 +410,29 @@ public:
 	int                  n_busyness       { 0       };
 	int                  t_busyness       { 0       };
 	int                  busyness         { 0       };
+
+	// audio clock: what is queued now is heard 'period_frames' + 'latency_frames' after 'render_ns'
+	std::atomic_uint64_t render_ns        { 0       };  // CLOCK_MONOTONIC when the last period was mixed
+	std::atomic_int      period_frames    { 0       };
+	std::atomic_int      latency_frames   { 0       };  // what the audio backend buffers after that (set by it)
+	std::atomic_bool     latency_measured { false   };  // false: latency_frames is what the backend expects, not what it measured
+
+	// live play (midi notes, taps): skips the sequencer, these are started at the beginning of the next period
+	// one lock-free queue per thread that produces them
+	enum { live_midi, live_touch, n_live_sources };
+	struct live_trigger {
+		int      group;
+		int      note;        // midi note to play the sample at, -1 for as it is
+		double   velocity;
+		uint64_t arrival_ns;  // CLOCK_MONOTONIC, when the input came in
+	};
+	std::vector<ringbuffer<live_trigger> *> live_queues;
+	// the sample of a pattern group; invoked by the audio thread while holding sounds_lock, so it is set
+	// with it held exclusively
+	std::function<sound *(const int group)> get_group_sample;
+	latency_statistics   live_latency;  // input to sound
 };
+
+// mix everything that is playing into 'dest' (period_size frames of n_channels, interleaved)
+// 'stems' (optional): a left and right buffer for each pattern group, these are added to
+void render_audio(sound_parameters *const sp, double *const dest, const int period_size, float *const *const stems = nullptr);
@@ -15,3 +15,17 @@ uint64_t get_us()
 	clock_gettime(CLOCK_REALTIME, &ts);
 	return uint64_t(ts.tv_sec) * uint64_t(1000000) + uint64_t(ts.tv_nsec / 1000);
 }
+
+uint64_t get_ns()
+{
+	timespec ts { };
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return uint64_t(ts.tv_sec) * uint64_t(1000000000) + uint64_t(ts.tv_nsec);
+}
+
+uint64_t get_ns_mono()
+{
+	timespec ts { };
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * uint64_t(1000000000) + uint64_t(ts.tv_nsec);
+}
@@ -3,3 +3,6 @@
 
 uint64_t get_ms();
 uint64_t get_us();
+uint64_t get_ns();
+// monotonic, for measuring durations
+uint64_t get_ns_mono();
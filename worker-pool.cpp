@@ -0,0 +1,64 @@
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "worker-pool.h"
+
+
+worker_pool::worker_pool(const size_t n_threads)
+{
+	size_t n = n_threads ? n_threads : std::max(1u, std::thread::hardware_concurrency());
+	for(size_t i=0; i<n; i++)
+		threads.push_back(new std::thread(&worker_pool::run, this));
+}
+
+worker_pool::~worker_pool()
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		stop_flag = true;
+		cv.notify_all();
+	}
+
+	for(auto & th: threads) {
+		th->join();
+		delete th;
+	}
+}
+
+void worker_pool::queue(std::function<void()> && job)
+{
+	std::unique_lock<std::mutex> lck(lock);
+	jobs.push_back(std::move(job));
+	cv.notify_one();
+}
+
+void worker_pool::wait()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	cv_idle.wait(lck, [this] { return jobs.empty() && n_busy == 0; });
+}
+
+void worker_pool::run()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(;;) {
+		cv.wait(lck, [this] { return stop_flag || jobs.empty() == false; });
+		if (jobs.empty())
+			break;
+
+		auto job = std::move(jobs.front());
+		jobs.pop_front();
+		n_busy++;
+		lck.unlock();
+
+		job();
+
+		lck.lock();
+		n_busy--;
+		if (jobs.empty() && n_busy == 0)
+			cv_idle.notify_all();
+	}
+}
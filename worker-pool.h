@@ -0,0 +1,35 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// runs jobs on a number of threads (by default one per cpu core)
+class worker_pool
+{
+private:
+	std::vector<std::thread *>          threads;
+	std::mutex                          lock;
+	std::condition_variable             cv;
+	std::condition_variable             cv_idle;
+	std::deque<std::function<void()> >  jobs;
+	size_t                              n_busy    { 0     };
+	bool                                stop_flag { false };
+
+	void run();
+
+public:
+	worker_pool(const size_t n_threads = 0);
+	virtual ~worker_pool();  // finishes what was queued
+
+	void queue(std::function<void()> && job);
+	// until every job that was queued is done
+	void wait();
+
+	size_t get_n_threads() const { return threads.size(); }
+};